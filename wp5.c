@@ -2,24 +2,51 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <signal.h>
 #include <regex.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
 
 #include "wp5lib.h"
 
 #define INPUT_MAX_LENGTH        32
 
-#define DOWNLOAD_BUFFER_SIZE    1024
-
 #define IN_USE_SCRIPT_NAME      "schedule"
 
+#define BOARD_RELOAD_TIMEOUT_MS 30000
+#define ADMIN_TIMEOUT_MS        10000   // Timeout for administrative commands that do not reload firmware
+
+#define TOP_INTERVAL_MS         200     // Redraw interval of "wp5 top"
+#define TOP_STALE_MS            1500    // Read registers directly if wp5d has not published for this long
+#define TOP_HISTORY             40      // Samples shown in sparklines
+#define TOP_LINES               11      // Lines in the "wp5 top" screen
+
+#define CONFIG_FILE_VERSION     1       // Version of the "wp5 config export" file format
+#define CONFIG_REG_COUNT        (I2C_CONF_SYS_CLOCK_MHZ - I2C_CONF_FIRST + 1)   // Registers 0x10~0x36 in configuration file
+
+#define STREAM_DEFAULT_RATE     10      // Samples per second of "wp5 stream"
+#define STREAM_RING_SLOTS       4096    // Samples buffered between sampling and writing of "wp5 stream"
+#define STREAM_BIN_MAGIC        "WP5STRM1"  // Header of binary "wp5 stream" output
+
 
 bool running = true;
 
 int model = MODEL_UNKNOWN;
 
+bool replaying = false;
+
+double stream_rate = STREAM_DEFAULT_RATE;
+
+const char *stream_format = "csv";
+
+RegisterSnapshot snapshot;      // Registers read once for each redraw of the info bar and main menu
+
 
 /**
  * Signal handler
@@ -28,6 +55,14 @@ void handle_signal(int signum) {
     
     running = false;
     
+    trace_end("wp5 session");
+    
+    if (replaying) {
+        int matched, mismatched, skipped, remaining;
+        get_replay_stats(&matched, &mismatched, &skipped, &remaining);
+        printf("\nReplay: %d matched, %d mismatched, %d skipped, %d remaining.", matched, mismatched, skipped, remaining);
+    }
+    
     printf("\nExit now.\n");
     
     exit(0);
@@ -151,7 +186,7 @@ static char *read_line(char *buffer, size_t size) {
 
 
 /**
- * Display the information bar
+ * Display the information bar, after taking the register snapshot that the main menu also renders from
  */
 void do_info_bar(void) {
     int model = get_wittypi_model();
@@ -159,26 +194,31 @@ void do_info_bar(void) {
         printf("Can not detect Witty Pi, exiting...\n");
 		exit(0);
     }
+    bool has_snapshot = get_register_snapshot(&snapshot);
+    if (!has_snapshot) {
+        memset(&snapshot, 0, sizeof(snapshot));
+    }
 
     printf("--------------------------------------------------------------------------------\n");
     printf("  Model: %s", wittypi_models[model]);
-    float celsius = get_temperature();
+    float celsius = has_snapshot ? snapshot_value(&snapshot, REG_TEMPERATURE) : -1000.0f;
     float fahrenheit = celsius_to_fahrenheit(celsius);
 	printf("   Temperature: %.3f°C / %.3f°F\n", celsius, fahrenheit);
-    int mode = get_power_mode();
+    int mode = has_snapshot ? (int)snapshot_value(&snapshot, REG_POWER_MODE) : -1;
     if (mode == 0) {
-        printf("  V-USB: %.3fV", get_vusb());
+        printf("  V-USB: %.3fV", snapshot_value(&snapshot, REG_VUSB));
     } else if (mode == 1) {
-        printf("  V-IN: %.3fV", get_vin());
+        printf("  V-IN: %.3fV", snapshot_value(&snapshot, REG_VIN));
     }
-    printf("   V-OUT: %.3fV", get_vout());
-    printf("   I-OUT: %.3fA\n", get_iout());
+    printf("   V-OUT: %.3fV", snapshot_value(&snapshot, REG_VOUT));
+    printf("   I-OUT: %.3fA\n", snapshot_value(&snapshot, REG_IOUT));
 	
 	DateTime sys_dt, rtc_dt;
 	if (get_system_time(&sys_dt)) {
 		printf("  SYS Time: %4d-%02d-%02d %02d:%02d:%02d\n", sys_dt.year, sys_dt.month, sys_dt.day, sys_dt.hour, sys_dt.min, sys_dt.sec);
 	}
-	if (get_rtc_time(&rtc_dt)) {
+	if (has_snapshot) {
+		snapshot_rtc_time(&snapshot, &rtc_dt);
 		printf("  RTC Time: %4d-%02d-%02d %02d:%02d:%02d\n", rtc_dt.year, rtc_dt.month, rtc_dt.day, rtc_dt.hour, rtc_dt.min, rtc_dt.sec);
 	}
     printf("--------------------------------------------------------------------------------\n");
@@ -362,35 +402,15 @@ void schedule_shutdown(void) {
 }
 
 
-// Print file list, or copy selected file name to output buffer
-int list_or_select_file(const char* input, int select, char* output, int output_len) {
-    const char* start = input + 1;
-    const char* current = start;
-    int file_count = 0;
-    
-    while (*current && *current != '>') {
-        const char* filename_start = current;
-        
-        while (*current && *current != '|' && *current != '>') {
-            current++;
-        }
-        
-        if (*current != '>' && strncmp(filename_start, IN_USE_SCRIPT_NAME, strlen(IN_USE_SCRIPT_NAME)) != 0) {
-            file_count ++;
-            int len = current - filename_start;
-            if (select <= 0) {
-                printf("  [%d] %.*s\n", file_count, len, filename_start);
-            } else if (select == file_count && output && output_len) {
-                snprintf(output, output_len, "%.*s", len, filename_start);
-                return select;
-            }
-        }
-        
-        if (*current == '|') {
-            current++;
-        }
+// Print a schedule script as soon as it is listed, leave out the one in use
+static bool print_script_entry(const char *name, int index, void *arg) {
+    (void)arg;
+    if (strncmp(name, IN_USE_SCRIPT_NAME, strlen(IN_USE_SCRIPT_NAME)) == 0) {
+        return false;
     }
-    return file_count;
+    printf("  [%d] %s\n", index + 1, name);
+    fflush(stdout);
+    return true;
 }
 
 
@@ -420,39 +440,51 @@ bool pack_filename(char* filename, char* output) {
 }
 
 
+// Run administrative command and wait for its completion, tell user if it is not done
+static bool admin_command(uint16_t psw_cmd, int timeout_ms) {
+    int elapsed_ms;
+    AdminResult result = run_admin_command_wait(psw_cmd, timeout_ms, &elapsed_ms);
+    if (result != ADMIN_DONE) {
+        printf("  Command %s after %d ms.\n", result == ADMIN_TIMEOUT ? "timed out" : "failed", elapsed_ms);
+    }
+    return result == ADMIN_DONE;
+}
+
+
 /**
  * Choose a schedule script
  */
 void choose_schedule_script(void) {
-    i2c_set(-1, I2C_ADMIN_DIR, DIRECTORY_SCHEDULE);
-    run_admin_command(I2C_ADMIN_PWD_CMD_LIST_FILES);
-    
-    char buf[DOWNLOAD_BUFFER_SIZE];
-    int len = i2c_read_stream_util(-1, I2C_ADMIN_DOWNLOAD, buf, DOWNLOAD_BUFFER_SIZE - 1, '>');
-    buf[len] = '\0';
-    
+    FileListing list;
+    init_file_listing(&list);
     printf("  Available schedule scripts on disk:\n");
-    int file_count = list_or_select_file(buf, -1, NULL, -1);
+    if (!download_file_listing(DIRECTORY_SCHEDULE, &list, print_script_entry, NULL)) {
+        printf("  Failed to list schedule scripts.\n");
+        free_file_listing(&list);
+        return;
+    }
     int select = 0;
-    if (request_input_number("Please choose a schedule script: ", 1, file_count, &select, 2)) {
-        list_or_select_file(buf, select, buf, DOWNLOAD_BUFFER_SIZE);
-        printf("  You have chosen %s\n", buf);
+    if (request_input_number("Please choose a schedule script: ", 1, list.count, &select, 2)) {
+        const char *name = get_file_listing_entry(&list, select - 1);
+        printf("  You have chosen %s\n", name);
         printf("  Please wait while processing...");
         fflush(stdout);
 
-        pack_filename(buf, buf);
-        i2c_set(-1, I2C_ADMIN_DIR, DIRECTORY_SCHEDULE);
-        i2c_write_stream_util(-1, I2C_ADMIN_UPLOAD, buf, DOWNLOAD_BUFFER_SIZE, '>');
-        run_admin_command(I2C_ADMIN_PWD_CMD_CHOOSE_SCRIPT);
-        
-        sleep(1);
-        int model = MODEL_UNKNOWN;
-        while (model == MODEL_UNKNOWN) {
-            sleep(1);
-            model = get_wittypi_model();
+        size_t packet_len = strlen(name) + 4;
+        char *packet = malloc(packet_len + 1);
+        if (packet && pack_filename((char *)name, packet)) {
+            i2c_set(-1, I2C_ADMIN_DIR, DIRECTORY_SCHEDULE);
+            i2c_write_stream_util(-1, I2C_ADMIN_UPLOAD, (uint8_t *)packet, packet_len, PACKET_END);
+            int elapsed_ms;
+            if (run_admin_command_wait(I2C_ADMIN_PWD_CMD_CHOOSE_SCRIPT, BOARD_RELOAD_TIMEOUT_MS, &elapsed_ms) == ADMIN_DONE) {
+                printf("done in %d ms :)\n", elapsed_ms);
+            } else {
+                printf("timeout :(\n");
+            }
         }
-        printf("done :)\n");
+        free(packet);
     }
+    free_file_listing(&list);
 }
 
 
@@ -637,9 +669,12 @@ void configure_over_temperature_action(void) {
             return;
         }
         if (is_valid_integer_in_range(input, -30, 80, &ot)) {
-			bool success = true;
-			success &= i2c_set(-1, I2C_CONF_OVER_TEMP_ACTION, oa);
-			success &= i2c_set(-1, I2C_CONF_OVER_TEMP_POINT, (uint8_t)ot);
+            // Set point goes first, so the action never runs with a stale one
+            RegisterTransaction txn;
+            reg_txn_begin(&txn);
+            reg_txn_stage(&txn, I2C_CONF_OVER_TEMP_POINT, (uint8_t)ot);
+            reg_txn_stage(&txn, I2C_CONF_OVER_TEMP_ACTION, oa);
+            bool success = reg_txn_commit(&txn) == TXN_COMMITTED;
             if (success) {
                 char action_msg[64] = {0};
 				temperature_action_info(false, oa, ot, action_msg, sizeof(action_msg));
@@ -682,9 +717,12 @@ void configure_below_temperature_action(void) {
             return;
         }
         if (is_valid_integer_in_range(input, -30, 80, &bt)) {
-			bool success = true;
-			success &= i2c_set(-1, I2C_CONF_BELOW_TEMP_ACTION, ba);
-			success &= i2c_set(-1, I2C_CONF_BELOW_TEMP_POINT, (uint8_t)bt);
+            // Set point goes first, so the action never runs with a stale one
+            RegisterTransaction txn;
+            reg_txn_begin(&txn);
+            reg_txn_stage(&txn, I2C_CONF_BELOW_TEMP_POINT, (uint8_t)bt);
+            reg_txn_stage(&txn, I2C_CONF_BELOW_TEMP_ACTION, ba);
+            bool success = reg_txn_commit(&txn) == TXN_COMMITTED;
             if (success) {
                 char action_msg[64] = {0};
 				temperature_action_info(true, ba, bt, action_msg, sizeof(action_msg));
@@ -711,13 +749,22 @@ void configure_below_temperature_action(void) {
 void other_settings(void) {
     printf("  Other Settings:\n");
     
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
+    static const RegisterId ids[] = {
+        REG_CONF_DEFAULT_ON_DELAY, REG_CONF_POWER_CUT_DELAY, REG_CONF_PULSE_INTERVAL, REG_CONF_BLINK_LED,
+        REG_CONF_DUMMY_LOAD, REG_CONF_ADJ_VUSB, REG_CONF_ADJ_VIN, REG_CONF_ADJ_VOUT, REG_CONF_ADJ_IOUT,
+        REG_CONF_PS_PRIORITY, REG_CONF_WATCHDOG, REG_CONF_LOG_TO_FILE,
+    };
+    double values[sizeof(ids) / sizeof(ids[0])];
+    if (!get_register_values(ids, sizeof(ids) / sizeof(ids[0]), values)) {
         return;
     }
+    char adj[4][16];
+    for (int i = 0; i < 4; i ++) {
+        format_register_value(ids[5 + i], values[5 + i], adj[i], sizeof(adj[i]));
+    }
     
     // [1] Default state when powered
-    uint8_t dod = i2c_get(i2c_dev, I2C_CONF_DEFAULT_ON_DELAY);
+    uint8_t dod = (uint8_t)values[0];
     printf("  [ 1] Default state when powered");
     if (dod == 255) {
         printf(" [default OFF]\n");
@@ -726,47 +773,34 @@ void other_settings(void) {
     }
     
     // [2] Power cut delay after shutdown
-    uint8_t pcd = i2c_get(i2c_dev, I2C_CONF_POWER_CUT_DELAY);
-    printf("  [ 2] Power cut delay after shutdown [%d Seconds]\n", pcd);
+    printf("  [ 2] Power cut delay after shutdown [%d Seconds]\n", (int)values[1]);
     
     // [3] Pulsing interval during sleep
-    uint8_t pi = i2c_get(i2c_dev, I2C_CONF_PULSE_INTERVAL);
-    printf("  [ 3] Pulsing interval during sleep [%d Seconds]\n", pi);
+    printf("  [ 3] Pulsing interval during sleep [%d Seconds]\n", (int)values[2]);
     
     // [4] White LED pulse length
-    uint8_t led = i2c_get(i2c_dev, I2C_CONF_BLINK_LED);
-    printf("  [ 4] White LED pulse length [%d ms]\n", led);
+    printf("  [ 4] White LED pulse length [%d ms]\n", (int)values[3]);
     
     // [5] Dummy load pulse length
-    uint8_t dload = i2c_get(i2c_dev, I2C_CONF_DUMMY_LOAD);
-    printf("  [ 5] Dummy load pulse length [%d ms]\n", dload);
+    printf("  [ 5] Dummy load pulse length [%d ms]\n", (int)values[4]);
     
     // [6] V-USB adjustment
-    uint8_t vusbAdj = i2c_get(i2c_dev, I2C_CONF_ADJ_VUSB);
-    float vusbAdj_float = (float)(int8_t)vusbAdj / 100.0f;
-    printf("  [ 6] V-USB adjustment [%+.2fV]\n", vusbAdj_float);
+    printf("  [ 6] V-USB adjustment [%s]\n", adj[0]);
     
     // [7] V-IN adjustment
-    uint8_t vinAdj = i2c_get(i2c_dev, I2C_CONF_ADJ_VIN);
-    float vinAdj_float = (float)(int8_t)vinAdj / 100.0f;
-    printf("  [ 7] V-IN  adjustment [%+.2fV]\n", vinAdj_float);
+    printf("  [ 7] V-IN  adjustment [%s]\n", adj[1]);
     
     // [8] V-OUT adjustment
-    uint8_t voutAdj = i2c_get(i2c_dev, I2C_CONF_ADJ_VOUT);
-    float voutAdj_float = (float)(int8_t)voutAdj / 100.0f;
-    printf("  [ 8] V-OUT adjustment [%+.2fV]\n", voutAdj_float);
+    printf("  [ 8] V-OUT adjustment [%s]\n", adj[2]);
     
     // [9] I-OUT adjustment
-    uint8_t ioutAdj = i2c_get(i2c_dev, I2C_CONF_ADJ_IOUT);
-    float ioutAdj_float = (float)(int8_t)ioutAdj / 100.0f;
-    printf("  [ 9] I-OUT adjustment [%+.3fA]\n", ioutAdj_float);
+    printf("  [ 9] I-OUT adjustment [%s]\n", adj[3]);
 	
 	// [10] Power source priority
-    uint8_t psp = i2c_get(i2c_dev, I2C_CONF_PS_PRIORITY);
-    printf("  [10] Power source priority [%s first]\n", psp ? "V-IN" : "V-USB");
+    printf("  [10] Power source priority [%s first]\n", values[9] ? "V-IN" : "V-USB");
 	
 	// [11] Watchdog
-    uint8_t wdg = i2c_get(i2c_dev, I2C_CONF_WATCHDOG);
+    uint8_t wdg = (uint8_t)values[10];
 	if (wdg) {
 		printf("  [11] Watchdog [Enabled, allow %d missing heartbeats]\n", wdg);
 	} else {
@@ -774,14 +808,11 @@ void other_settings(void) {
 	}
 	
 	// [12] Log to file
-    uint8_t ltf = i2c_get(i2c_dev, I2C_CONF_LOG_TO_FILE);
-	printf("  [12] Log to file on Witty Pi [%s]\n", ltf ? "Yes" : "No");
+	printf("  [12] Log to file on Witty Pi [%s]\n", values[11] ? "Yes" : "No");
 	
 	// [13] Return to main menu
     printf("  [13] Return to main menu\n");
     
-    close_i2c_device(i2c_dev);
-    
     int optionCount = 13;
     
     printf("  Please input 1~%d: ", optionCount);
@@ -848,7 +879,7 @@ void other_settings(void) {
             break;
         case 6:	// V-USB adjustment
             if (request_input_number("Input the adjust value (in 0.01V) for measured V-USB (-127~127): ", -127, 127, &input, 2)) {
-				i2c_set(-1, I2C_CONF_ADJ_VUSB, input);
+				SET_REGISTER(CONF_ADJ_VUSB, (double)input / register_table[REG_CONF_ADJ_VUSB].scale);
 				printf("  V-USB adjust value is set to %+.2fV!\n", (float)input / 100.0f);
 			} else {
 				other_settings();
@@ -856,7 +887,7 @@ void other_settings(void) {
             break;
         case 7:	// V-IN adjustment
 			if (request_input_number("Input the adjust value (in 0.01V) for measured V-IN (-127~127): ", -127, 127, &input, 2)) {
-				i2c_set(-1, I2C_CONF_ADJ_VIN, input);
+				SET_REGISTER(CONF_ADJ_VIN, (double)input / register_table[REG_CONF_ADJ_VIN].scale);
 				printf("  V-IN adjust value is set to %+.2fV!\n", (float)input / 100.0f);
 			} else {
 				other_settings();
@@ -864,7 +895,7 @@ void other_settings(void) {
             break;
         case 8:	// V-OUT adjustment
 			if (request_input_number("Input the adjust value (in 0.01V) for measured V-OUT (-127~127): ", -127, 127, &input, 2)) {
-				i2c_set(-1, I2C_CONF_ADJ_VOUT, input);
+				SET_REGISTER(CONF_ADJ_VOUT, (double)input / register_table[REG_CONF_ADJ_VOUT].scale);
 				printf("  V-OUT adjust value is set to %+.2fV!\n", (float)input / 100.0f);
 			} else {
 				other_settings();
@@ -872,7 +903,7 @@ void other_settings(void) {
             break;
 		case 9:	// I-OUT adjustment
 			if (request_input_number("Input the adjust value (in 0.001A) for measured I-OUT (-127~127): ", -127, 127, &input, 2)) {
-				i2c_set(-1, I2C_CONF_ADJ_IOUT, input);
+				SET_REGISTER(CONF_ADJ_IOUT, (double)input / register_table[REG_CONF_ADJ_IOUT].scale);
 				printf("  I-OUT adjust value is set to %+.3fA!\n", (float)input / 1000.0f);
 			} else {
 				other_settings();
@@ -956,7 +987,7 @@ void reset_data(void) {
 			printf("  Scheduled shutdown time is cleared!\n");
             return;
 		case 3:	// Stop using schedule script
-			run_admin_command(I2C_ADMIN_PWD_CMD_PURGE_SCRIPT);
+			admin_command(I2C_ADMIN_PWD_CMD_PURGE_SCRIPT, ADMIN_TIMEOUT_MS);
 			return;
 		case 4:	// Clear low-voltage threshold
 			i2c_set(-1, I2C_CONF_LOW_VOLTAGE, 0);
@@ -975,13 +1006,14 @@ void reset_data(void) {
 			printf("  Below-temperature action is cleared!\n");
             return;
         case 8: // Reset all configuration values
-            run_admin_command(I2C_ADMIN_PWD_CMD_RESET_CONF);
-            printf("  All configuration values are reset!\n");
+            if (admin_command(I2C_ADMIN_PWD_CMD_RESET_CONF, ADMIN_TIMEOUT_MS)) {
+                printf("  All configuration values are reset!\n");
+            }
             return;
 		case 9: // Perform all actions above
 			clear_startup_time();
 			clear_shutdown_time();
-			run_admin_command(I2C_ADMIN_PWD_CMD_PURGE_SCRIPT);
+			admin_command(I2C_ADMIN_PWD_CMD_PURGE_SCRIPT, ADMIN_TIMEOUT_MS);
 			int i2c_dev = open_i2c_device();
 			if (i2c_dev >= 0) {
 				i2c_set(i2c_dev, I2C_CONF_LOW_VOLTAGE, 0);
@@ -990,8 +1022,9 @@ void reset_data(void) {
 				i2c_set(i2c_dev, I2C_CONF_BELOW_TEMP_ACTION, 0);
 				close_i2c_device(i2c_dev);
 			}
-			run_admin_command(I2C_ADMIN_PWD_CMD_RESET_CONF);
-			printf("  All cleared!\n");
+			if (admin_command(I2C_ADMIN_PWD_CMD_RESET_CONF, ADMIN_TIMEOUT_MS)) {
+				printf("  All cleared!\n");
+			}
 			return;
 		case 10: // Return to main menu
 			return;
@@ -1032,21 +1065,24 @@ void administrate(void) {
     
     switch (value) {
         case 1:	// Print product information in log
-			run_admin_command(I2C_ADMIN_PWD_CMD_PRINT_PRODUCT_INFO);
-			printf("  Product information is printed!\n\n");
+			if (admin_command(I2C_ADMIN_PWD_CMD_PRINT_PRODUCT_INFO, ADMIN_TIMEOUT_MS)) {
+				printf("  Product information is printed!\n\n");
+			}
             break;
         case 2:	// Format Witty Pi disk
 			if (user_confirm("All data on Witty Pi disk will be erased! Are you sure?", 2)) {
-				run_admin_command(I2C_ADMIN_PWD_CMD_FORMAT_DISK);
-				printf("  Witty Pi disk is formatted!\n\n");
+				if (admin_command(I2C_ADMIN_PWD_CMD_FORMAT_DISK, ADMIN_TIMEOUT_MS)) {
+					printf("  Witty Pi disk is formatted!\n\n");
+				}
 			} else {
 				printf("  Task is cancelled.\n\n");
 			}
             break;
 		case 3: // Reset RTC
 			if (user_confirm("Do you want to reset the RTC?", 2)) {
-				run_admin_command(I2C_ADMIN_PWD_CMD_RESET_RTC);
-				printf("  RTC is reset!\n\n");
+				if (admin_command(I2C_ADMIN_PWD_CMD_RESET_RTC, ADMIN_TIMEOUT_MS)) {
+					printf("  RTC is reset!\n\n");
+				}
 			} else {
 				printf("  Task is cancelled.\n\n");
 			}
@@ -1061,24 +1097,29 @@ void administrate(void) {
 				break;
 			}
 			if (value) {
-				run_admin_command(I2C_ADMIN_PWD_CMD_ENABLE_ID_EEPROM_WP);
-				printf("  ID EEPROM write protection is ON.\n\n");
+				if (admin_command(I2C_ADMIN_PWD_CMD_ENABLE_ID_EEPROM_WP, ADMIN_TIMEOUT_MS)) {
+					printf("  ID EEPROM write protection is ON.\n\n");
+				}
 			} else {
-				run_admin_command(I2C_ADMIN_PWD_CMD_DISABLE_ID_EEPROM_WP);
-				printf("  ID EEPROM write protection is OFF.\n\n");
+				if (admin_command(I2C_ADMIN_PWD_CMD_DISABLE_ID_EEPROM_WP, ADMIN_TIMEOUT_MS)) {
+					printf("  ID EEPROM write protection is OFF.\n\n");
+				}
 			}
 			break;
 		case 5: // Synchronize configuration to file
-			run_admin_command(I2C_ADMIN_PWD_CMD_SYNC_CONF);
-			printf("  Configuration is synchronized to file on Witty Pi.\n\n");
+			if (admin_command(I2C_ADMIN_PWD_CMD_SYNC_CONF, ADMIN_TIMEOUT_MS)) {
+				printf("  Configuration is synchronized to file on Witty Pi.\n\n");
+			}
 			break;
 		case 6: // Save log to file
-			run_admin_command(I2C_ADMIN_PWD_CMD_SAVE_LOG);
-			printf("  Log is saved to file on Witty Pi.\n\n");
+			if (admin_command(I2C_ADMIN_PWD_CMD_SAVE_LOG, ADMIN_TIMEOUT_MS)) {
+				printf("  Log is saved to file on Witty Pi.\n\n");
+			}
 			break;
 		case 7: // Load and generate schedule scripts
-			run_admin_command(I2C_ADMIN_PWD_CMD_LOAD_SCRIPT);
-			printf("  Log schedule.wpi and generate .act and .skd files.\n\n");
+			if (admin_command(I2C_ADMIN_PWD_CMD_LOAD_SCRIPT, ADMIN_TIMEOUT_MS)) {
+				printf("  Log schedule.wpi and generate .act and .skd files.\n\n");
+			}
 			break;
 		case 8: // Return to main menu
 			return;
@@ -1087,6 +1128,27 @@ void administrate(void) {
 }
 
 
+/**
+ * Format scheduled startup or shutdown time in the snapshot as "dd HH:MM:SS"
+ * 
+ * @param startup true for startup time, false for shutdown time
+ * @param buffer The pointer to buffer
+ * @param buf_size The size of buffer
+ * @return true if the time is set, false otherwise
+ */
+static bool snapshot_alarm(bool startup, char *buffer, int buf_size) {
+    int second = (int)snapshot_value(&snapshot, startup ? REG_CONF_ALARM1_SECOND : REG_CONF_ALARM2_SECOND);
+    int minute = (int)snapshot_value(&snapshot, startup ? REG_CONF_ALARM1_MINUTE : REG_CONF_ALARM2_MINUTE);
+    int hour = (int)snapshot_value(&snapshot, startup ? REG_CONF_ALARM1_HOUR : REG_CONF_ALARM2_HOUR);
+    int date = (int)snapshot_value(&snapshot, startup ? REG_CONF_ALARM1_DAY : REG_CONF_ALARM2_DAY);
+    if (second > 59 || minute > 59 || hour > 23 || date == 0 || date > 31) {
+        return false;
+    }
+    snprintf(buffer, buf_size, "%02d %02d:%02d:%02d", date, hour, minute, second);
+    return true;
+}
+
+
 /**
  * Display and process the main menu
  */
@@ -1095,37 +1157,38 @@ void do_main_menu(void) {
     printf("  2. Write RTC time to system\n");
     printf("  3. Synchronize with network time\n");
     printf("  4. Schedule next shutdown");
-	uint8_t date, hour, minute, second;
-	if (get_shutdown_time(&date, &hour, &minute, &second)) {
-		printf(" [%02d %02d:%02d:%02d]", date, hour, minute, second);
+	char buf[32];
+	if (snapshot_alarm(false, buf, sizeof(buf))) {
+		printf(" [%s]", buf);
 	}
 	printf("\n");
     printf("  5. Schedule next startup ");
-	if (get_startup_time(&date, &hour, &minute, &second)) {
-		printf(" [%02d %02d:%02d:%02d]", date, hour, minute, second);
+	if (snapshot_alarm(true, buf, sizeof(buf))) {
+		printf(" [%s]", buf);
 	}
 	printf("\n");
-    printf("  6. Choose schedule script%s\n", is_script_in_use() ? " (in use)" : "");
+    printf("  6. Choose schedule script%s\n", ((int)snapshot_value(&snapshot, REG_MISC) & 0x01) ? " (in use)" : "");
     printf("  7. Set low voltage threshold");
-	float lv = get_low_voltage_threshold();
+	float lv = snapshot_value(&snapshot, REG_CONF_LOW_VOLTAGE);
 	if (lv > 0.01f) {
 		printf(" [%.1fV]", lv);
 	}
 	printf("\n");
     printf("  8. Set recovery voltage threshold");
-	float rv = get_recovery_voltage_threshold();
+	float rv = snapshot_value(&snapshot, REG_CONF_RECOVERY_VOLTAGE);
 	if (rv > 0.01f) {
 		printf(" [%.1fV]", rv);
 	}
 	printf("\n");
     printf("  9. Set over temperature action");
-	char buf[32];
-	if (temperature_action_info(false, -1, -1, buf, 32) > 0) {
+	if (temperature_action_info(false, (int)snapshot_value(&snapshot, REG_CONF_OVER_TEMP_ACTION),
+	                            (int)snapshot_value(&snapshot, REG_CONF_OVER_TEMP_POINT), buf, 32) > 0) {
 		printf("  [%s]", buf);
 	}
 	printf("\n");
     printf(" 10. Set below temperature action");
-	if (temperature_action_info(true, -1, -1, buf, 32) > 0) {
+	if (temperature_action_info(true, (int)snapshot_value(&snapshot, REG_CONF_BELOW_TEMP_ACTION),
+	                            (int)snapshot_value(&snapshot, REG_CONF_BELOW_TEMP_POINT), buf, 32) > 0) {
 		printf(" [%s]", buf);
 	}
 	printf("\n");
@@ -1206,21 +1269,1181 @@ void do_main_menu(void) {
 }
 
 
+/**
+ * Benchmark retry policies on simulated transport with injected faults
+ *
+ * @param operations The number of operations for each policy
+ * @param faults_spec Comma separated fault probabilities, e.g. "nak=0.05,flip=0.01", NULL for defaults
+ */
+void benchmark_retry_policies(int operations, const char *faults_spec) {
+    SimFaults faults = { .nak = 0.05, .bit_flip = 0.01, .stuck = 0.01, .stretch = 0.02, .stretch_us = 500, .contention = 0.01, .contention_us = 5000 };
+    if (faults_spec) {
+        char spec[256];
+        snprintf(spec, sizeof(spec), "%s", faults_spec);
+        for (char *item = strtok(spec, ","); item; item = strtok(NULL, ",")) {
+            char name[32];
+            double value;
+            if (sscanf(item, "%31[^=]=%lf", name, &value) != 2) {
+                printf("Ignored fault: %s\n", item);
+            } else if (strcmp(name, "nak") == 0) {
+                faults.nak = value;
+            } else if (strcmp(name, "flip") == 0) {
+                faults.bit_flip = value;
+            } else if (strcmp(name, "stuck") == 0) {
+                faults.stuck = value;
+            } else if (strcmp(name, "stretch") == 0) {
+                faults.stretch = value;
+            } else if (strcmp(name, "stretch_us") == 0) {
+                faults.stretch_us = (int)value;
+            } else if (strcmp(name, "contention") == 0) {
+                faults.contention = value;
+            } else if (strcmp(name, "contention_us") == 0) {
+                faults.contention_us = (int)value;
+            } else {
+                printf("Ignored fault: %s\n", item);
+            }
+        }
+    }
+    printf("Faults: nak=%g flip=%g stuck=%g stretch=%g (%dus) contention=%g (%dus), %d operations per policy\n\n",
+           faults.nak, faults.bit_flip, faults.stuck, faults.stretch, faults.stretch_us, faults.contention, faults.contention_us, operations);
+
+    RetryPolicy current;
+    get_retry_policy(&current);
+    struct {
+        const char *name;
+        RetryPolicy policy;
+    } policies[] = {
+        { "current", current },
+        { "fixed", current },
+        { "no-breaker", current },
+        { "few-attempts", current },
+        { "triple-read", current },
+    };
+    policies[1].policy.adaptive = false;
+    policies[2].policy.breaker_threshold = 0;
+    policies[3].policy.read_max_attempts = 3;
+    policies[3].policy.write_max_attempts = 3;
+    policies[4].policy.read_validate_count = 3;
+    printf("%-18s %9s %9s %9s %10s %10s %8s\n", "Policy", "Success%", "Failed", "Corrupt", "Mean(us)", "P99(us)", "Tx/op");
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i ++) {
+        use_simulated_transport(&faults, 1);   // Same seed for every policy
+        BenchResult result;
+        if (benchmark_retry_policy(&policies[i].policy, operations, &result)) {
+            printf("%-18s %9.2f %9d %9d %10.1f %10.1f %8.2f\n", policies[i].name,
+                   100.0 * result.succeeded / result.operations, result.failed, result.corrupted, result.mean_us, result.p99_us, result.amplification);
+        }
+    }
+}
+
+
+// Arguments and result of one benchmark thread
+typedef struct {
+    wp5_ctx *ctx;           // Context to use, NULL for functions without context
+    uint8_t index;          // Register owned by this thread
+    int operations;
+    int mismatches;
+} BenchThread;
+
+
+// Write and read back own register, with or without context
+void *bench_thread(void *arg) {
+    BenchThread *bench = (BenchThread *)arg;
+    for (int i = 0; i < bench->operations; i ++) {
+        uint8_t value = (uint8_t)(i * 7 + bench->index);
+        bool ok = bench->ctx ? wp5_set(bench->ctx, bench->index, value, true) : i2c_set(-1, bench->index, value);
+        int read = bench->ctx ? wp5_get(bench->ctx, bench->index, true) : i2c_get(-1, bench->index);
+        if (!ok || read != value) {
+            bench->mismatches ++;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Benchmark concurrent use of the library on simulated transport, with shared default context and per-thread contexts
+ *
+ * @param threads The number of threads
+ */
+void benchmark_threads(int threads) {
+    SimFaults faults = { 0 };
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    BenchThread *benches = calloc(threads, sizeof(BenchThread));
+    if (ids == NULL || benches == NULL) {
+        free(ids);
+        free(benches);
+        return;
+    }
+    printf("%-20s %8s %12s %12s\n", "Mode", "Threads", "Ops/s", "Mismatches");
+    for (int mode = 0; mode < 2; mode ++) {
+        use_simulated_transport(&faults, 1);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < threads; i ++) {
+            benches[i] = (BenchThread){ .ctx = mode ? wp5_ctx_new() : NULL, .index = 16 + i % 48, .operations = 500 };
+            pthread_create(&ids[i], NULL, bench_thread, &benches[i]);
+        }
+        int mismatches = 0;
+        for (int i = 0; i < threads; i ++) {
+            pthread_join(ids[i], NULL);
+            mismatches += benches[i].mismatches;
+            wp5_ctx_free(benches[i].ctx);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%-20s %8d %12.0f %12d\n", mode ? "context per thread" : "default context", threads, threads * 500 * 2 / seconds, mismatches);
+    }
+    free(ids);
+    free(benches);
+}
+
+
+// Print a string as quoted JSON string
+static void print_json_string(const char *value) {
+    putchar('"');
+    for (const char *p = value; *p; p ++) {
+        if (*p == '"' || *p == '\\') {
+            putchar('\\');
+        }
+        putchar(*p);
+    }
+    putchar('"');
+}
+
+
+/**
+ * Print a field of command output, as "key: value" line or as JSON member
+ * 
+ * @param json Whether to print as JSON
+ * @param first Whether it is the first field of the JSON object
+ * @param key The name of the field
+ * @param value The value, NULL for unknown
+ * @param quoted Whether the value is a string in JSON
+ */
+static void print_field(bool json, bool first, const char *key, const char *value, bool quoted) {
+    if (!json) {
+        printf("%s: %s\n", key, value ? value : "unknown");
+        return;
+    }
+    printf("%s\"%s\":", first ? "" : ",", key);
+    if (value == NULL) {
+        printf("null");
+    } else if (quoted) {
+        print_json_string(value);
+    } else {
+        printf("%s", value);
+    }
+}
+
+
+/**
+ * Format alarm registers (second, minute, hour, day) as "dd HH:MM:SS"
+ * 
+ * @param values The register values
+ * @param buf The buffer for the string
+ * @param size The size of the buffer
+ * @return buf if the alarm is set, NULL otherwise
+ */
+static const char *format_alarm(const double *values, char *buf, int size) {
+    int second = (int)values[0], minute = (int)values[1], hour = (int)values[2], date = (int)values[3];
+    if (second > 59 || minute > 59 || hour > 23 || date == 0 || date > 31) {
+        return NULL;
+    }
+    snprintf(buf, size, "%02d %02d:%02d:%02d", date, hour, minute, second);
+    return buf;
+}
+
+
+/**
+ * Command "status": print the state of Witty Pi, in three batched reads
+ * 
+ * @param json Whether to print as JSON
+ * @return The exit code
+ */
+int command_status(bool json) {
+    int model = get_wittypi_model();
+    if (model == MODEL_UNKNOWN) {
+        fprintf(stderr, "Can not detect Witty Pi.\n");
+        return EXIT_FAILURE;
+    }
+    static const RegisterId ids[] = {
+        REG_TEMPERATURE, REG_POWER_MODE, REG_VUSB, REG_VIN, REG_VOUT, REG_IOUT, REG_ACTION_REASON, REG_MISC,
+        REG_CONF_LOW_VOLTAGE, REG_CONF_RECOVERY_VOLTAGE,
+        REG_CONF_ALARM1_SECOND, REG_CONF_ALARM1_MINUTE, REG_CONF_ALARM1_HOUR, REG_CONF_ALARM1_DAY,
+        REG_CONF_ALARM2_SECOND, REG_CONF_ALARM2_MINUTE, REG_CONF_ALARM2_HOUR, REG_CONF_ALARM2_DAY,
+    };
+    double values[sizeof(ids) / sizeof(ids[0])];
+    if (!get_register_values(ids, sizeof(ids) / sizeof(ids[0]), values)) {
+        fprintf(stderr, "Failed to read registers.\n");
+        return EXIT_FAILURE;
+    }
+    DateTime sys_dt, rtc_dt;
+    bool has_sys = get_system_time(&sys_dt);
+    bool has_rtc = get_rtc_time(&rtc_dt) && is_time_valid(&rtc_dt);
+    int major = 0, minor = 0;
+    bool has_fw = get_firmware_version(&major, &minor);
+    
+    char buf[16][32];
+    snprintf(buf[0], sizeof(buf[0]), "%d.%02d", major, minor);
+    snprintf(buf[1], sizeof(buf[1]), "%.3f", values[0]);
+    snprintf(buf[2], sizeof(buf[2]), "%d", (int)values[1]);
+    for (int i = 0; i < 4; i ++) {
+        snprintf(buf[3 + i], sizeof(buf[3 + i]), "%.3f", values[2 + i]);
+    }
+    snprintf(buf[7], sizeof(buf[7]), "%4d-%02d-%02d %02d:%02d:%02d", sys_dt.year, sys_dt.month, sys_dt.day, sys_dt.hour, sys_dt.min, sys_dt.sec);
+    snprintf(buf[8], sizeof(buf[8]), "%4d-%02d-%02d %02d:%02d:%02d", rtc_dt.year, rtc_dt.month, rtc_dt.day, rtc_dt.hour, rtc_dt.min, rtc_dt.sec);
+    snprintf(buf[9], sizeof(buf[9]), "%.1f", values[8]);
+    snprintf(buf[10], sizeof(buf[10]), "%.1f", values[9]);
+    int reasons = (int)values[6];
+    int startup_reason = (reasons >> 4) & 0x0F;
+    int shutdown_reason = reasons & 0x0F;
+    
+    if (json) {
+        printf("{");
+    }
+    print_field(json, true, "model", wittypi_models[model], true);
+    print_field(json, false, "firmware", has_fw ? buf[0] : NULL, true);
+    print_field(json, false, "temperature", buf[1], false);
+    print_field(json, false, "power_mode", buf[2], false);
+    print_field(json, false, "vusb", buf[3], false);
+    print_field(json, false, "vin", buf[4], false);
+    print_field(json, false, "vout", buf[5], false);
+    print_field(json, false, "iout", buf[6], false);
+    print_field(json, false, "system_time", has_sys ? buf[7] : NULL, true);
+    print_field(json, false, "rtc_time", has_rtc ? buf[8] : NULL, true);
+    print_field(json, false, "startup_time", format_alarm(&values[10], buf[11], sizeof(buf[11])), true);
+    print_field(json, false, "shutdown_time", format_alarm(&values[14], buf[12], sizeof(buf[12])), true);
+    print_field(json, false, "low_voltage", values[8] > 0 ? buf[9] : NULL, false);
+    print_field(json, false, "recovery_voltage", values[9] > 0 ? buf[10] : NULL, false);
+    print_field(json, false, "startup_reason", startup_reason < action_reasons_count ? action_reasons[startup_reason] : NULL, true);
+    print_field(json, false, "shutdown_reason", shutdown_reason < action_reasons_count ? action_reasons[shutdown_reason] : NULL, true);
+    print_field(json, false, "script_in_use", ((int)values[7] & 0x01) ? "true" : "false", false);
+    if (json) {
+        printf("}\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Parse register index, in decimal or hexadecimal (0x..)
+ * 
+ * @param str The string to parse
+ * @param index Pointer to store the index
+ * @return true if it is a register index, false otherwise
+ */
+static bool parse_register_index(const char *str, uint8_t *index) {
+    char *end;
+    long value = strtol(str, &end, 0);
+    if (end == str || *end != '\0' || value < 0 || value > 255) {
+        return false;
+    }
+    *index = (uint8_t)value;
+    return true;
+}
+
+
+/**
+ * Command "get": print register values by name or index, named values are read in one burst
+ * 
+ * @param count The number of registers
+ * @param names The names or indexes of the registers
+ * @param json Whether to print as JSON
+ * @return The exit code
+ */
+int command_get(int count, char **names, bool json) {
+    RegisterId ids[REG_COUNT];
+    uint8_t indexes[256];
+    int id_count = 0, index_count = 0;
+    for (int i = 0; i < count; i ++) {
+        uint8_t index;
+        int id = find_register(names[i]);
+        if (id >= 0 && id_count < REG_COUNT) {
+            ids[id_count ++] = id;
+        } else if (parse_register_index(names[i], &index) && index_count < 256) {
+            indexes[index_count ++] = index;
+        } else {
+            fprintf(stderr, "Unknown register: %s\n", names[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    double values[REG_COUNT];
+    uint8_t raw[256];
+    if ((id_count > 0 && !get_register_values(ids, id_count, values))
+        || (index_count > 0 && !i2c_get_batch(-1, indexes, index_count, raw, true))) {
+        fprintf(stderr, "Failed to read registers.\n");
+        return EXIT_FAILURE;
+    }
+    if (json) {
+        printf("{");
+    }
+    int id_pos = 0, index_pos = 0;
+    for (int i = 0; i < count; i ++) {
+        char value[32];
+        if (find_register(names[i]) >= 0) {
+            snprintf(value, sizeof(value), "%g", values[id_pos ++]);
+        } else {
+            snprintf(value, sizeof(value), "%d", raw[index_pos ++]);
+        }
+        if (json) {
+            print_field(true, i == 0, names[i], value, false);
+        } else if (count == 1) {
+            printf("%s\n", value);
+        } else {
+            print_field(false, false, names[i], value, false);
+        }
+    }
+    if (json) {
+        printf("}\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Command "set": write register value by name (in unit) or index (raw byte)
+ * 
+ * @param name The name or index of the register
+ * @param value The value
+ * @return The exit code
+ */
+int command_set(const char *name, const char *value) {
+    char *end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0') {
+        fprintf(stderr, "Invalid value: %s\n", value);
+        return EXIT_FAILURE;
+    }
+    int id = find_register(name);
+    uint8_t index;
+    bool success;
+    if (id >= 0) {
+        if (!(register_table[id].access & REG_ACCESS_WO)) {
+            fprintf(stderr, "Register %s is read-only.\n", register_table[id].name);
+            return EXIT_FAILURE;
+        }
+        if (number < register_table[id].min || number > register_table[id].max) {
+            fprintf(stderr, "Value of %s should be %g~%g.\n", register_table[id].name, register_table[id].min, register_table[id].max);
+            return EXIT_FAILURE;
+        }
+        success = set_register_value(id, number);
+    } else if (parse_register_index(name, &index)) {
+        if (number < 0 || number > 255 || number != (int)number) {
+            fprintf(stderr, "Raw register value should be 0~255.\n");
+            return EXIT_FAILURE;
+        }
+        success = i2c_set(-1, index, (uint8_t)number);
+    } else {
+        fprintf(stderr, "Unknown register: %s\n", name);
+        return EXIT_FAILURE;
+    }
+    if (!success) {
+        fprintf(stderr, "Failed to write register.\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Command "schedule": set or clear scheduled startup/shutdown time
+ * 
+ * @param which "startup" or "shutdown"
+ * @param when Time in "dd HH:MM:SS" format, or "off" to clear
+ * @return The exit code
+ */
+int command_schedule(const char *which, const char *when) {
+    bool startup = strcmp(which, "startup") == 0;
+    if (!startup && strcmp(which, "shutdown") != 0) {
+        fprintf(stderr, "Usage: wp5 schedule startup|shutdown \"dd HH:MM:SS\"|off\n");
+        return 2;
+    }
+    bool success;
+    if (strcmp(when, "off") == 0) {
+        success = startup ? clear_startup_time() : clear_shutdown_time();
+    } else {
+        uint8_t date, hour, minute, second;
+        if (!validate_time_format(when) || !parse_time_string(when, &date, &hour, &minute, &second)
+            || date < 1 || date > 31 || hour > 23) {
+            fprintf(stderr, "Invalid time \"%s\", should be \"dd HH:MM:SS\".\n", when);
+            return EXIT_FAILURE;
+        }
+        success = startup ? set_startup_time(date, hour, minute, second) : set_shutdown_time(date, hour, minute, second);
+    }
+    if (!success) {
+        fprintf(stderr, "Failed to set %s time.\n", which);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Command "sync": synchronize time between system, RTC and network
+ * 
+ * @param target "rtc" (system -> RTC), "system" (RTC -> system) or "network" (network -> system and RTC)
+ * @return The exit code
+ */
+int command_sync(const char *target) {
+    bool success;
+    if (strcmp(target, "rtc") == 0) {
+        success = system_to_rtc_precise();
+    } else if (strcmp(target, "system") == 0) {
+        success = rtc_to_system();
+    } else if (strcmp(target, "network") == 0) {
+        success = network_to_system_and_rtc();
+    } else {
+        fprintf(stderr, "Usage: wp5 sync rtc|system|network\n");
+        return 2;
+    }
+    if (!success) {
+        fprintf(stderr, "Failed to synchronize %s time.\n", target);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// Whether a register belongs to the configuration file
+static bool is_config_register(const RegisterInfo *reg) {
+    return reg->index >= I2C_CONF_FIRST && reg->index < I2C_CONF_FIRST + CONFIG_REG_COUNT && reg->volatility == REG_VOLATILITY_CONFIG;
+}
+
+
+// Read all configuration registers in one burst, repeated until identical readings validate it, values are indexed from I2C_CONF_FIRST
+static bool read_config_registers(uint8_t *values) {
+    uint8_t indexes[CONFIG_REG_COUNT];
+    for (int i = 0; i < CONFIG_REG_COUNT; i ++) {
+        indexes[i] = I2C_CONF_FIRST + i;
+    }
+    return i2c_get_batch(-1, indexes, CONFIG_REG_COUNT, values, true);
+}
+
+
+// Format a configuration register value, values that do not survive decoding (e.g. invalid BCD) are kept raw
+static void format_config_value(int id, uint8_t raw, char *buf, int size) {
+    const RegisterInfo *reg = &register_table[id];
+    double value = decode_register_value(reg, &raw);
+    uint8_t encoded;
+    if (encode_register_value(reg, value, &encoded) && encoded == raw) {
+        format_register_value(id, value, buf, size);
+    } else {
+        snprintf(buf, size, "0x%02X", raw);
+    }
+}
+
+
+/**
+ * Command "config export": write all configuration registers into a versioned text file
+ * 
+ * @param path The file to write, NULL or "-" for stdout
+ * @return The exit code
+ */
+int command_config_export(const char *path) {
+    int model = get_wittypi_model();
+    if (model == MODEL_UNKNOWN) {
+        fprintf(stderr, "Can not detect Witty Pi.\n");
+        return EXIT_FAILURE;
+    }
+    uint8_t values[CONFIG_REG_COUNT];
+    if (!read_config_registers(values)) {
+        fprintf(stderr, "Failed to read configuration registers.\n");
+        return EXIT_FAILURE;
+    }
+    bool to_stdout = path == NULL || strcmp(path, "-") == 0;
+    FILE *fp = to_stdout ? stdout : fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Can not write to %s\n", path);
+        return EXIT_FAILURE;
+    }
+    int major = 0, minor = 0;
+    get_firmware_version(&major, &minor);
+    fprintf(fp, "# %s configuration, exported by wp5 V%s (firmware %d.%02d)\n", wittypi_models[model], SOFTWARE_VERSION_STR, major, minor);
+    fprintf(fp, "version = %d\n", CONFIG_FILE_VERSION);
+    for (int i = 0; i < REG_COUNT; i ++) {
+        const RegisterInfo *reg = &register_table[i];
+        if (!is_config_register(reg)) {
+            continue;
+        }
+        char buf[32];
+        format_config_value(i, values[reg->index - I2C_CONF_FIRST], buf, sizeof(buf));
+        fprintf(fp, "%-24s = %-10s # %s\n", reg->name, buf, reg->label);
+    }
+    if (!to_stdout) {
+        fclose(fp);
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// Parse a configuration file, mark the registers it sets in "present" and their raw values in "values"
+static bool parse_config_file(const char *path, uint8_t *values, bool *present) {
+    bool from_stdin = strcmp(path, "-") == 0;
+    FILE *fp = from_stdin ? stdin : fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Can not read %s\n", path);
+        return false;
+    }
+    bool success = true;
+    bool has_version = false;
+    char line[256];
+    for (int line_no = 1; success && fgets(line, sizeof(line), fp) != NULL; line_no ++) {
+        char *p = strchr(line, '#');
+        if (p) {
+            *p = '\0';
+        }
+        char *eq = strchr(line, '=');
+        char key[32], text[32];
+        if (eq == NULL) {
+            if (strspn(line, " \t\r\n") != strlen(line)) {
+                fprintf(stderr, "%s:%d: expecting \"name = value\".\n", path, line_no);
+                success = false;
+            }
+            continue;
+        }
+        *eq = '\0';
+        if (sscanf(line, "%31s", key) != 1 || sscanf(eq + 1, "%31s", text) != 1) {
+            fprintf(stderr, "%s:%d: expecting \"name = value\".\n", path, line_no);
+            success = false;
+            continue;
+        }
+        if (strcmp(key, "version") == 0) {
+            has_version = atoi(text) == CONFIG_FILE_VERSION;
+            if (!has_version) {
+                fprintf(stderr, "%s:%d: unsupported version %s.\n", path, line_no, text);
+                success = false;
+            }
+            continue;
+        }
+        int id = find_register(key);
+        if (id < 0 || !is_config_register(&register_table[id])) {
+            fprintf(stderr, "%s:%d: unknown configuration register %s.\n", path, line_no, key);
+            success = false;
+            continue;
+        }
+        const RegisterInfo *reg = &register_table[id];
+        uint8_t *raw = &values[reg->index - I2C_CONF_FIRST];
+        char *end;
+        if (strncasecmp(text, "0x", 2) == 0) {
+            long number = strtol(text, &end, 16);
+            if (*end != '\0' || number < 0 || number > 255) {
+                fprintf(stderr, "%s:%d: invalid raw value %s.\n", path, line_no, text);
+                success = false;
+            }
+            *raw = (uint8_t)number;
+        } else {
+            double number = strtod(text, &end);
+            if (end == text || (*end != '\0' && strcmp(end, reg->unit) != 0)) {
+                fprintf(stderr, "%s:%d: invalid value %s.\n", path, line_no, text);
+                success = false;
+            } else if (!encode_register_value(reg, number, raw)) {
+                fprintf(stderr, "%s:%d: value of %s should be %g~%g.\n", path, line_no, reg->name, reg->min, reg->max);
+                success = false;
+            }
+        }
+        present[reg->index - I2C_CONF_FIRST] = true;
+    }
+    if (success && !has_version) {
+        fprintf(stderr, "%s: missing \"version = %d\".\n", path, CONFIG_FILE_VERSION);
+        success = false;
+    }
+    if (!from_stdin) {
+        fclose(fp);
+    }
+    return success;
+}
+
+
+/**
+ * Command "config apply" / "config diff": write the registers that differ from a configuration file
+ * The changed registers are committed as one transaction, see reg_txn_commit()
+ * 
+ * @param path The file to read, "-" for stdin
+ * @param dry_run Only print the differences
+ * @return The exit code
+ */
+int command_config_apply(const char *path, bool dry_run) {
+    uint8_t wanted[CONFIG_REG_COUNT];
+    bool present[CONFIG_REG_COUNT] = { false };
+    if (!parse_config_file(path, wanted, present)) {
+        return EXIT_FAILURE;
+    }
+    if (get_wittypi_model() == MODEL_UNKNOWN) {
+        fprintf(stderr, "Can not detect Witty Pi.\n");
+        return EXIT_FAILURE;
+    }
+    uint8_t current[CONFIG_REG_COUNT];
+    if (!read_config_registers(current)) {
+        fprintf(stderr, "Failed to read configuration registers.\n");
+        return EXIT_FAILURE;
+    }
+    
+    // Show and stage the changes, the transaction writes only these
+    RegisterTransaction txn;
+    reg_txn_begin(&txn);
+    for (int i = 0; i < REG_COUNT; i ++) {
+        const RegisterInfo *reg = &register_table[i];
+        int offset = reg->index - I2C_CONF_FIRST;
+        if (!is_config_register(reg) || !present[offset] || wanted[offset] == current[offset]) {
+            continue;
+        }
+        if (reg->index == I2C_CONF_ADDRESS) {   // The rest of the batch would go to an absent device
+            fprintf(stderr, "Skipped %s, change it in \"Other settings\" instead.\n", reg->name);
+            continue;
+        }
+        char old_text[32], new_text[32];
+        format_config_value(i, current[offset], old_text, sizeof(old_text));
+        format_config_value(i, wanted[offset], new_text, sizeof(new_text));
+        printf("%-24s %s -> %s\n", reg->name, old_text, new_text);
+        reg_txn_stage(&txn, reg->index, wanted[offset]);
+    }
+    if (txn.count == 0) {
+        printf("Configuration is up to date.\n");
+        return EXIT_SUCCESS;
+    }
+    if (dry_run) {
+        return EXIT_SUCCESS;
+    }
+    switch (reg_txn_commit(&txn)) {
+        case TXN_COMMITTED:
+            printf("Applied %d change(s).\n", txn.written);
+            return EXIT_SUCCESS;
+        case TXN_ROLLED_BACK:
+            fprintf(stderr, "Failed to apply configuration, previous values are restored.\n");
+            break;
+        case TXN_ROLLBACK_FAILED:
+            fprintf(stderr, "Failed to apply configuration, and failed to restore previous values!\n");
+            break;
+        default:
+            fprintf(stderr, "Failed to apply configuration.\n");
+            break;
+    }
+    return EXIT_FAILURE;
+}
+
+
+// Names of directories on Witty Pi disk, indexed by DIRECTORY_???
+static const char *directory_names[] = { NULL, "root", "conf", "log", "schedule" };
+
+
+/**
+ * Command "fs ls": list files in one or all directories on Witty Pi disk
+ * Listings are cached, so browsing again does not download them until a command writes to the disk
+ * 
+ * @param name The name of the directory, NULL for all directories
+ * @param json Whether to print as JSON
+ * @return The exit code
+ */
+int command_fs_ls(const char *name, bool json) {
+    int first = DIRECTORY_ROOT, last = DIRECTORY_SCHEDULE;
+    if (name) {
+        while (first <= last && strcmp(directory_names[first], name) != 0) {
+            first ++;
+        }
+        if (first > last) {
+            fprintf(stderr, "Unknown directory: %s\n", name);
+            return EXIT_FAILURE;
+        }
+        last = first;
+    }
+    if (json) {
+        printf("{");
+    }
+    for (int dir = first; dir <= last; dir ++) {
+        FileListing list;
+        init_file_listing(&list);
+        bool cached;
+        if (!get_file_listing(dir, &list, NULL, NULL, &cached)) {
+            free_file_listing(&list);
+            if (json) {
+                printf("}\n");
+            }
+            fprintf(stderr, "Failed to list files in %s directory.\n", directory_names[dir]);
+            return EXIT_FAILURE;
+        }
+        print_log("Listed %d file(s) in %s directory%s.\n", list.count, directory_names[dir], cached ? " from cache" : "");
+        if (json) {
+            printf("%s\"%s\":[", dir == first ? "" : ",", directory_names[dir]);
+        }
+        for (int i = 0; i < list.count; i ++) {
+            const char *entry = get_file_listing_entry(&list, i);
+            if (json) {
+                if (i > 0) {
+                    putchar(',');
+                }
+                print_json_string(entry);
+            } else if (name) {
+                printf("%s\n", entry);
+            } else {
+                printf("%s/%s\n", directory_names[dir], entry);
+            }
+        }
+        if (json) {
+            printf("]");
+        }
+        free_file_listing(&list);
+    }
+    if (json) {
+        printf("}\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// Set when a long running command ("top" or "stream") should stop
+static volatile sig_atomic_t command_stopped = 0;
+
+
+// Signal handler for long running commands
+static void stop_command(int signum) {
+    (void)signum;
+    command_stopped = 1;
+}
+
+
+// Get microseconds from monotonic clock, comparable with the time in published snapshot
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// Render recent samples as a sparkline, scaled between their minimum and maximum
+static void format_sparkline(const double *history, int start, int count, char *buf, int size) {
+    static const char *blocks[] = { "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+    double min = 0, max = 0;
+    for (int i = 0; i < count; i ++) {
+        double v = history[(start + i) % TOP_HISTORY];
+        if (i == 0 || v < min) min = v;
+        if (i == 0 || v > max) max = v;
+    }
+    int len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < count && len + 4 < size; i ++) {
+        double v = history[(start + i) % TOP_HISTORY];
+        int level = max > min ? (int)((v - min) / (max - min) * 7 + 0.5) : 0;
+        len += snprintf(buf + len, size - len, "%s", blocks[level]);
+    }
+}
+
+
+/**
+ * Command "top": keep showing live values in place, until interrupted
+ * Values come from the snapshot published by wp5d, or from direct burst reads if wp5d is not publishing
+ * 
+ * @return The exit code
+ */
+int command_top(void) {
+    static const RegisterId ids[] = { REG_VUSB, REG_VIN, REG_VOUT, REG_IOUT, REG_TEMPERATURE };
+    static const char *rpi_states[] = { "OFF", "STARTING", "ON", "STOPPING" };
+    const int metrics = sizeof(ids) / sizeof(ids[0]);
+    
+    int model = get_wittypi_model();
+    if (model == MODEL_UNKNOWN) {
+        fprintf(stderr, "Can not detect Witty Pi.\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, stop_command);
+    signal(SIGTERM, stop_command);
+    
+    double history[sizeof(ids) / sizeof(ids[0])][TOP_HISTORY];
+    uint64_t times[TOP_HISTORY];
+    int start = 0, count = 0;
+    unsigned long samples = 0;
+    uint64_t last_sampled_us = 0;
+    uint64_t started_us = monotonic_us();
+    RegisterSnapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    const char *source = "waiting";
+    
+    char frame[TOP_LINES][256], shown[TOP_LINES][256];
+    memset(shown, 0, sizeof(shown));
+    printf("\033[?25l\033[2J");
+    while (!command_stopped) {
+        // Prefer the snapshot from wp5d, reading it also asks wp5d to publish faster
+        uint64_t now_us = monotonic_us();
+        uint64_t sampled_us = 0;
+        RegisterSnapshot latest;
+        if (read_published_snapshot(&latest, &sampled_us) && now_us - sampled_us < TOP_STALE_MS * 1000) {
+            source = "wp5d";
+        } else if (now_us - started_us < TOP_STALE_MS * 1000) {
+            sampled_us = last_sampled_us;
+        } else if (get_live_snapshot(&latest)) {
+            source = "direct";
+            sampled_us = now_us;
+        } else {
+            source = "read failed";
+            sampled_us = last_sampled_us;
+        }
+        if (sampled_us != last_sampled_us) {
+            last_sampled_us = sampled_us;
+            snap = latest;
+            int slot = (start + count) % TOP_HISTORY;
+            if (count == TOP_HISTORY) {
+                start = (start + 1) % TOP_HISTORY;
+            } else {
+                count ++;
+            }
+            for (int i = 0; i < metrics; i ++) {
+                history[i][slot] = snapshot_value(&snap, ids[i]);
+            }
+            times[slot] = sampled_us;
+            samples ++;
+        }
+        
+        // Observed sampling rate over the samples in history
+        double rate = 0;
+        if (count > 1) {
+            uint64_t span_us = times[(start + count - 1) % TOP_HISTORY] - times[start];
+            rate = span_us > 0 ? (count - 1) * 1e6 / span_us : 0;
+        }
+        
+        // Compose the frame
+        int line = 0;
+        snprintf(frame[line ++], sizeof(frame[0]), "  %s   source: %s   rate: %.1f Hz   samples: %lu", wittypi_models[model], source, rate, samples);
+        snprintf(frame[line ++], sizeof(frame[0]), "%s", "");
+        for (int i = 0; i < metrics; i ++) {
+            const RegisterInfo *reg = &register_table[ids[i]];
+            char spark[TOP_HISTORY * 4 + 1];
+            format_sparkline(history[i], start, count, spark, sizeof(spark));
+            if (count > 0) {
+                snprintf(frame[line ++], sizeof(frame[0]), "  %-12s %8.3f %-2s  %s", reg->label, history[i][(start + count - 1) % TOP_HISTORY], reg->unit, spark);
+            } else {
+                snprintf(frame[line ++], sizeof(frame[0]), "  %-12s %8s", reg->label, "-");
+            }
+        }
+        snprintf(frame[line ++], sizeof(frame[0]), "%s", "");
+        int mode = (int)snapshot_value(&snap, REG_POWER_MODE);
+        int state = (int)snapshot_value(&snap, REG_RPI_STATE);
+        snprintf(frame[line ++], sizeof(frame[0]), "  Power source: %s   Raspberry Pi: %s   Missed heartbeats: %d",
+                 count == 0 ? "-" : (mode ? "V-IN" : "V-USB"), count == 0 ? "-" : (state < 4 ? rpi_states[state] : "UNKNOWN"),
+                 (int)snapshot_value(&snap, REG_MISSED_HEARTBEAT));
+        snprintf(frame[line ++], sizeof(frame[0]), "%s", "");
+        snprintf(frame[line ++], sizeof(frame[0]), "  Press Ctrl+C to exit.");
+        
+        // Only redraw lines that changed
+        for (int i = 0; i < line; i ++) {
+            if (strcmp(frame[i], shown[i]) != 0) {
+                printf("\033[%d;1H%s\033[K", i + 1, frame[i]);
+                strcpy(shown[i], frame[i]);
+            }
+        }
+        fflush(stdout);
+        
+        struct timespec interval = { 0, TOP_INTERVAL_MS * 1000000L };
+        nanosleep(&interval, NULL);
+    }
+    printf("\033[%d;1H\033[?25h\n", TOP_LINES + 1);
+    return EXIT_SUCCESS;
+}
+
+
+// A sample taken by "wp5 stream", also the record layout of the binary format
+typedef struct {
+    uint64_t time_us;           // Unix time in microseconds
+    uint32_t seq;               // Sequence number, gaps mean dropped samples
+    uint32_t power_mode;        // 0=via V-USB, 1=via V-IN
+    float vusb;
+    float vin;
+    float vout;
+    float iout;
+    float temperature;
+    uint32_t missed;            // Deadlines missed so far
+} StreamSample;
+
+static StreamSample stream_ring[STREAM_RING_SLOTS];
+static atomic_uint stream_head;
+static atomic_uint stream_tail;
+static atomic_bool stream_stopping;
+static sem_t stream_sem;
+
+
+// Write one sample in the chosen format
+static void write_stream_sample(const StreamSample *sample, const char *format) {
+    if (strcmp(format, "bin") == 0) {
+        fwrite(sample, sizeof(StreamSample), 1, stdout);
+    } else if (strcmp(format, "ndjson") == 0) {
+        printf("{\"time\":%llu.%06llu,\"seq\":%u,\"power_mode\":%u,\"vusb\":%.3f,\"vin\":%.3f,\"vout\":%.3f,\"iout\":%.3f,\"temperature\":%.3f,\"missed\":%u}\n",
+               (unsigned long long)(sample->time_us / 1000000), (unsigned long long)(sample->time_us % 1000000), sample->seq, sample->power_mode,
+               sample->vusb, sample->vin, sample->vout, sample->iout, sample->temperature, sample->missed);
+    } else {
+        printf("%llu.%06llu,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%u\n",
+               (unsigned long long)(sample->time_us / 1000000), (unsigned long long)(sample->time_us % 1000000), sample->seq, sample->power_mode,
+               sample->vusb, sample->vin, sample->vout, sample->iout, sample->temperature, sample->missed);
+    }
+}
+
+
+// Background writer thread of "wp5 stream", drains the ring buffer to stdout
+static void *stream_writer(void *arg) {
+    const char *format = arg;
+    while (true) {
+        sem_wait(&stream_sem);
+        unsigned tail = atomic_load_explicit(&stream_tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&stream_head, memory_order_acquire)) {
+            write_stream_sample(&stream_ring[tail % STREAM_RING_SLOTS], format);
+            tail ++;
+            atomic_store_explicit(&stream_tail, tail, memory_order_release);
+        }
+        fflush(stdout);
+        if (atomic_load(&stream_stopping) && tail == atomic_load(&stream_head)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Command "stream": sample live registers at given rate and write them to stdout, until interrupted
+ * Each sample is one transaction, samples are paced by monotonic clock and written by a background
+ * thread, so a slow reader of stdout drops samples (seen as sequence gaps) instead of delaying them
+ * 
+ * @param rate Samples per second, 0 for as fast as the bus allows
+ * @param format "csv", "ndjson" or "bin"
+ * @return The exit code
+ */
+int command_stream(double rate, const char *format) {
+    if (rate < 0 || (strcmp(format, "csv") != 0 && strcmp(format, "ndjson") != 0 && strcmp(format, "bin") != 0)) {
+        fprintf(stderr, "Rate must not be negative, format must be csv, ndjson or bin.\n");
+        return 2;
+    }
+    if (get_wittypi_model() == MODEL_UNKNOWN) {
+        fprintf(stderr, "Can not detect Witty Pi.\n");
+        return EXIT_FAILURE;
+    }
+    if (strcmp(format, "bin") == 0) {
+        fwrite(STREAM_BIN_MAGIC, 8, 1, stdout);
+    } else if (strcmp(format, "csv") == 0) {
+        printf("time,seq,power_mode,vusb,vin,vout,iout,temperature,missed\n");
+    }
+    fflush(stdout);
+    
+    pthread_t writer;
+    atomic_store(&stream_stopping, false);
+    if (sem_init(&stream_sem, 0, 0) != 0 || pthread_create(&writer, NULL, stream_writer, (void *)format) != 0) {
+        fprintf(stderr, "Can not start writer thread.\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, stop_command);
+    signal(SIGTERM, stop_command);
+    signal(SIGPIPE, stop_command);
+    
+    uint64_t period_us = rate > 0 ? (uint64_t)(1000000 / rate) : 0;
+    uint64_t started_us = monotonic_us();
+    uint64_t deadline_us = started_us;
+    uint64_t next_report_us = started_us + 1000000;
+    uint32_t seq = 0;
+    unsigned long sampled = 0, missed = 0, dropped = 0, failed = 0;
+    unsigned long reported_missed = 0, reported_dropped = 0;
+    while (!command_stopped) {
+        if (period_us > 0) {
+            struct timespec ts = { deadline_us / 1000000, (deadline_us % 1000000) * 1000 };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        RegisterSnapshot snap;
+        if (get_live_snapshot(&snap)) {
+            StreamSample sample;
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            sample.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+            sample.seq = seq ++;
+            sample.power_mode = (uint32_t)snapshot_value(&snap, REG_POWER_MODE);
+            sample.vusb = snapshot_value(&snap, REG_VUSB);
+            sample.vin = snapshot_value(&snap, REG_VIN);
+            sample.vout = snapshot_value(&snap, REG_VOUT);
+            sample.iout = snapshot_value(&snap, REG_IOUT);
+            sample.temperature = snapshot_value(&snap, REG_TEMPERATURE);
+            sample.missed = missed;
+            unsigned head = atomic_load_explicit(&stream_head, memory_order_relaxed);
+            if (head - atomic_load_explicit(&stream_tail, memory_order_acquire) >= STREAM_RING_SLOTS) {
+                dropped ++;
+            } else {
+                stream_ring[head % STREAM_RING_SLOTS] = sample;
+                atomic_store_explicit(&stream_head, head + 1, memory_order_release);
+                sem_post(&stream_sem);
+            }
+            sampled ++;
+        } else {
+            failed ++;
+        }
+        
+        // Skip the deadlines already passed instead of catching up in a burst
+        uint64_t now_us = monotonic_us();
+        if (period_us > 0) {
+            deadline_us += period_us;
+            if (now_us > deadline_us) {
+                uint64_t behind = (now_us - deadline_us) / period_us + 1;
+                missed += behind;
+                deadline_us += behind * period_us;
+            }
+        }
+        if (now_us >= next_report_us) {
+            if (missed != reported_missed || dropped != reported_dropped) {
+                fprintf(stderr, "Missed %lu deadline(s), dropped %lu sample(s) in the last second.\n", missed - reported_missed, dropped - reported_dropped);
+                reported_missed = missed;
+                reported_dropped = dropped;
+            }
+            next_report_us = now_us + 1000000;
+        }
+    }
+    
+    double elapsed = (monotonic_us() - started_us) / 1e6;
+    atomic_store(&stream_stopping, true);
+    sem_post(&stream_sem);
+    pthread_join(writer, NULL);
+    sem_destroy(&stream_sem);
+    fprintf(stderr, "%lu samples in %.3f s (%.1f Hz), %lu missed deadline(s), %lu dropped, %lu failed read(s).\n",
+            sampled, elapsed, elapsed > 0 ? sampled / elapsed : 0, missed, dropped, failed);
+    return failed > 0 && sampled == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+// Print usage of non-interactive commands, returns the exit code for bad command line
+static int print_usage(void) {
+    fprintf(stderr, "Usage: wp5 [options] [command]\n");
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  status [--json]                               Print the state of Witty Pi\n");
+    fprintf(stderr, "  get <name|index>... [--json]                  Print register values\n");
+    fprintf(stderr, "  set <name|index> <value>                      Write register value\n");
+    fprintf(stderr, "  schedule startup|shutdown \"dd HH:MM:SS\"|off   Set or clear scheduled time\n");
+    fprintf(stderr, "  sync rtc|system|network                       Synchronize time\n");
+    fprintf(stderr, "  top                                           Keep showing live values until Ctrl+C\n");
+    fprintf(stderr, "  stream [--rate=N] [--format=csv|ndjson|bin]  Write live values to stdout until Ctrl+C\n");
+    fprintf(stderr, "  config export [file]                          Write configuration registers to file (or stdout)\n");
+    fprintf(stderr, "  config diff|apply <file>                      Show or write the registers that differ from file\n");
+    fprintf(stderr, "  fs ls [root|conf|log|schedule] [--json]       List files on Witty Pi disk (cached)\n");
+    fprintf(stderr, "Register names:");
+    for (int i = 0; i < REG_COUNT; i ++) {
+        fprintf(stderr, "%s%s", i % 6 ? " " : "\n  ", register_table[i].name);
+    }
+    fprintf(stderr, "\n");
+    return 2;
+}
+
+
+// Reject an unknown or malformed option
+static int reject_option(const char *option) {
+    fprintf(stderr, "Invalid option: %s\n", option);
+    return print_usage();
+}
+
+
+/**
+ * Run a non-interactive command
+ * 
+ * @param argc The number of command arguments
+ * @param argv The command arguments, starting with the command name
+ * @param json Whether to print as JSON
+ * @return The exit code
+ */
+int run_command(int argc, char **argv, bool json) {
+    if (strcmp(argv[0], "status") == 0 && argc == 1) {
+        return command_status(json);
+    } else if (strcmp(argv[0], "get") == 0 && argc >= 2) {
+        return command_get(argc - 1, argv + 1, json);
+    } else if (strcmp(argv[0], "set") == 0 && argc == 3) {
+        return command_set(argv[1], argv[2]);
+    } else if (strcmp(argv[0], "schedule") == 0 && argc == 3) {
+        return command_schedule(argv[1], argv[2]);
+    } else if (strcmp(argv[0], "sync") == 0 && argc == 2) {
+        return command_sync(argv[1]);
+    } else if (strcmp(argv[0], "top") == 0 && argc == 1) {
+        return command_top();
+    } else if (strcmp(argv[0], "stream") == 0 && argc == 1) {
+        return command_stream(stream_rate, stream_format);
+    } else if (strcmp(argv[0], "config") == 0 && argc <= 3 && argc >= 2 && strcmp(argv[1], "export") == 0) {
+        return command_config_export(argc == 3 ? argv[2] : NULL);
+    } else if (strcmp(argv[0], "config") == 0 && argc == 3 && (strcmp(argv[1], "apply") == 0 || strcmp(argv[1], "diff") == 0)) {
+        return command_config_apply(argv[2], strcmp(argv[1], "diff") == 0);
+    } else if (strcmp(argv[0], "fs") == 0 && argc <= 3 && argc >= 2 && strcmp(argv[1], "ls") == 0) {
+        return command_fs_ls(argc == 3 ? argv[2] : NULL, json);
+    } else if (strcmp(argv[0], "fs") == 0 && argc >= 2
+               && (strcmp(argv[1], "get") == 0 || strcmp(argv[1], "put") == 0 || strcmp(argv[1], "rm") == 0)) {
+        fprintf(stderr, "Firmware can not transfer or remove files over I2C, please access Witty Pi disk as USB drive.\n");
+        return 2;
+    }
+    return print_usage();
+}
+
+
 /**
  * Main function
  */
 int main(int argc, char *argv[]) {
     
     
-    // Process --debug arguments
+    // Process --debug, --ntp-servers, --trace, --capture, --replay, --bench-retry, --bench-threads, --json, --rate and --format arguments,
+    // other arguments make a non-interactive command
     bool debug = false;
+    bool json = false;
+    char **command_argv = calloc(argc, sizeof(char *));
+    if (command_argv == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    int command_argc = 0;
+    int bench_operations = 0;
+    int bench_threads = 0;
+    const char *bench_faults = NULL;
     for (int i = 1; i < argc; i ++) {
         if (strcmp(argv[i], "--debug") == 0) {
             debug = true;
+        } else if (strncmp(argv[i], "--ntp-servers=", 14) == 0) {
+            set_ntp_servers(argv[i] + 14);
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            start_trace_recording(argv[i] + 8);
+        } else if (strcmp(argv[i], "--flock-compat") == 0) {
+            set_flock_compat(true);
+        } else if (strncmp(argv[i], "--capture=", 10) == 0) {
+            start_capture(argv[i] + 10);
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replaying = use_replay_transport(argv[i] + 9, false);
+        } else if (strncmp(argv[i], "--replay-realtime=", 18) == 0) {
+            replaying = use_replay_transport(argv[i] + 18, true);
+        } else if (strcmp(argv[i], "--bench-retry") == 0) {
+            bench_operations = 2000;
+        } else if (strncmp(argv[i], "--bench-retry=", 14) == 0) {
+            if (!is_valid_integer_in_range(argv[i] + 14, 1, 100000000, &bench_operations)) {
+                return reject_option(argv[i]);
+            }
+        } else if (strncmp(argv[i], "--bench-threads=", 16) == 0) {
+            if (!is_valid_integer_in_range(argv[i] + 16, 1, 1024, &bench_threads)) {
+                return reject_option(argv[i]);
+            }
+        } else if (strncmp(argv[i], "--faults=", 9) == 0) {
+            bench_faults = argv[i] + 9;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strncmp(argv[i], "--rate=", 7) == 0) {
+            char *end;
+            stream_rate = strtod(argv[i] + 7, &end);
+            if (end == argv[i] + 7 || *end != '\0') {
+                return reject_option(argv[i]);
+            }
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            stream_format = argv[i] + 9;
+        } else if (strncmp(argv[i], "--", 2) != 0) {
+            command_argv[command_argc ++] = argv[i];
+        } else {
+            return reject_option(argv[i]);
         }
     }
     set_log_mode(debug ? LOG_WITH_TIME : LOG_NONE);
     
+    if (bench_operations > 0) {
+        benchmark_retry_policies(bench_operations, bench_faults);
+        return 0;
+    }
+    if (bench_threads > 0) {
+        benchmark_threads(bench_threads);
+        return 0;
+    }
+    if (command_argc > 0) {
+        return run_command(command_argc, command_argv, json);
+    }
+    
     // Register signal handler
     signal(SIGINT, handle_signal);
 
@@ -1234,8 +2457,13 @@ int main(int argc, char *argv[]) {
     printf("================================================================================\n");
 
     // Main loop
+    trace_begin("wp5 session");
     while (running) {
+        trace_begin("info_bar");
         do_info_bar();
+        trace_end("info_bar");
+        trace_begin("main_menu");
         do_main_menu();
+        trace_end("main_menu");
     }
 }
\ No newline at end of file
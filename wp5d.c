@@ -3,9 +3,16 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 #include <signal.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/timex.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "wp5lib.h"
 
@@ -18,26 +25,424 @@
 
 #define PID_FILE_PATH           "/run/wp5d.pid"
 
+#define DRIFT_DIR_PATH          "/var/lib/wp5d"
+#define DRIFT_FILE_PATH         DRIFT_DIR_PATH "/rtc_drift"
 
-bool running = true;
+#define DRIFT_FIRST_CHECK_SEC   60          // First clock check after board is connected
+#define DRIFT_SAMPLE_INTERVAL   3600        // Interval for sampling RTC offset while system time is synced
+#define DRIFT_SLEW_INTERVAL     900         // Interval for correcting system time while offline
+#define DRIFT_MIN_FIT_SPAN      21600       // Minimum time span of samples to fit drift rate
+#define DRIFT_MIN_SAMPLES       3           // Minimum number of samples to fit drift rate
+#define DRIFT_MAX_PPM           500.0       // Drift rate beyond this is considered bogus
+#define DRIFT_JUMP_SEC          0.1         // RTC offset this far from prediction means RTC was written by others
+#define DRIFT_UNKNOWN_PPM       100.0       // Drift rate to allow for in the prediction before it is learned
+
+#define RTC_MAX_ERROR_SEC       0.5         // Rewrite RTC when predicted error goes beyond this
+#define SLEW_MIN_ERROR_SEC      0.01        // Do not slew system time for smaller error
+#define SLEW_MAX_ERROR_SEC      2.0         // Step system time instead of slewing for larger error
+
+#define READY_TIMEOUT_SEC       15          // Report readiness anyway if system time can not be validated in time
+
+#define METRICS_FILE_PATH       "/run/wp5d.prom"
+
+#define LATENCY_WINDOW_SEC      60          // Latency statistics cover the last one or two windows
+#define LATENCY_MIN_SAMPLES     20          // Do not judge p99 with fewer operations
+#define LATENCY_SLO_DEFAULT_MS  50.0        // Default SLO for p99 latency of every transaction class
+
+#define SNAPSHOT_FAST_MS        200         // Interval for publishing live registers while a viewer is watching
+#define SNAPSHOT_VIEWER_MS      2000        // A viewer that has not read the snapshot for this long is gone
+
+
+// Learned RTC drift, persisted in DRIFT_FILE_PATH
+typedef struct {
+    double drift_ppm;           // RTC drift rate (positive means RTC runs fast), 0 if unknown
+    double rtc_set_time;        // System time when RTC was written
+    double rtc_set_offset;      // RTC offset right after it was written
+    int n;                      // Number of samples since RTC was written
+    double sx, sy, sxx, sxy;    // Sums for least squares fitting (x=elapsed seconds, y=offset)
+} RtcDrift;
+
+
+volatile sig_atomic_t running = true;
+
+volatile sig_atomic_t caught_signal = 0;
 
 int i2c_dev = -1;
 
+bool replaying = false;
+
+RtcDrift drift = { 0 };
+
+time_t next_clock_check = 0;
+
+uint64_t watchdog_usec = 0;
+
+struct timespec last_watchdog = { 0 };
+
+double latency_slo_ms = LATENCY_SLO_DEFAULT_MS;
+
+time_t next_latency_check = 0;
+
+bool latency_breached[TX_CLASS_COUNT] = { false };
+
 
 /**
- * Signal handler
+ * Send a state notification to systemd (same protocol as sd_notify)
+ *
+ * @param state The state string, e.g. "READY=1"
+ * @return true if sent, false if not running under systemd or failed
+ */
+bool notify_systemd(const char *state) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (path == NULL || (path[0] != '/' && path[0] != '@')) {
+        return false;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path, path_len);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0';   // Abstract namespace
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path_len;
+    bool result = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, addr_len) >= 0;
+    close(fd);
+    return result;
+}
+
+
+/**
+ * Read watchdog interval from environment set by systemd (WatchdogSec)
+ */
+void init_watchdog(void) {
+    const char *usec = getenv("WATCHDOG_USEC");
+    const char *pid = getenv("WATCHDOG_PID");
+    if (usec == NULL || (pid != NULL && atoi(pid) != getpid())) {
+        return;
+    }
+    watchdog_usec = strtoull(usec, NULL, 10);
+    if (watchdog_usec > 0) {
+        print_log("Systemd watchdog enabled, timeout = %llu ms\n", (unsigned long long)(watchdog_usec / 1000));
+    }
+}
+
+
+/**
+ * Send keepalive to systemd watchdog, at half of the watchdog interval
+ */
+void feed_watchdog(void) {
+    if (watchdog_usec == 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed = (now.tv_sec - last_watchdog.tv_sec) * 1000000ULL + (now.tv_nsec - last_watchdog.tv_nsec) / 1000;
+    if (elapsed >= watchdog_usec / 2) {
+        notify_systemd("WATCHDOG=1");
+        last_watchdog = now;
+    }
+}
+
+
+/**
+ * Signal handler, only flags the main loop to stop, cleaning up is done after it
  */
 void handle_signal(int signum) {
-    
-    print_log("Caught signal %d\n", signum);
-    
+    caught_signal = signum;
     running = false;
-    
-    close_i2c_device(i2c_dev);
-    
-    print_log("Exit now.\n");
-    
-    exit(0);
+}
+
+
+/**
+ * Get current system time in seconds, with sub-second precision
+ */
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Load learned RTC drift from file
+ */
+void load_drift(void) {
+    FILE *fp = fopen(DRIFT_FILE_PATH, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        sscanf(line, "drift_ppm=%lf", &drift.drift_ppm);
+        sscanf(line, "rtc_set_time=%lf", &drift.rtc_set_time);
+        sscanf(line, "rtc_set_offset=%lf", &drift.rtc_set_offset);
+        sscanf(line, "n=%d", &drift.n);
+        sscanf(line, "sx=%lf", &drift.sx);
+        sscanf(line, "sy=%lf", &drift.sy);
+        sscanf(line, "sxx=%lf", &drift.sxx);
+        sscanf(line, "sxy=%lf", &drift.sxy);
+    }
+    fclose(fp);
+    print_log("Loaded RTC drift: %.3f ppm (%d samples)\n", drift.drift_ppm, drift.n);
+}
+
+
+/**
+ * Save learned RTC drift to file
+ */
+void save_drift(void) {
+    if (mkdir(DRIFT_DIR_PATH, 0755) < 0 && errno != EEXIST) {
+        print_log("Can not create directory: %s\n", DRIFT_DIR_PATH);
+        return;
+    }
+    FILE *fp = fopen(DRIFT_FILE_PATH, "w");
+    if (fp == NULL) {
+        print_log("Can not write to drift file: %s\n", DRIFT_FILE_PATH);
+        return;
+    }
+    fprintf(fp, "drift_ppm=%.6f\n", drift.drift_ppm);
+    fprintf(fp, "rtc_set_time=%.3f\n", drift.rtc_set_time);
+    fprintf(fp, "rtc_set_offset=%.6f\n", drift.rtc_set_offset);
+    fprintf(fp, "n=%d\n", drift.n);
+    fprintf(fp, "sx=%.6f\nsy=%.9f\nsxx=%.6f\nsxy=%.9f\n", drift.sx, drift.sy, drift.sxx, drift.sxy);
+    fclose(fp);
+}
+
+
+/**
+ * Predict RTC error (RTC time minus true time) at given time
+ */
+double predict_rtc_error(double t) {
+    return drift.rtc_set_offset + drift.drift_ppm / 1e6 * (t - drift.rtc_set_time);
+}
+
+
+/**
+ * Restart drift fitting from given RTC offset, the learned drift rate is kept
+ *
+ * @param t The time of the offset, 0 if there is no usable history
+ * @param offset The RTC offset at that time
+ */
+void restart_drift(double t, double offset) {
+    drift.rtc_set_time = t;
+    drift.rtc_set_offset = offset;
+    drift.n = 0;
+    drift.sx = drift.sy = drift.sxx = drift.sxy = 0.0;
+    save_drift();
+}
+
+
+/**
+ * Write system time into RTC and restart drift fitting
+ */
+bool rewrite_rtc(void) {
+    if (!system_to_rtc_precise()) {
+        print_log("Failed writing system time into RTC.\n");
+        return false;
+    }
+    double offset;
+    restart_drift(now_seconds(), get_rtc_offset(&offset) ? offset : 0.0);
+    print_log("RTC is rewritten, offset after writing is %+.3fs\n", drift.rtc_set_offset);
+    return true;
+}
+
+
+/**
+ * Add an offset sample (taken while system time is synced) and refit drift rate
+ *
+ * @param t The time of sample
+ * @param offset The measured RTC offset
+ */
+void add_drift_sample(double t, double offset) {
+    double x = t - drift.rtc_set_time;
+    drift.n ++;
+    drift.sx += x;
+    drift.sy += offset;
+    drift.sxx += x * x;
+    drift.sxy += x * offset;
+
+    double span = x;
+    double denominator = drift.n * drift.sxx - drift.sx * drift.sx;
+    if (drift.n >= DRIFT_MIN_SAMPLES && span >= DRIFT_MIN_FIT_SPAN && denominator > 0) {
+        double slope = (drift.n * drift.sxy - drift.sx * drift.sy) / denominator;
+        double ppm = slope * 1e6;
+        if (fabs(ppm) < DRIFT_MAX_PPM) {
+            drift.drift_ppm = ppm;
+            drift.rtc_set_offset = (drift.sy - slope * drift.sx) / drift.n;
+        }
+    }
+    save_drift();
+}
+
+
+/**
+ * Maintain RTC and system clock
+ * While system time is synced, RTC offset is sampled to learn the drift, and RTC
+ * is rewritten once the predicted error gets too large. While offline, system time
+ * is slewed according to RTC time corrected by the learned drift.
+ */
+void maintain_clock(void) {
+    double offset;
+    if (!get_rtc_offset(&offset)) {
+        next_clock_check = time(NULL) + DRIFT_SLEW_INTERVAL;
+        return;
+    }
+    double t = now_seconds();
+    if (is_system_time_synced()) {
+        next_clock_check = time(NULL) + DRIFT_SAMPLE_INTERVAL;
+        if (drift.rtc_set_time <= 0 || fabs(offset) > RTC_MAX_ERROR_SEC * 4) {
+            print_log("RTC offset is %+.3fs, no usable history, rewriting RTC...\n", offset);
+            rewrite_rtc();
+            return;
+        }
+        // A jump away from the prediction means RTC was written elsewhere (e.g. wp5 sync rtc), older samples are void
+        double tolerance = DRIFT_JUMP_SEC + (drift.drift_ppm == 0 ? DRIFT_UNKNOWN_PPM / 1e6 * (t - drift.rtc_set_time) : 0);
+        if (fabs(offset - predict_rtc_error(t)) > tolerance) {
+            print_log("RTC offset jumped to %+.3fs, restarting drift fitting...\n", offset);
+            restart_drift(t, offset);
+        } else {
+            add_drift_sample(t, offset);
+        }
+        double predicted = predict_rtc_error(t);
+        print_log("RTC offset: %+.3fs, predicted: %+.3fs, drift: %+.3f ppm\n", offset, predicted, drift.drift_ppm);
+        if (fabs(predicted) > RTC_MAX_ERROR_SEC || fabs(offset) > RTC_MAX_ERROR_SEC * 2) {
+            rewrite_rtc();
+        }
+    } else {
+        next_clock_check = time(NULL) + DRIFT_SLEW_INTERVAL;
+        if (drift.rtc_set_time <= 0) {
+            return;     // Nothing learned yet
+        }
+        // offset = RTC - SYS, and RTC = TRUE + rtc_error, so SYS - TRUE = rtc_error - offset
+        double sys_error = predict_rtc_error(t) - offset;
+        if (fabs(sys_error) < SLEW_MIN_ERROR_SEC) {
+            return;
+        }
+        if (fabs(sys_error) > SLEW_MAX_ERROR_SEC) {
+            struct timespec ts;
+            double corrected = now_seconds() - sys_error;
+            ts.tv_sec = (time_t)corrected;
+            ts.tv_nsec = (long)((corrected - ts.tv_sec) * 1e9);
+            if (clock_settime(CLOCK_REALTIME, &ts) == 0) {
+                print_log("System time is stepped by %+.3fs according to RTC.\n", -sys_error);
+            } else {
+                print_log("Failed stepping system time.\n");
+            }
+        } else {
+            struct timex tx;
+            memset(&tx, 0, sizeof(tx));
+            tx.modes = ADJ_OFFSET_SINGLESHOT;
+            tx.offset = (long)(-sys_error * 1e6);
+            if (adjtimex(&tx) >= 0) {
+                print_log("System time is slewed by %+.3fs according to RTC.\n", -sys_error);
+            } else {
+                print_log("Failed slewing system time.\n");
+            }
+        }
+    }
+}
+
+
+/**
+ * Write a metric without labels in Prometheus text format, with its own HELP and TYPE lines
+ */
+void write_metric(FILE *fp, const char *name, const char *type, const char *help, double value) {
+    fprintf(fp, "# HELP %s %s\n", name, help);
+    fprintf(fp, "# TYPE %s %s\n", name, type);
+    fprintf(fp, "%s %.15g\n", name, value);
+}
+
+
+/**
+ * Check p99 latency of every transaction class against the SLO, warn when it drifts above
+ * and export the latency metrics in Prometheus text format
+ */
+void check_latency_slo(void) {
+    FILE *fp = fopen(METRICS_FILE_PATH ".tmp", "w");
+    if (fp) {
+        fprintf(fp, "# HELP wp5_latency_seconds I2C operation latency over the last %d to %d seconds.\n", LATENCY_WINDOW_SEC, LATENCY_WINDOW_SEC * 2);
+        fprintf(fp, "# TYPE wp5_latency_seconds summary\n");
+    }
+    for (int i = 0; i < TX_CLASS_COUNT; i ++) {
+        LatencyStats stats;
+        get_latency_stats(i, &stats);
+        if (stats.count >= LATENCY_MIN_SAMPLES) {
+            bool breached = stats.p99_us > latency_slo_ms * 1000;
+            if (breached && !latency_breached[i]) {
+                print_log_level(LOG_LEVEL_WARNING, "Latency SLO breached: %s p99 is %.2f ms (SLO %.2f ms, p50 %.2f ms, max %.2f ms, %lu ops)\n",
+                                tx_class_names[i], stats.p99_us / 1000, latency_slo_ms, stats.p50_us / 1000, stats.max_us / 1000, stats.count);
+            } else if (!breached && latency_breached[i]) {
+                print_log("Latency SLO met again: %s p99 is %.2f ms\n", tx_class_names[i], stats.p99_us / 1000);
+            }
+            latency_breached[i] = breached;
+        }
+        if (fp) {
+            fprintf(fp, "wp5_latency_seconds{class=\"%s\",quantile=\"0.5\"} %.6f\n", tx_class_names[i], stats.p50_us / 1e6);
+            fprintf(fp, "wp5_latency_seconds{class=\"%s\",quantile=\"0.99\"} %.6f\n", tx_class_names[i], stats.p99_us / 1e6);
+            fprintf(fp, "wp5_latency_seconds_sum{class=\"%s\"} %.6f\n", tx_class_names[i], stats.sum_us / 1e6);
+            fprintf(fp, "wp5_latency_seconds_count{class=\"%s\"} %lu\n", tx_class_names[i], stats.count);
+        }
+    }
+    if (fp) {
+        fprintf(fp, "# HELP wp5_latency_slo_breached Whether p99 latency is above the SLO.\n");
+        fprintf(fp, "# TYPE wp5_latency_slo_breached gauge\n");
+        for (int i = 0; i < TX_CLASS_COUNT; i ++) {
+            fprintf(fp, "wp5_latency_slo_breached{class=\"%s\"} %d\n", tx_class_names[i], latency_breached[i] ? 1 : 0);
+        }
+        ArbiterStats arb;
+        if (get_arbiter_stats(&arb)) {
+            write_metric(fp, "wp5_arbiter_acquisitions_total", "counter", "I2C bus acquisitions by all processes.", arb.acquisitions);
+            write_metric(fp, "wp5_arbiter_contended_total", "counter", "I2C bus acquisitions that found the bus held or other waiters.", arb.contended);
+            write_metric(fp, "wp5_arbiter_wait_seconds_total", "counter", "Time spent waiting for the I2C bus.", arb.wait_us_total / 1e6);
+            write_metric(fp, "wp5_arbiter_wait_seconds_max", "gauge", "Longest wait for the I2C bus.", arb.wait_us_max / 1e6);
+            write_metric(fp, "wp5_arbiter_priority_handoffs_total", "counter", "High priority waiters queued ahead of normal ones.", arb.priority_handoffs);
+            write_metric(fp, "wp5_arbiter_owner_dead_total", "counter", "Times the I2C bus was recovered from a process that died holding it.", arb.owner_dead);
+            write_metric(fp, "wp5_arbiter_waiters", "gauge", "Processes waiting for the I2C bus.", arb.waiters);
+        }
+        fclose(fp);
+        rename(METRICS_FILE_PATH ".tmp", METRICS_FILE_PATH);
+    }
+    rotate_latency_window();
+    next_latency_check = time(NULL) + LATENCY_WINDOW_SEC;
+}
+
+
+/**
+ * Read live registers in one transaction and publish them for viewers like "wp5 top", if there is any
+ */
+void publish_live_snapshot(void) {
+    long idle_ms = published_snapshot_idle_ms();
+    if (idle_ms < 0 || idle_ms >= SNAPSHOT_VIEWER_MS) {
+        return;
+    }
+    RegisterSnapshot snap;
+    if (get_live_snapshot(&snap)) {
+        publish_register_snapshot(&snap);
+    }
+}
+
+
+/**
+ * Sleep until the next tick, while a viewer is watching keep publishing live registers in between
+ * 
+ * @param connected Whether Witty Pi is connected
+ */
+void sleep_until_next_tick(bool connected) {
+    struct timespec interval = { 0, SNAPSHOT_FAST_MS * 1000000L };
+    for (int elapsed = 0; running && elapsed < 1000; elapsed += SNAPSHOT_FAST_MS) {
+        nanosleep(&interval, NULL);
+        if (connected && elapsed + SNAPSHOT_FAST_MS < 1000) {
+            publish_live_snapshot();
+        }
+    }
 }
 
 
@@ -73,8 +478,29 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Process --poweroff and --reboot arguments
+    // Process --poweroff, --reboot, --trace, --latency-slo-ms, --flock-compat, --reset-controller, --capture and --replay arguments
     for (int i = 1; i < argc; i ++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            start_trace_recording(argv[i] + 8);
+        }
+        if (strncmp(argv[i], "--latency-slo-ms=", 17) == 0) {
+            latency_slo_ms = atof(argv[i] + 17);
+        }
+        if (strcmp(argv[i], "--flock-compat") == 0) {
+            set_flock_compat(true);
+        }
+        if (strcmp(argv[i], "--reset-controller") == 0) {
+            set_controller_reset(true);
+        }
+        if (strncmp(argv[i], "--capture=", 10) == 0) {
+            start_capture(argv[i] + 10);
+        }
+        if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replaying = use_replay_transport(argv[i] + 9, false);
+        }
+        if (strncmp(argv[i], "--replay-realtime=", 18) == 0) {
+            replaying = use_replay_transport(argv[i] + 18, true);
+        }
         if (strcmp(argv[i], "--poweroff") == 0) {
             i2c_set(-1, I2C_ADMIN_SHUTDOWN, ADMIN_RPI_POWERING_OFF);
             exit(0);
@@ -85,6 +511,12 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    // Log through background writer from now on, so logging never stalls the bus path
+    set_log_async(true);
+    
+    // Shutdown requests and heartbeats are polled here, let them go ahead of other tools waiting for the bus
+    set_i2c_priority(true);
+    
     // Save PID to file
     pid_t current_pid = getpid();
     print_log("Witty Pi 5 daemon V%s started. PID = %d\n", SOFTWARE_VERSION_STR, current_pid);
@@ -98,30 +530,68 @@ int main(int argc, char *argv[]) {
     
     // Register signal handler
     signal(SIGINT, handle_signal);
-
-    // Print system information
-    print_sys_info();
+    signal(SIGTERM, handle_signal);
     
-    // Print Raspberry Pi information
-    print_pi_info();
+    init_watchdog();
     
-    // Main loop
+    // Main loop, the first iteration runs immediately so RTC time gets restored as early as possible
     i2c_dev = open_i2c_device();
     int cur_model = MODEL_UNKNOWN;
+    bool ready = false;
+    time_t ready_deadline = time(NULL) + READY_TIMEOUT_SEC;
+    next_latency_check = time(NULL) + LATENCY_WINDOW_SEC;
+    bool first_loop = true;
+    bool connected = false;
+    trace_begin("wp5d session");
     while (running) {
-        sleep(1);
+        if (!first_loop) {
+            trace_end("tick");
+            sleep_until_next_tick(connected);
+        }
+        first_loop = false;
+        trace_begin("tick");
+        feed_watchdog();
         
-        // Try to connect Witty Pi
+        // Track Witty Pi connection, probing happens only while it is not connected
+        BoardState state = update_board_state();
         int model = get_wittypi_model();
+        bool time_restored = false;
+        if (state != BOARD_CONNECTED && cur_model != MODEL_UNKNOWN) {
+            print_log("Lost connection to %s, trying to recover...\n", wittypi_models[cur_model]);
+            i2c_dev = recover_i2c_device(i2c_dev);
+            feed_watchdog();
+            if (i2c_dev >= 0) {
+                RecoveryStats stats;
+                get_recovery_stats(&stats);
+                char status[128];
+                snprintf(status, sizeof(status), "STATUS=Witty Pi connected, bus recovered %d time(s), last in %d ms", stats.recovered, stats.last_ms);
+                notify_systemd(status);
+                state = BOARD_CONNECTED;
+            } else {
+                cur_model = MODEL_UNKNOWN;
+            }
+        }
+        if (state == BOARD_CONNECTED && i2c_dev < 0) {
+            i2c_dev = open_i2c_device();
+        }
         if (model != cur_model && model > MODEL_UNKNOWN && model < wittypi_models_count) {
             cur_model = model;
-            print_log("Connected to %s\n", wittypi_models[model]);
+            int fw_major, fw_minor;
+            if (get_firmware_version(&fw_major, &fw_minor)) {
+                print_log("Connected to %s (firmware %d.%02d)\n", wittypi_models[model], fw_major, fw_minor);
+            } else {
+                print_log("Connected to %s\n", wittypi_models[model]);
+            }
+            
+            // Load learned drift before RTC may get written below
+            load_drift();
             
             // Synchronize time once
             DateTime dt;
             if (get_rtc_time(&dt) && is_time_valid(&dt)) {
                 print_log("RTC has valid time, write RTC time into system...\n");
                 if (rtc_to_system()) {
+                    time_restored = true;
                     print_log("Done :)\n");
                 } else {
                     print_log("Failed :(\n");
@@ -129,6 +599,7 @@ int main(int argc, char *argv[]) {
             } else {
                 print_log("RTC has invalid time, write system time into RTC...\n");
                 if (system_to_rtc()) {
+                    restart_drift(0, 0.0);     // Written from unverified system time, RTC gets rewritten once synced
                     print_log("Done :)\n");
                 } else {
                     print_log("Failed :(\n");
@@ -138,10 +609,42 @@ int main(int argc, char *argv[]) {
             // Print startup reason once
             int reason = get_startup_reason();
             print_log("Startup reason: %s\n", action_reasons[reason >= action_reasons_count ? ACTION_REASON_UNKNOWN : reason]);
+            
+            // Schedule the first clock check
+            next_clock_check = time(NULL) + DRIFT_FIRST_CHECK_SEC;
         }
-        if (model == MODEL_UNKNOWN) {   // Witty Pi not detected, retry later
+        
+        // Report readiness once system time is valid
+        if (!ready && (time_restored || is_system_time_synced() || time(NULL) >= ready_deadline)) {
+            ready = true;
+            if (!time_restored && !is_system_time_synced()) {
+                print_log("System time is not validated, report readiness anyway.\n");
+            }
+            notify_systemd(cur_model == MODEL_UNKNOWN ? "READY=1\nSTATUS=Witty Pi not detected" : "READY=1\nSTATUS=Witty Pi connected");
+            
+            // Print system information
+            print_sys_info();
+            
+            // Print Raspberry Pi information
+            print_pi_info();
+        }
+        // Watch bus latency, degrading latency is the earliest sign of a failing board or connector
+        if (time(NULL) >= next_latency_check) {
+            check_latency_slo();
+        }
+        
+        connected = (model != MODEL_UNKNOWN);
+        if (!connected) {   // Witty Pi not detected, retry later
             continue;
         }
+        
+        // Publish live registers, so watching the board never needs another bus user
+        publish_live_snapshot();
+        
+        // Learn RTC drift and keep clocks disciplined
+        if (time(NULL) >= next_clock_check) {
+            maintain_clock();
+        }
        
         if (i2c_get(i2c_dev, I2C_ADMIN_SHUTDOWN) == ADMIN_TURN_RPI_OFF) {   // Poll for shutdown request / implicitly send heartbeat
             print_log("Detected shutdown request, clearing and shutdown...\n");
@@ -161,6 +664,38 @@ int main(int argc, char *argv[]) {
     }
     
     // Clean up and exit
+    if (caught_signal) {
+        print_log("Caught signal %d\n", caught_signal);
+    }
+    
+    notify_systemd("STOPPING=1");
+    
+    trace_end("tick");
+    trace_end("wp5d session");
+    
     close_i2c_device(i2c_dev);
+    
+    RecoveryStats stats;
+    get_recovery_stats(&stats);
+    if (stats.attempts > 0) {
+        print_log("I2C bus recovery: %d attempt(s), %d recovered, %d adapter reset(s), time to recover mean %ld ms, max %d ms.\n",
+                  stats.attempts, stats.recovered, stats.adapter_resets, stats.recovered ? stats.total_ms / stats.recovered : 0, stats.max_ms);
+    }
+    
+    ArbiterStats arb;
+    if (get_arbiter_stats(&arb) && arb.acquisitions > 0) {
+        print_log("I2C arbiter: %lu acquisition(s), %lu contended, wait mean %llu us, max %llu us, %lu priority handoff(s), %lu recovered from dead holder(s).\n",
+                  arb.acquisitions, arb.contended, (unsigned long long)(arb.wait_us_total / arb.acquisitions),
+                  (unsigned long long)arb.wait_us_max, arb.priority_handoffs, arb.owner_dead);
+    }
+    
+    if (replaying) {
+        int matched, mismatched, skipped, remaining;
+        get_replay_stats(&matched, &mismatched, &skipped, &remaining);
+        print_log("Replay: %d matched, %d mismatched, %d skipped, %d remaining.\n", matched, mismatched, skipped, remaining);
+    }
+    
+    print_log("Exit now.\n");
+    
     return 0;
 }
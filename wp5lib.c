@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -14,19 +15,75 @@
 #include <sys/ioctl.h>
 #include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <sys/sysmacros.h>
 #include <sys/socket.h>
+#include <sys/timex.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #include "wp5lib.h"
 
 
+/*
+ * Static tracepoints (USDT), available when built with <sys/sdt.h> (systemtap-sdt-dev).
+ * Each probe has a semaphore that tracers (bpftrace, perf) increment when attached,
+ * so arguments such as durations are only computed while somebody is listening.
+ */
+#if defined(__has_include) && !defined(WP5_NO_TRACE)
+#if __has_include(<sys/sdt.h>)
+#define WP5_HAS_USDT
+#endif
+#endif
+
+#ifdef WP5_HAS_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define WP5_TRACE_SEMAPHORE(name)   unsigned short wp5_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define WP5_TRACE_ENABLED(name)     __builtin_expect(*(volatile unsigned short *)&wp5_##name##_semaphore, 0)
+#define WP5_TRACE(name, ...)        STAP_PROBEV(wp5, name, ##__VA_ARGS__)
+#else
+static inline void wp5_trace_noop(int unused, ...) { (void)unused; }
+#define WP5_TRACE_SEMAPHORE(name)   extern int wp5_trace_unused_##name
+#define WP5_TRACE_ENABLED(name)     0
+#define WP5_TRACE(name, ...)        do { if (0) wp5_trace_noop(0, ##__VA_ARGS__); } while (0)
+#endif
+
+WP5_TRACE_SEMAPHORE(lock_acquire);     // (attempts, wait_us, success)
+WP5_TRACE_SEMAPHORE(lock_release);     // (held_us)
+WP5_TRACE_SEMAPHORE(i2c_retry);        // (index, attempt, errno)
+WP5_TRACE_SEMAPHORE(i2c_get);          // (index, attempts, duration_us, value)
+WP5_TRACE_SEMAPHORE(i2c_set);          // (index, value, attempts, duration_us, success)
+WP5_TRACE_SEMAPHORE(stream_read);      // (index, length, duration_us)
+WP5_TRACE_SEMAPHORE(stream_write);     // (index, length, duration_us)
+WP5_TRACE_SEMAPHORE(admin_command);    // (psw_cmd, duration_us, success)
+
+
+#define LOG_RING_SLOTS                  256
+#define LOG_LINE_MAX                    256
+#define LOG_RATE_PER_SEC                20
+#define LOG_RATE_BURST                  100
+
 #define ACQUIRE_I2C_LOCK_MAX_ATTEMPTS   5
 #define ACQUIRE_I2C_LOCK_INTERVAL_US    200000
 
+#define ARBITER_MAGIC                   0x57503541  // "WP5A"
+#define ARBITER_QUEUE_SIZE              64
+#define ARBITER_POLL_MS                 100         // Interval to look for crashed holder and waiters while waiting
+#define ARBITER_INIT_TIMEOUT_MS         1000
+#define ARBITER_LOCK_TOKEN              INT_MAX     // Returned by lock_file() when the bus is held through the arbiter
+
 #define I2C_POST_WRITE_SETTLE_DELAY_US  1000
 
 #define I2C_WRITE_MAX_ATTEMPTS			10
@@ -35,8 +92,203 @@
 #define I2C_READ_MAX_ATTEMPTS   		10
 #define I2C_READ_VALIDATE_COUNT   		2
 
+#define I2C_RETRY_DELAY_US              1000
+#define I2C_RETRY_DELAY_MAX_US          16000
+
+#define RETRY_ERROR_RATE_WEIGHT         16      // Weight of history in error rate (EWMA), 1/16 per transaction
+#define RETRY_HEALTHY_ERROR_RATE        0.01    // Error rate below which validated read takes single read
+#define RETRY_SAMPLE_INTERVAL           16      // Fully validate one of this many fast path reads
+#define BREAKER_THRESHOLD               5
+#define BREAKER_COOLDOWN_MIN_MS         500
+#define BREAKER_COOLDOWN_MAX_MS         30000
+
+#define BOARD_PROBE_ATTEMPTS            3
+#define BOARD_PROBE_RETRY_DELAY_US      10000
+#define BOARD_BACKOFF_MIN_MS            250
+#define BOARD_BACKOFF_MAX_MS            30000
+#define BOARD_LOST_FAILURES             3
+
+#define RECOVERY_BUDGET_MS              5000
+#define RECOVERY_RETRY_DELAY_MIN_MS     20
+#define RECOVERY_RETRY_DELAY_MAX_MS     500
+#define RECOVERY_RESET_SETTLE_US        100000
+#define FIRMWARE_RELOAD_WINDOW_MS       30000       // The board may be gone this long after it is told to reload
+
+#define ADMIN_POLL_MIN_MS               5
+#define ADMIN_POLL_MAX_MS               200
+#define ADMIN_RELOAD_GRACE_MS           3000        // A reloading command is done if the board is still there after this
+
+#define LISTING_TIMEOUT_MS              10000
+#define LISTING_CHUNK_SIZE              32          // Bytes read from download stream before parsing them
+#define LISTING_MAX_BYTES               (1 << 20)   // Give up on a stream that never ends
+#define LISTING_ARENA_INITIAL           256
+#define LISTING_ENTRIES_INITIAL         16
+#define LISTING_CACHE_PATH              "/dev/shm/wp5_listing_%u_%d"    // Cached listing of each user and directory
+#define LISTING_CACHE_TTL_SEC           600         // Files may also change through USB drive, list again after this
+
+#define ADAPTER_CACHE_SIZE              4
+#define KERNEL_MAX_HANDLES              256
+#define I2C_BATCH_MAX_REGS              (I2C_RDWR_IOCTL_MAX_MSGS / 2)
+
+#define LATENCY_SUB_BUCKET_BITS         4       // 16 sub-buckets per power of two, within 6.25% error
+#define LATENCY_SUB_BUCKETS             (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS                 (28 * LATENCY_SUB_BUCKETS)  // Up to 2^31 us
+
+#define RTC_OFFSET_POLL_INTERVAL_US     2000
+#define RTC_OFFSET_TIMEOUT_US           1200000
+
+#define RTC_WRITE_MARGIN_NS             200000000L
+
+#define SYNCED_MAX_ERROR_US             100000
+
+#define NTP_DEFAULT_SERVERS             "pool.ntp.org,time.google.com,time.cloudflare.com"
+#define NTP_DEFAULT_PORT                "123"
+#define NTP_PACKET_SIZE                 48
+#define NTP_UNIX_EPOCH_DIFF             2208988800LL
+
+#define SNTP_MAX_SERVERS                8
+#define SNTP_TIMEOUT_MS                 2000
+
+#define CAPTURE_MAGIC                   "WP5T"
+#define CAPTURE_VERSION                 1
+#define REPLAY_RESYNC_WINDOW            64
+
+#define SIM_REGISTER_COUNT              256
+#define SIM_BENCH_FIRST_REG             16
+#define SIM_BENCH_REG_COUNT             64
+
+
+// Slot in the log ring buffer
+typedef struct {
+    atomic_int ready;
+    LogLevel level;
+    time_t time;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+// Transport that carries I2C transactions, either the kernel adapter or a replayed capture
+typedef struct {
+    const char *name;
+    int (*open)(bool quiet);
+    int (*transfer)(int i2c_dev, struct i2c_rdwr_ioctl_data *data);
+    void (*close)(int i2c_dev);
+    void (*lock_delay)(void);       // Optional, called before acquiring the I2C lock
+    bool (*reset)(void);            // Optional, resets the adapter to recover a hung bus
+} I2cTransport;
+
+// Library context: retry policy and bus health, log sink and statistics, operations on a context are serialized
+struct wp5_ctx {
+    pthread_mutex_t mutex;
+    int i2c_dev;                    // Device handler kept open by context API, -1 if not opened yet
+    RetryPolicy retry_policy;
+    float reg_error_rate[256];
+    float bus_error_rate;
+    unsigned int fast_read_count;
+    uint32_t backoff_random;
+    int breaker_failures;
+    int breaker_cooldown_ms;
+    bool breaker_open;
+    uint64_t breaker_retry_ms;
+    Wp5LogSink log_sink;
+    void *log_user_data;
+    Wp5Stats stats;
+};
+
+// Functionality of an I2C adapter, queried with I2C_FUNCS
+typedef struct {
+    dev_t rdev;
+    unsigned long funcs;
+} AdapterCaps;
+
+// Location of one record in replay data
+typedef struct {
+    size_t offset;
+    size_t end;
+    char type;
+    uint8_t err;
+    uint64_t duration_us;
+} ReplayRecord;
+
 
 static LogMode log_mode = LOG_WITH_TIME;
+static LogLevel log_level = LOG_LEVEL_INFO;
+
+static bool log_async = false;
+static LogSlot log_ring[LOG_RING_SLOTS];
+static atomic_uint log_head;
+static atomic_uint log_tail;
+static atomic_uint log_dropped;
+static atomic_bool log_stopping;
+static sem_t log_sem;
+static pthread_t log_thread;
+
+static FILE * volatile trace_fp = NULL;
+static unsigned long trace_event_count = 0;
+
+static char ntp_servers[256] = NTP_DEFAULT_SERVERS;
+
+static BoardState board_state = BOARD_ABSENT;
+static int board_model = MODEL_UNKNOWN;
+static int board_fw_major = -1;
+static int board_fw_minor = -1;
+static int board_failures = 0;
+static int board_backoff_ms = 0;
+static uint64_t board_next_probe_ms = 0;
+
+static RecoveryStats recovery_stats = { 0 };
+static bool controller_reset = false;
+static int last_transfer_errno = 0;
+static uint64_t local_reload_ms = 0;
+
+static AdapterCaps adapter_caps[ADAPTER_CACHE_SIZE];
+static int adapter_caps_count = 0;
+static unsigned long kernel_dev_funcs[KERNEL_MAX_HANDLES];
+static pthread_mutex_t adapter_caps_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *capture_fp = NULL;
+static uint64_t capture_last_us = 0;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t *replay_data = NULL;
+static size_t replay_size = 0;
+static size_t replay_pos = 0;
+static bool replay_realtime = false;
+static int replay_matched = 0;
+static int replay_mismatched = 0;
+static int replay_skipped = 0;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static SimFaults sim_faults;
+static uint8_t sim_registers[SIM_REGISTER_COUNT];
+static uint8_t sim_pointer = 0;
+static uint8_t sim_last_byte = 0xFF;
+static uint64_t sim_random = 0;
+static unsigned long sim_transfers = 0;
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static wp5_ctx default_ctx = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .i2c_dev = -1,
+    .retry_policy = {
+        .read_max_attempts = I2C_READ_MAX_ATTEMPTS,
+        .read_validate_count = I2C_READ_VALIDATE_COUNT,
+        .write_max_attempts = I2C_WRITE_MAX_ATTEMPTS,
+        .retry_delay_us = I2C_RETRY_DELAY_US,
+        .write_validate_delay_us = I2C_WRITE_VALIDATE_DELAY_US,
+        .adaptive = true,
+        .retry_delay_max_us = I2C_RETRY_DELAY_MAX_US,
+        .breaker_threshold = BREAKER_THRESHOLD,
+        .breaker_cooldown_ms = BREAKER_COOLDOWN_MIN_MS,
+    },
+    .backoff_random = 0x2545F491,
+};
+
+static pthread_mutex_t board_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_uint latency_histogram[2][TX_CLASS_COUNT][LATENCY_BUCKETS];
+static atomic_ulong latency_sum_us[2][TX_CLASS_COUNT];
+static atomic_int latency_window = 0;
+static __thread bool in_stream = false;
 
 
 const char *wittypi_models[] = {
@@ -64,6 +316,31 @@ const char *action_reasons[] = {
 };
 const int action_reasons_count = sizeof(action_reasons) / sizeof(action_reasons[0]);
 
+const char *tx_class_names[] = {
+    "read",
+    "validated_read",
+    "write",
+    "validated_write",
+    "range_read",
+    "batch_write",
+    "stream_chunk",
+};
+
+#define REG_DESCRIPTOR(id, index, codec, scale, min, max, access, volatility, unit, label) \
+    [REG_##id] = { #id, index, REG_CODEC_WIDTH(REG_CODEC_##codec), REG_CODEC_##codec, scale, min, max, \
+                   REG_ACCESS_##access, REG_VOLATILITY_##volatility, unit, label },
+const RegisterInfo register_table[] = {
+    WP5_REGISTERS(REG_DESCRIPTOR)
+};
+#undef REG_DESCRIPTOR
+
+// Rows in WP5_REGISTERS must fit in the register map and have a scale
+#define REG_CHECK(id, index, codec, scale, ...) \
+    _Static_assert((index) + REG_CODEC_WIDTH(REG_CODEC_##codec) - 1 <= I2C_VREG_LAST, #id " is out of register map"); \
+    _Static_assert((scale) > 0, #id " has invalid scale");
+WP5_REGISTERS(REG_CHECK)
+#undef REG_CHECK
+
 
 /**
  * Set log mode
@@ -76,49 +353,269 @@ void set_log_mode(LogMode mode) {
 
 
 /**
- * Print log function that accepts same arguments as printf
+ * Set log level, messages less important than this level are discarded
  *
- * @param format Format string in printf style
- * @param ... Variable arguments for the format string
- * @return Number of characters printed (excluding null byte)
+ * @param level The log level to be used
  */
-int print_log(const char *format, ...) {
-    if (log_mode == LOG_WITH_TIME) {
-        time_t now;
-        time(&now);
-        struct tm *local_time = localtime(&now);
+void set_log_level(LogLevel level) {
+    log_level = level;
+}
+
+
+// Format timestamp for given time, the result is cached per thread until the second changes
+static const char *format_timestamp(time_t t) {
+    static __thread time_t cached_time = (time_t)-1;
+    static __thread char cached_str[20]; // YYYY-MM-DD HH:MM:SS
+    if (t != cached_time) {
+        struct tm local_time;
+        localtime_r(&t, &local_time);
+        strftime(cached_str, sizeof(cached_str), "%Y-%m-%d %H:%M:%S", &local_time);
+        cached_time = t;
+    }
+    return cached_str;
+}
 
-        char timestamp[20]; // YYYY-MM-DD HH:MM:SS
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", local_time);
 
-        int timestamp_chars = printf("[%s] ", timestamp);
+// Write a complete log line with timestamp to stdout, in one system call
+static void write_log_line(time_t t, const char *text) {
+    size_t len = strlen(text);
+    while (len > 0 && text[len - 1] == '\n') {
+        len --;
+    }
+    char prefix[32];
+    int n = snprintf(prefix, sizeof(prefix), "[%s] ", format_timestamp(t));
+    struct iovec iov[3] = { { prefix, n }, { (void *)text, len }, { "\n", 1 } };
+    ssize_t written = writev(STDOUT_FILENO, iov, 3);
+    (void)written;
+}
+
 
-        va_list args;
-        va_start(args, format);
-        int printed_chars = vprintf(format, args);
-        va_end(args);
+// Write one record taken from the ring, with rate limiting and repeat suppression
+static void writer_emit(LogSlot *slot) {
+    static char last_text[LOG_LINE_MAX];
+    static time_t last_time = 0;
+    static int repeated = 0;
+    static int suppressed = 0;
+    static double tokens = LOG_RATE_BURST;
+    static time_t token_time = 0;
+
+    if (slot == NULL || strcmp(slot->text, last_text) != 0) {
+        if (repeated > 0) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Last message repeated %d times", repeated);
+            write_log_line(last_time, msg);
+            repeated = 0;
+        }
+    } else {
+        repeated ++;
+        last_time = slot->time;
+        return;
+    }
+    if (slot == NULL) {
+        if (suppressed > 0) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%d messages suppressed by rate limit", suppressed);
+            write_log_line(time(NULL), msg);
+            suppressed = 0;
+        }
+        unsigned dropped = atomic_exchange(&log_dropped, 0);
+        if (dropped > 0) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%u messages dropped (log buffer full)", dropped);
+            write_log_line(time(NULL), msg);
+        }
+        return;
+    }
+
+    // Token bucket for lines per second
+    if (slot->time != token_time) {
+        tokens += (double)(slot->time - token_time) * LOG_RATE_PER_SEC;
+        if (tokens > LOG_RATE_BURST) {
+            tokens = LOG_RATE_BURST;
+        }
+        token_time = slot->time;
+    }
+    if (tokens < 1.0 && slot->level > LOG_LEVEL_ERROR) {
+        suppressed ++;
+        return;
+    }
+    tokens -= 1.0;
+    if (suppressed > 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%d messages suppressed by rate limit", suppressed);
+        write_log_line(slot->time, msg);
+        suppressed = 0;
+    }
+    unsigned dropped = atomic_exchange(&log_dropped, 0);
+    if (dropped > 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "%u messages dropped (log buffer full)", dropped);
+        write_log_line(slot->time, msg);
+    }
+    write_log_line(slot->time, slot->text);
+    memcpy(last_text, slot->text, sizeof(last_text));
+    last_time = slot->time;
+}
+
+
+// Background writer thread, drains the ring buffer
+static void *log_writer(void *arg) {
+    (void)arg;
+    while (true) {
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += 1;
+        bool idle = sem_timedwait(&log_sem, &timeout) < 0 && errno == ETIMEDOUT;
+
+        unsigned tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        while (tail != atomic_load_explicit(&log_head, memory_order_acquire)) {
+            LogSlot *slot = &log_ring[tail % LOG_RING_SLOTS];
+            if (!atomic_load_explicit(&slot->ready, memory_order_acquire)) {
+                break;  // Producer still writing this slot
+            }
+            writer_emit(slot);
+            atomic_store_explicit(&slot->ready, 0, memory_order_relaxed);
+            tail ++;
+            atomic_store_explicit(&log_tail, tail, memory_order_release);
+        }
+        if (idle || atomic_load(&log_stopping)) {
+            writer_emit(NULL);  // Flush pending repeat count
+        }
+        if (atomic_load(&log_stopping) && tail == atomic_load(&log_head)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Flush pending log messages and stop the background writer
+ */
+void flush_log(void) {
+    if (!log_async) {
+        return;
+    }
+    log_async = false;
+    atomic_store(&log_stopping, true);
+    sem_post(&log_sem);
+    pthread_join(log_thread, NULL);
+}
+
+
+/**
+ * Enable or disable asynchronous logging
+ * When enabled, messages are formatted into a preallocated ring buffer and written by a
+ * background thread, so logging never blocks the caller. Consecutive repeated messages
+ * are folded and the output rate is limited.
+ *
+ * @param async true to enable asynchronous logging
+ */
+void set_log_async(bool async) {
+    if (async == log_async) {
+        return;
+    }
+    if (!async) {
+        flush_log();
+        return;
+    }
+    atomic_store(&log_stopping, false);
+    if (sem_init(&log_sem, 0, 0) != 0 || pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        return;
+    }
+    log_async = true;
+    static bool registered = false;
+    if (!registered) {
+        atexit(flush_log);
+        registered = true;
+    }
+}
 
-        const char *last_char = format + strlen(format) - 1;
-        if (*last_char != '\n') {
-            printf("\n");
-            printed_chars += 1;
+
+// Format message into a ring slot, never blocks
+static int enqueue_log(LogLevel level, const char *format, va_list args) {
+    unsigned head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    do {
+        if (head - atomic_load_explicit(&log_tail, memory_order_acquire) >= LOG_RING_SLOTS) {
+            atomic_fetch_add(&log_dropped, 1);
+            return 0;
         }
+    } while (!atomic_compare_exchange_weak(&log_head, &head, head + 1));
+
+    LogSlot *slot = &log_ring[head % LOG_RING_SLOTS];
+    slot->level = level;
+    slot->time = time(NULL);
+    int len = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    atomic_store_explicit(&slot->ready, 1, memory_order_release);
+    sem_post(&log_sem);
+    return len;
+}
+
 
+// Print log with given level
+static int vprint_log(LogLevel level, const char *format, va_list args) {
+    if (level > log_level) {
+        return 0;
+    }
+    if (log_mode == LOG_WITH_TIME) {
+        if (log_async) {
+            return enqueue_log(level, format, args);
+        }
+        // Unlike the ring slots, a synchronous line is not limited to LOG_LINE_MAX
+        char text[LOG_LINE_MAX];
+        char *long_text = NULL;
+        va_list retry_args;
+        va_copy(retry_args, args);
+        int printed_chars = vsnprintf(text, sizeof(text), format, args);
+        if (printed_chars >= (int)sizeof(text) && (long_text = malloc(printed_chars + 1)) != NULL) {
+            vsnprintf(long_text, printed_chars + 1, format, retry_args);
+        }
+        va_end(retry_args);
         fflush(stdout);
-        return timestamp_chars + printed_chars;
+        write_log_line(time(NULL), long_text ? long_text : text);
+        free(long_text);
+        return printed_chars;
     } else if (log_mode == LOG_WITHOUT_TIME) {
-        va_list args;
-        int result;
-        va_start(args, format);
-        result = vprintf(format, args);
-        va_end(args);
-        return result;
+        return vprintf(format, args);
     } else {
         return 0;
     }
 }
 
 
+/**
+ * Print log function that accepts same arguments as printf
+ *
+ * @param format Format string in printf style
+ * @param ... Variable arguments for the format string
+ * @return Number of characters printed (excluding null byte)
+ */
+int print_log(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = vprint_log(LOG_LEVEL_INFO, format, args);
+    va_end(args);
+    return result;
+}
+
+
+/**
+ * Print log with specific level, accepts same arguments as printf after level
+ *
+ * @param level The log level of this message
+ * @param format Format string in printf style
+ * @param ... Variable arguments for the format string
+ * @return Number of characters printed (excluding null byte)
+ */
+int print_log_level(LogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int result = vprint_log(level, format, args);
+    va_end(args);
+    return result;
+}
+
+
 /**
  * Print system information
  */
@@ -176,441 +673,2973 @@ uint8_t calculate_crc8(const uint8_t *data, size_t len) {
 }
 
 
-// Acquire I2C lock
-int lock_file() {
-    int lock_fd = -1;
-    int attempts = 0;
-    while (lock_fd < 0) {
-        attempts ++;
-        mode_t old_umask = umask(0);
-        lock_fd = open(I2C_LOCK, O_CREAT | O_RDWR, 0666);
-        umask(old_umask);
-        if (lock_fd < 0) {
-            print_log("Failed to open lock file %s\n", I2C_LOCK);
-            return -1;
-        }
-        if (flock(lock_fd, LOCK_EX) < 0) {
-            print_log("Failed to acquire I2C lock\n");
-            close(lock_fd);
-            if (attempts >= ACQUIRE_I2C_LOCK_MAX_ATTEMPTS) {
-                return -1;
-            }
-            usleep(ACQUIRE_I2C_LOCK_INTERVAL_US);
-        }
+// Get microseconds from monotonic clock
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// Time when I2C lock was acquired, only recorded while lock_release probe is enabled
+static __thread uint64_t lock_acquired_us = 0;
+
+
+// Write one event to trace file, args_json is the content of "args" object (can be NULL)
+static void write_trace_event(char ph, const char *cat, const char *name, uint64_t ts, uint64_t dur, const char *args_json) {
+    FILE *fp = trace_fp;
+    if (fp == NULL) {
+        return;
     }
-    return lock_fd;
+    flockfile(fp);
+    fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,",
+            trace_event_count ++ ? ",\n" : "", name, cat, ph, (unsigned long long)ts);
+    if (ph == 'X') {
+        fprintf(fp, "\"dur\":%llu,", (unsigned long long)dur);
+    } else if (ph == 'i') {
+        fprintf(fp, "\"s\":\"t\",");
+    }
+    fprintf(fp, "\"pid\":%d,\"tid\":%d,\"args\":{%s}}", getpid(), (int)gettid(), args_json ? args_json : "");
+    funlockfile(fp);
 }
 
 
-// Release I2C lock
-void unlock_file(int lock_fd) {
-    flock(lock_fd, LOCK_UN);
-    close(lock_fd);
+// Record a complete span that started at start_us and ends now
+static void trace_span(const char *cat, const char *name, uint64_t start_us, const char *args_format, ...) {
+    if (trace_fp == NULL) {
+        return;
+    }
+    uint64_t end_us = monotonic_us();
+    char args_json[128] = "";
+    if (args_format) {
+        va_list args;
+        va_start(args, args_format);
+        vsnprintf(args_json, sizeof(args_json), args_format, args);
+        va_end(args);
+    }
+    write_trace_event('X', cat, name, start_us, end_us - start_us, args_json);
 }
 
 
 /**
- * Open I2C device
+ * Start recording bus activity into a file in Chrome trace-event JSON format
+ * The file can be loaded by chrome://tracing or https://ui.perfetto.dev
  *
- * @return The handler of the device if open succesfully, -1 otherwise
+ * @param path The path of the trace file
+ * @return true if succeed, otherwise false
  */
-int open_i2c_device(void) {
-    int i2c_dev = open(I2C_DEVICE, O_RDWR);
-    if (i2c_dev < 0) {
-        print_log("Failed to open I2C device.\n");
-        return -1;
+bool start_trace_recording(const char * path) {
+    if (trace_fp != NULL) {
+        return false;
     }
-
-    if (ioctl(i2c_dev, I2C_SLAVE, I2C_SLAVE_ADDR) < 0) {
-        print_log("Failed setting I2C slave device address.\n");
-        return -1;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        print_log("Can not create trace file: %s\n", path);
+        return false;
     }
-    return i2c_dev;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    trace_event_count = 0;
+    trace_fp = fp;
+    static bool registered = false;
+    if (!registered) {
+        atexit(stop_trace_recording);
+        registered = true;
+    }
+    return true;
 }
 
 
 /**
- * Read value from I2C register, with or without validation
- * When reading value that may change quickly, validation should not be used
- *
- * @param i2c_dev The I2C device handler, use -1 to get one internally
- * @param index The index of the register
- * @param validate Whether to validate the value
- * @return The value if read succesfully, -1 otherwise
+ * Stop recording and close the trace file
  */
-int i2c_get_impl(int i2c_dev, uint8_t index, bool validate) {
-    bool need_to_close = false;
-    if (i2c_dev < 0) {
-        i2c_dev = open_i2c_device();
-        if (i2c_dev < 0) {
-            print_log("i2c_get: can not open I2C device.\n");
-            return -1;
-        }
-        need_to_close = true;
+void stop_trace_recording(void) {
+    FILE *fp = trace_fp;
+    if (fp == NULL) {
+        return;
     }
+    trace_fp = NULL;
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
 
-    int value = -1;
-    int attempts = 0;
-    int same_value_count = 0;
-    uint8_t last_read_value = 0;
 
-    while (attempts < I2C_READ_MAX_ATTEMPTS && same_value_count < (validate ? I2C_READ_VALIDATE_COUNT : 1)) {
-        attempts++;
+/**
+ * Begin a named span in the trace (e.g. a session), spans can be nested
+ *
+ * @param name The name of the span
+ */
+void trace_begin(const char * name) {
+    write_trace_event('B', "session", name, monotonic_us(), 0, NULL);
+}
 
-        int lock_fd = lock_file();
-        if (lock_fd < 0) {
-            print_log("i2c_get: failed to lock I2C device.\n");
-            usleep(1000);
-            continue;
-        }
 
-        uint8_t read_buffer[1];
-        uint8_t read_addr_buffer[1];
-        read_addr_buffer[0] = index;
+/**
+ * End the span most recently begun with the same name
+ *
+ * @param name The name of the span
+ */
+void trace_end(const char * name) {
+    write_trace_event('E', "session", name, monotonic_us(), 0, NULL);
+}
 
-        struct i2c_msg msgs[2];
-        struct i2c_rdwr_ioctl_data msgs_data;
 
-        msgs[0].addr = I2C_SLAVE_ADDR;
-        msgs[0].flags = 0;
-        msgs[0].len = 1;
-        msgs[0].buf = read_addr_buffer;
+// Get functionality of the adapter behind the handler, queried once per adapter
+static unsigned long adapter_funcs(int i2c_dev) {
+    struct stat st;
+    if (fstat(i2c_dev, &st) < 0) {
+        return I2C_FUNC_I2C;
+    }
+    pthread_mutex_lock(&adapter_caps_mutex);
+    unsigned long funcs = 0;
+    for (int i = 0; i < adapter_caps_count; i ++) {
+        if (adapter_caps[i].rdev == st.st_rdev) {
+            funcs = adapter_caps[i].funcs;
+            break;
+        }
+    }
+    if (funcs == 0) {
+        if (ioctl(i2c_dev, I2C_FUNCS, &funcs) < 0 || funcs == 0) {
+            funcs = I2C_FUNC_I2C;   // Query not supported, assume plain I2C
+        }
+        int slot = adapter_caps_count < ADAPTER_CACHE_SIZE ? adapter_caps_count ++ : ADAPTER_CACHE_SIZE - 1;
+        adapter_caps[slot].rdev = st.st_rdev;
+        adapter_caps[slot].funcs = funcs;
+        print_log_level(LOG_LEVEL_DEBUG, "I2C adapter %u:%u functionality 0x%08lx, using %s.\n", major(st.st_rdev), minor(st.st_rdev), funcs,
+                        (funcs & I2C_FUNC_I2C) ? "I2C_RDWR" : "SMBus byte data");
+    }
+    pthread_mutex_unlock(&adapter_caps_mutex);
+    return funcs;
+}
 
-        msgs[1].addr = I2C_SLAVE_ADDR;
-        msgs[1].flags = I2C_M_RD;
-        msgs[1].len = 1;
-        msgs[1].buf = read_buffer;
 
-        msgs_data.msgs = msgs;
-        msgs_data.nmsgs = 2;
+// Run one SMBus transaction on the kernel adapter
+static int kernel_smbus(int i2c_dev, uint8_t read_write, uint8_t command, int size, union i2c_smbus_data *data) {
+    struct i2c_smbus_ioctl_data args = { .read_write = read_write, .command = command, .size = size, .data = data };
+    return ioctl(i2c_dev, I2C_SMBUS, &args);
+}
 
-        if (ioctl(i2c_dev, I2C_RDWR, &msgs_data) < 0) {
-            print_log("i2c_get: read transaction failed for Reg%d on attempt %d: %s\n", index, attempts, strerror(errno));
-            unlock_file(lock_fd);
-            usleep(1000);
-            if (validate) {
-                continue;
+
+// Perform transfer with SMBus primitives on adapters without plain I2C (e.g. some USB bridges)
+// Only single byte register read (write index + read one byte) and write (index + one byte) are supported,
+// that is all the library sends: the firmware is not known to auto-increment the register index
+static int kernel_transfer_smbus(int i2c_dev, unsigned long funcs, struct i2c_rdwr_ioctl_data *data) {
+    for (__u32 i = 0; i < data->nmsgs; i ++) {
+        struct i2c_msg *msg = &data->msgs[i];
+        struct i2c_msg *next = i + 1 < data->nmsgs ? &data->msgs[i + 1] : NULL;
+        union i2c_smbus_data smbus;
+        if ((msg->flags & I2C_M_RD) || msg->len == 0) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        if (msg->len == 1 && next && (next->flags & I2C_M_RD) && next->len == 1 && (funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA)) {
+            if (kernel_smbus(i2c_dev, I2C_SMBUS_READ, msg->buf[0], I2C_SMBUS_BYTE_DATA, &smbus) < 0) {
+                return -1;
+            }
+            next->buf[0] = smbus.byte;
+            i ++;
+        } else if (msg->len == 2 && (funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+            smbus.byte = msg->buf[1];
+            if (kernel_smbus(i2c_dev, I2C_SMBUS_WRITE, msg->buf[0], I2C_SMBUS_BYTE_DATA, &smbus) < 0) {
+                return -1;
             }
+        } else {
+            errno = EOPNOTSUPP;
+            return -1;
         }
+    }
+    return data->nmsgs;
+}
 
-        unlock_file(lock_fd);
-
-        uint8_t current_read_value = read_buffer[0];
 
-        if (validate) {
-            if (attempts == 1) {
-                 last_read_value = current_read_value;
-                 same_value_count = 1;
-            } else {
-                if (current_read_value == last_read_value) {
-                    same_value_count++;
-                } else {
-                    print_log("i2c_get: Reg%d value changed from 0x%02x to 0x%02x on attempt %d.\n", index, last_read_value, current_read_value, attempts);
-                    last_read_value = current_read_value;
-                    same_value_count = 1;
-                }
-            }
-        } else {
-            value = current_read_value;
-            break;
+// Open I2C device on the kernel adapter
+static int kernel_open(bool quiet) {
+    int i2c_dev = open(I2C_DEVICE, O_RDWR);
+    if (i2c_dev < 0) {
+        int saved_errno = errno;
+        if (!quiet) {
+            print_log("Failed to open I2C device.\n");
         }
+        errno = saved_errno;
+        return -1;
+    }
 
-        if (validate && same_value_count >= I2C_READ_VALIDATE_COUNT) {
-             value = current_read_value;
-             break;
+    if (ioctl(i2c_dev, I2C_SLAVE, I2C_SLAVE_ADDR) < 0) {
+        int saved_errno = errno;
+        if (!quiet) {
+            print_log("Failed setting I2C slave device address.\n");
         }
+        close(i2c_dev);
+        errno = saved_errno;
+        return -1;
     }
-    if (attempts >= I2C_READ_MAX_ATTEMPTS && (validate && same_value_count < I2C_READ_VALIDATE_COUNT)) {
-        print_log("i2c_get: Failed to get stable reading for Reg%d after %d attempts.\n", index, attempts);
-        value = -1;
+    if (i2c_dev < KERNEL_MAX_HANDLES) {
+        kernel_dev_funcs[i2c_dev] = adapter_funcs(i2c_dev);
     }
-    if (need_to_close) {
-        close(i2c_dev);
+    return i2c_dev;
+}
+
+
+// Perform transfer on the kernel adapter, with the cheapest primitive it supports
+static int kernel_transfer(int i2c_dev, struct i2c_rdwr_ioctl_data *data) {
+    unsigned long funcs = (i2c_dev >= 0 && i2c_dev < KERNEL_MAX_HANDLES) ? kernel_dev_funcs[i2c_dev] : 0;
+    if (funcs == 0) {
+        funcs = adapter_funcs(i2c_dev);
     }
-    return value;
+    if (funcs & I2C_FUNC_I2C) {
+        return ioctl(i2c_dev, I2C_RDWR, data);   // Whole batch in one combined transaction
+    }
+    return kernel_transfer_smbus(i2c_dev, funcs, data);
 }
 
 
+// Close I2C device on the kernel adapter
+static void kernel_close(int i2c_dev) {
+    if (i2c_dev >= 0 && i2c_dev < KERNEL_MAX_HANDLES) {
+        kernel_dev_funcs[i2c_dev] = 0;
+    }
+    close(i2c_dev);
+}
 
-/**
- * Read value from I2C register with validation
+
+// Write a string into sysfs attribute
+static bool write_sysfs(const char *path, const char *value) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t len = strlen(value);
+    bool ok = write(fd, value, len) == len;
+    close(fd);
+    return ok;
+}
+
+
+// Reset the I2C controller by unbinding and binding its driver, the driver initializes (and recovers) the bus on probe
+static bool kernel_reset(void) {
+    char path[PATH_MAX + 16];
+    char controller[PATH_MAX];
+    char driver[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/bus/i2c/devices/%s/..", strrchr(I2C_DEVICE, '/') + 1);
+    if (realpath(path, controller) == NULL) {
+        return false;
+    }
+    snprintf(path, sizeof(path), "%s/driver", controller);
+    if (realpath(path, driver) == NULL) {
+        return false;
+    }
+    const char *name = strrchr(controller, '/') + 1;
+    print_log("Resetting I2C controller %s...\n", name);
+    pthread_mutex_lock(&adapter_caps_mutex);
+    adapter_caps_count = 0;     // Query functionality again after reset
+    pthread_mutex_unlock(&adapter_caps_mutex);
+    snprintf(path, sizeof(path), "%s/unbind", driver);
+    if (!write_sysfs(path, name)) {
+        return false;
+    }
+    usleep(RECOVERY_RESET_SETTLE_US);
+    snprintf(path, sizeof(path), "%s/bind", driver);
+    return write_sysfs(path, name);
+}
+
+
+static const I2cTransport kernel_transport = { "kernel", kernel_open, kernel_transfer, kernel_close, NULL, kernel_reset };
+
+static const I2cTransport *i2c_transport = &kernel_transport;
+
+
+// Write unsigned LEB128 varint to capture file
+static void capture_put_varint(FILE *fp, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        fputc(value ? (byte | 0x80) : byte, fp);
+    } while (value);
+}
+
+
+// Write record header (type, time since previous record, duration) to capture file, must hold capture_mutex
+static void capture_put_header(char type, uint64_t start_us, uint64_t end_us) {
+    fputc(type, capture_fp);
+    capture_put_varint(capture_fp, start_us - capture_last_us);
+    capture_put_varint(capture_fp, end_us - start_us);
+    capture_last_us = start_us;
+}
+
+
+// Record an open or close of the device into capture file
+static void capture_device(char type, uint64_t start_us, int result, int err) {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp) {
+        capture_put_header(type, start_us, monotonic_us());
+        fputc(result < 0 ? (err & 0xFF) : 0, capture_fp);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+
+// Record a transfer with all request and response bytes into capture file
+static void capture_transfer(uint64_t start_us, struct i2c_rdwr_ioctl_data *data, int result, int err) {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp) {
+        capture_put_header('X', start_us, monotonic_us());
+        fputc(data->nmsgs, capture_fp);
+        for (__u32 i = 0; i < data->nmsgs; i ++) {
+            struct i2c_msg *msg = &data->msgs[i];
+            fputc((msg->flags & I2C_M_RD) ? 1 : 0, capture_fp);
+            capture_put_varint(capture_fp, msg->len);
+            fwrite(msg->buf, 1, msg->len, capture_fp);    // Read buffers hold the response (or garbage on failure)
+        }
+        fputc(result < 0 ? (err & 0xFF) : 0, capture_fp);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+
+/**
+ * Start capturing every I2C transaction (request and response bytes with timing) into a binary trace file
+ * The file can be replayed later with use_replay_transport()
+ *
+ * @param path The path of the capture file
+ * @return true if succeed, otherwise false
+ */
+bool start_capture(const char * path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        print_log("Can not create capture file: %s\n", path);
+        return false;
+    }
+    fwrite(CAPTURE_MAGIC, 1, 4, fp);
+    fputc(CAPTURE_VERSION, fp);
+    pthread_mutex_lock(&capture_mutex);
+    bool started = capture_fp == NULL;
+    if (started) {
+        capture_last_us = monotonic_us();
+        capture_fp = fp;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    if (!started) {
+        fclose(fp);
+        return false;
+    }
+    static bool registered = false;
+    if (!registered) {
+        atexit(stop_capture);
+        registered = true;
+    }
+    return true;
+}
+
+
+/**
+ * Stop capturing and close the capture file
+ */
+void stop_capture(void) {
+    pthread_mutex_lock(&capture_mutex);
+    FILE *fp = capture_fp;
+    capture_fp = NULL;
+    pthread_mutex_unlock(&capture_mutex);
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+
+// Read unsigned LEB128 varint from replay data, return false if truncated
+static bool replay_get_varint(const uint8_t *data, size_t size, size_t *pos, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *pos < size && shift < 64; shift += 7) {
+        uint8_t byte = data[(*pos) ++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Parse one record starting at pos, return false if the data is truncated or corrupted
+static bool replay_parse_record(size_t pos, ReplayRecord *record) {
+    uint64_t delay, duration, len;
+    record->offset = pos;
+    if (pos >= replay_size) {
+        return false;
+    }
+    record->type = replay_data[pos ++];
+    if (!replay_get_varint(replay_data, replay_size, &pos, &delay) || !replay_get_varint(replay_data, replay_size, &pos, &duration)) {
+        return false;
+    }
+    record->duration_us = duration;
+    if (record->type == 'X') {
+        if (pos >= replay_size) {
+            return false;
+        }
+        int nmsgs = replay_data[pos ++];
+        for (int i = 0; i < nmsgs; i ++) {
+            if (pos >= replay_size) {
+                return false;
+            }
+            pos ++;
+            if (!replay_get_varint(replay_data, replay_size, &pos, &len) || len > replay_size - pos) {
+                return false;
+            }
+            pos += len;
+        }
+    } else if (record->type != 'O' && record->type != 'C') {
+        return false;
+    }
+    if (pos >= replay_size) {
+        return false;
+    }
+    record->err = replay_data[pos ++];
+    record->end = pos;
+    return true;
+}
+
+
+// Check whether a recorded transfer carries the same request, copy recorded response if it does
+static bool replay_match_transfer(const ReplayRecord *record, struct i2c_rdwr_ioctl_data *data, bool apply) {
+    size_t pos = record->offset + 1;
+    uint64_t value;
+    replay_get_varint(replay_data, replay_size, &pos, &value);
+    replay_get_varint(replay_data, replay_size, &pos, &value);
+    if (replay_data[pos ++] != data->nmsgs) {
+        return false;
+    }
+    for (__u32 i = 0; i < data->nmsgs; i ++) {
+        struct i2c_msg *msg = &data->msgs[i];
+        bool is_read = replay_data[pos ++];
+        replay_get_varint(replay_data, replay_size, &pos, &value);
+        if (is_read != ((msg->flags & I2C_M_RD) != 0) || value != msg->len) {
+            return false;
+        }
+        if (is_read) {
+            if (apply) {
+                memcpy(msg->buf, replay_data + pos, msg->len);
+            }
+        } else if (memcmp(msg->buf, replay_data + pos, msg->len) != 0) {
+            return false;
+        }
+        pos += value;
+    }
+    return true;
+}
+
+
+// Find the next record matching the request within the resync window and consume it
+static bool replay_next(char type, struct i2c_rdwr_ioctl_data *data, ReplayRecord *found) {
+    size_t pos = replay_pos;
+    for (int skipped = 0; skipped <= REPLAY_RESYNC_WINDOW; skipped ++) {
+        ReplayRecord record;
+        if (!replay_parse_record(pos, &record)) {
+            break;
+        }
+        if (record.type == type && (type != 'X' || replay_match_transfer(&record, data, false))) {
+            if (type == 'X') {
+                replay_match_transfer(&record, data, true);
+            }
+            if (skipped > 0) {
+                replay_skipped += skipped;
+                print_log_level(LOG_LEVEL_DEBUG, "Replay resynchronized after skipping %d record(s).\n", skipped);
+            }
+            replay_pos = record.end;
+            replay_matched ++;
+            *found = record;
+            return true;
+        }
+        pos = record.end;
+    }
+    replay_mismatched ++;
+    return false;
+}
+
+
+// Return the recorded result of a consumed record, optionally taking the recorded time
+static int replay_result(const ReplayRecord *record) {
+    if (replay_realtime && record->duration_us) {
+        usleep(record->duration_us);
+    }
+    if (record->err) {
+        errno = record->err;
+        return -1;
+    }
+    return 0;
+}
+
+
+// Open device on replay transport, the handler is a descriptor of /dev/null
+static int replay_open(bool quiet) {
+    pthread_mutex_lock(&replay_mutex);
+    ReplayRecord record;
+    int result = replay_next('O', NULL, &record) ? replay_result(&record) : (errno = ENODEV, -1);
+    pthread_mutex_unlock(&replay_mutex);
+    if (result < 0) {
+        if (!quiet) {
+            print_log("Failed to open I2C device (replay).\n");
+        }
+        return -1;
+    }
+    return open("/dev/null", O_RDWR);
+}
+
+
+// Perform transfer on replay transport
+static int replay_transfer(int i2c_dev, struct i2c_rdwr_ioctl_data *data) {
+    (void)i2c_dev;
+    pthread_mutex_lock(&replay_mutex);
+    ReplayRecord record;
+    int result = replay_next('X', data, &record) ? replay_result(&record) : (errno = EIO, -1);
+    pthread_mutex_unlock(&replay_mutex);
+    return result;
+}
+
+
+// Close device on replay transport
+static void replay_close(int i2c_dev) {
+    pthread_mutex_lock(&replay_mutex);
+    ReplayRecord record;
+    if (replay_data && replay_parse_record(replay_pos, &record) && record.type == 'C') {
+        replay_pos = record.end;
+    }
+    pthread_mutex_unlock(&replay_mutex);
+    close(i2c_dev);
+}
+
+
+static const I2cTransport replay_transport = { "replay", replay_open, replay_transfer, replay_close, NULL, NULL };
+
+
+/**
+ * Replace the I2C adapter with a trace captured by start_capture(), the recorded responses will be
+ * fed back in order. Requests that differ from the recording are resynchronized by looking ahead,
+ * and fail with EIO if no matching record is found.
+ *
+ * @param path The path of the capture file
+ * @param realtime Whether to take the recorded time for each transaction
+ * @return true if succeed, otherwise false
+ */
+bool use_replay_transport(const char * path, bool realtime) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        print_log("Can not open capture file: %s\n", path);
+        return false;
+    }
+    uint8_t *data = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    size_t count;
+    do {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            uint8_t *grown = realloc(data, capacity);
+            if (grown == NULL) {
+                free(data);
+                fclose(fp);
+                return false;
+            }
+            data = grown;
+        }
+        count = fread(data + size, 1, capacity - size, fp);
+        size += count;
+    } while (count > 0);
+    fclose(fp);
+    if (size < 5 || memcmp(data, CAPTURE_MAGIC, 4) != 0 || data[4] != CAPTURE_VERSION) {
+        print_log("Invalid capture file: %s\n", path);
+        free(data);
+        return false;
+    }
+    pthread_mutex_lock(&replay_mutex);
+    free(replay_data);
+    replay_data = data;
+    replay_size = size;
+    replay_pos = 5;
+    replay_realtime = realtime;
+    replay_matched = replay_mismatched = replay_skipped = 0;
+    i2c_transport = &replay_transport;
+    pthread_mutex_unlock(&replay_mutex);
+    return true;
+}
+
+
+/**
+ * Get statistics of the replay transport
+ *
+ * @param matched Pointer to store the number of transactions answered from the recording
+ * @param mismatched Pointer to store the number of transactions that found no matching record
+ * @param skipped Pointer to store the number of records skipped while resynchronizing
+ * @param remaining Pointer to store the number of records not yet consumed
+ */
+void get_replay_stats(int *matched, int *mismatched, int *skipped, int *remaining) {
+    pthread_mutex_lock(&replay_mutex);
+    int count = 0;
+    ReplayRecord record;
+    for (size_t pos = replay_pos; replay_data && replay_parse_record(pos, &record); pos = record.end) {
+        count ++;
+    }
+    *matched = replay_matched;
+    *mismatched = replay_mismatched;
+    *skipped = replay_skipped;
+    *remaining = count;
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+
+// Get next pseudo random number of simulated transport (xorshift64*), must hold sim_mutex
+static uint64_t sim_next_random(void) {
+    sim_random ^= sim_random >> 12;
+    sim_random ^= sim_random << 25;
+    sim_random ^= sim_random >> 27;
+    return sim_random * 2685821657736338717ULL;
+}
+
+
+// Decide whether a fault with given probability happens, must hold sim_mutex
+static bool sim_chance(double probability) {
+    return probability > 0 && (sim_next_random() >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+
+// Open device on simulated transport, the handler is a descriptor of /dev/null
+static int sim_open(bool quiet) {
+    int i2c_dev = open("/dev/null", O_RDWR);
+    if (i2c_dev < 0 && !quiet) {
+        print_log("Failed to open I2C device (simulated).\n");
+    }
+    return i2c_dev;
+}
+
+
+// Perform transfer on simulated Witty Pi, injecting faults
+static int sim_transfer(int i2c_dev, struct i2c_rdwr_ioctl_data *data) {
+    (void)i2c_dev;
+    pthread_mutex_lock(&sim_mutex);
+    sim_transfers ++;
+    bool stretch = sim_chance(sim_faults.stretch);
+    bool nak = sim_chance(sim_faults.nak);
+    bool stuck = sim_chance(sim_faults.stuck);
+    bool flip = sim_chance(sim_faults.bit_flip);
+    if (!nak) {
+        for (__u32 i = 0; i < data->nmsgs; i ++) {
+            struct i2c_msg *msg = &data->msgs[i];
+            if (msg->flags & I2C_M_RD) {
+                for (int j = 0; j < msg->len; j ++) {
+                    msg->buf[j] = stuck ? sim_last_byte : sim_registers[sim_pointer ++];
+                    sim_last_byte = msg->buf[j];
+                }
+                if (flip && msg->len > 0) {
+                    msg->buf[sim_next_random() % msg->len] ^= 1 << (sim_next_random() % 8);
+                }
+            } else if (msg->len > 0) {
+                sim_pointer = msg->buf[0];
+                for (int j = 1; j < msg->len; j ++) {
+                    if (!stuck) {
+                        sim_registers[sim_pointer] = msg->buf[j];
+                    }
+                    sim_pointer ++;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    if (stretch) {
+        usleep(sim_faults.stretch_us);
+    }
+    if (nak) {
+        errno = EREMOTEIO;
+        return -1;
+    }
+    return 0;
+}
+
+
+// Close device on simulated transport
+static void sim_close(int i2c_dev) {
+    close(i2c_dev);
+}
+
+
+// Simulate the I2C lock being held by another process
+static void sim_lock_delay(void) {
+    pthread_mutex_lock(&sim_mutex);
+    bool contended = sim_chance(sim_faults.contention);
+    pthread_mutex_unlock(&sim_mutex);
+    if (contended) {
+        usleep(sim_faults.contention_us);
+    }
+}
+
+
+static const I2cTransport sim_transport = { "simulated", sim_open, sim_transfer, sim_close, sim_lock_delay, NULL };
+
+
+/**
+ * Replace the I2C adapter with a simulated Witty Pi that injects faults, for benchmarking retry policies
+ *
+ * @param faults The probabilities of faults
+ * @param seed Seed of the fault generator, same seed produces same faults
+ */
+void use_simulated_transport(const SimFaults *faults, unsigned int seed) {
+    pthread_mutex_lock(&sim_mutex);
+    sim_faults = *faults;
+    sim_random = 0x9E3779B97F4A7C15ULL ^ seed;
+    for (int i = 0; i < SIM_REGISTER_COUNT; i ++) {
+        sim_registers[i] = (uint8_t)(sim_next_random() >> 56);
+    }
+    sim_registers[I2C_FW_ID] = FW_ID_WITTYPI_5;
+    sim_registers[I2C_FW_VERSION_MAJOR] = 1;
+    sim_registers[I2C_FW_VERSION_MINOR] = 0;
+    sim_pointer = 0;
+    sim_last_byte = 0xFF;
+    sim_transfers = 0;
+    i2c_transport = &sim_transport;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+
+// Compare two latencies for qsort
+static int compare_latency(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Benchmark a retry policy by doing validated reads and writes on simulated transport
+ * use_simulated_transport() should be called first
+ *
+ * @param policy The retry policy to benchmark
+ * @param operations The number of operations to perform
+ * @param result Pointer to store the result
+ * @return true if succeed, false if simulated transport is not in use
+ */
+bool benchmark_retry_policy(const RetryPolicy *policy, int operations, BenchResult *result) {
+    if (i2c_transport != &sim_transport || operations <= 0) {
+        return false;
+    }
+    double *latencies = malloc(operations * sizeof(double));
+    if (latencies == NULL) {
+        return false;
+    }
+    int dev = open_i2c_device();
+    if (dev < 0) {
+        free(latencies);
+        return false;
+    }
+    RetryPolicy saved_policy;
+    get_retry_policy(&saved_policy);
+    set_retry_policy(policy);
+    memset(result, 0, sizeof(BenchResult));
+    result->operations = operations;
+    unsigned long start_transfers = sim_transfers;
+    double total_us = 0;
+    for (int i = 0; i < operations; i ++) {
+        pthread_mutex_lock(&sim_mutex);
+        uint8_t index = SIM_BENCH_FIRST_REG + sim_next_random() % SIM_BENCH_REG_COUNT;
+        uint8_t value = (uint8_t)sim_next_random();
+        uint8_t expected = sim_registers[index];
+        pthread_mutex_unlock(&sim_mutex);
+
+        uint64_t start_us = monotonic_us();
+        bool ok;
+        if (i % 2) {
+            ok = i2c_set(dev, index, value);
+            expected = value;
+        } else {
+            int read = i2c_get(dev, index);
+            ok = read >= 0;
+            value = (uint8_t)read;
+        }
+        latencies[i] = (double)(monotonic_us() - start_us);
+        total_us += latencies[i];
+
+        pthread_mutex_lock(&sim_mutex);
+        bool correct = (i % 2) ? sim_registers[index] == expected : value == expected;
+        pthread_mutex_unlock(&sim_mutex);
+        if (!ok) {
+            result->failed ++;
+        } else if (correct) {
+            result->succeeded ++;
+        } else {
+            result->corrupted ++;
+        }
+    }
+    set_retry_policy(&saved_policy);
+    close_i2c_device(dev);
+
+    qsort(latencies, operations, sizeof(double), compare_latency);
+    result->mean_us = total_us / operations;
+    result->p99_us = latencies[(operations * 99 - 1) / 100];
+    result->amplification = (double)(sim_transfers - start_transfers) / operations;
+    free(latencies);
+    return true;
+}
+
+
+// Perform I2C_RDWR transfer on current transport, recorded as a span when tracing or capturing
+static int i2c_transfer(int i2c_dev, struct i2c_rdwr_ioctl_data *data) {
+    uint64_t start_us = (trace_fp || capture_fp) ? monotonic_us() : 0;
+    int result = i2c_transport->transfer(i2c_dev, data);
+    if (result < 0) {
+        last_transfer_errno = errno;
+    }
+    if (capture_fp) {
+        capture_transfer(start_us, data, result, errno);
+    }
+    if (trace_fp) {
+        bool is_read = data->nmsgs > 1;
+        trace_span("i2c", is_read ? "transfer read" : "transfer write", start_us, "\"reg\":%d,\"ok\":%s",
+                   data->msgs[0].buf[0], result < 0 ? "false" : "true");
+    }
+    return result;
+}
+
+
+// Record a retry as an instant event when tracing
+static void trace_retry(uint8_t index, int attempt) {
+    if (trace_fp) {
+        char args_json[64];
+        snprintf(args_json, sizeof(args_json), "\"reg\":%d,\"attempt\":%d", index, attempt);
+        write_trace_event('i', "i2c", "retry", monotonic_us(), 0, args_json);
+    }
+}
+
+
+// Sleep between bus operations, recorded as a span when tracing
+static void bus_sleep(useconds_t us) {
+    uint64_t start_us = trace_fp ? monotonic_us() : 0;
+    usleep(us);
+    trace_span("sleep", "sleep", start_us, "\"us\":%u", (unsigned)us);
+}
+
+
+// Waiter queued on the bus arbiter
+typedef struct {
+    pid_t pid;
+    uint32_t id;
+    bool priority;
+} ArbiterWaiter;
+
+// Bus arbiter shared by all processes in shared memory, waiters are served in FIFO order with priority ones first
+typedef struct {
+    atomic_uint magic;                          // Set when initialized
+    uint32_t size;                              // Size of this structure, to detect other layout
+    pthread_mutex_t mutex;                      // Robust, guards the fields below
+    pthread_cond_t cond;                        // Broadcast when the bus is released or the queue changes
+    pthread_mutex_t bus;                        // Robust, held while using the bus
+    pid_t holder;                               // Process holding the bus, 0 if free
+    uint32_t next_id;
+    int queue_len;
+    ArbiterWaiter queue[ARBITER_QUEUE_SIZE];
+    ArbiterStats stats;
+    uint64_t reload_ms;                         // Monotonic time of the last command that reloads the firmware
+    uint32_t listing_generation;                // Changed by commands that may write files, cached listings of older ones are stale
+} Arbiter;
+
+static Arbiter *arbiter = NULL;
+static pthread_once_t arbiter_once = PTHREAD_ONCE_INIT;
+
+static bool flock_compat = false;
+static int flock_compat_fd = -1;
+
+static __thread bool bus_priority = false;
+
+
+// Check whether a process is still alive
+static bool process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+// Lock a robust mutex, recover it if the previous owner died holding it
+static bool robust_lock(pthread_mutex_t *mutex, bool *owner_dead) {
+    int result = pthread_mutex_lock(mutex);
+    if (result == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+        if (owner_dead) {
+            *owner_dead = true;
+        }
+        return true;
+    }
+    return result == 0;
+}
+
+
+// Initialize arbiter in a newly created shared memory object
+static void arbiter_init(Arbiter *arb) {
+    memset(arb, 0, sizeof(Arbiter));
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&arb->mutex, &mattr);
+    pthread_mutex_init(&arb->bus, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&arb->cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    arb->listing_generation = (uint32_t)time(NULL);     // Not to match caches written before the arbiter was recreated
+    arb->size = sizeof(Arbiter);
+    atomic_store(&arb->magic, ARBITER_MAGIC);
+}
+
+
+// Get the group allowed to use the bus: the group of the I2C device, or our own if there is no device
+static gid_t arbiter_group(void) {
+    struct stat st;
+    return stat(I2C_DEVICE, &st) == 0 ? st.st_gid : getegid();
+}
+
+
+// Map the bus arbiter, creating it if this is the first process; arbiter stays NULL if not available
+// Only users who can use the I2C device may access it, as anyone who can write it can also wedge the bus
+static void arbiter_map(void) {
+    gid_t group = arbiter_group();
+    int fd = shm_open(I2C_ARBITER, O_CREAT | O_EXCL | O_RDWR, 0660);
+    bool creator = fd >= 0;
+    if (creator && (fchown(fd, -1, group) < 0 || fchmod(fd, 0660) < 0)) {
+        print_log("Failed to set permission of I2C arbiter, use lock file instead\n");
+        close(fd);
+        shm_unlink(I2C_ARBITER);
+        return;
+    }
+    if (!creator && errno == EEXIST) {
+        fd = shm_open(I2C_ARBITER, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        print_log("Failed to open I2C arbiter %s, use lock file instead\n", I2C_ARBITER);
+        return;
+    }
+    struct stat st;
+    if (!creator && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid())
+                     || st.st_gid != group || (st.st_mode & 0777) != 0660)) {
+        print_log("I2C arbiter %s has unexpected owner or permission, use lock file instead\n", I2C_ARBITER);
+        close(fd);
+        return;
+    }
+    if (creator && ftruncate(fd, sizeof(Arbiter)) < 0) {
+        print_log("Failed to allocate I2C arbiter, use lock file instead\n");
+        close(fd);
+        shm_unlink(I2C_ARBITER);
+        return;
+    }
+    // Another process may still be creating it
+    int waited_ms = 0;
+    while (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(Arbiter) && waited_ms < ARBITER_INIT_TIMEOUT_MS) {
+        usleep(1000);
+        waited_ms ++;
+    }
+    Arbiter *arb = MAP_FAILED;
+    if (st.st_size == (off_t)sizeof(Arbiter)) {
+        arb = mmap(NULL, sizeof(Arbiter), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (arb == MAP_FAILED) {
+        print_log("I2C arbiter %s is incompatible, use lock file instead\n", I2C_ARBITER);
+        return;
+    }
+    if (creator) {
+        arbiter_init(arb);
+    }
+    while (atomic_load(&arb->magic) != ARBITER_MAGIC && waited_ms < ARBITER_INIT_TIMEOUT_MS) {
+        usleep(1000);
+        waited_ms ++;
+    }
+    if (atomic_load(&arb->magic) != ARBITER_MAGIC || arb->size != sizeof(Arbiter)) {
+        // Creator died before initializing it, remove it so the next process starts over
+        print_log("I2C arbiter %s is not initialized, use lock file instead\n", I2C_ARBITER);
+        munmap(arb, sizeof(Arbiter));
+        shm_unlink(I2C_ARBITER);
+        return;
+    }
+    arbiter = arb;
+}
+
+
+// Remove crashed waiters from the queue and release the bus from crashed holder, must hold arbiter mutex
+static void arbiter_prune(Arbiter *arb) {
+    for (int i = 0; i < arb->queue_len; ) {
+        if (process_alive(arb->queue[i].pid)) {
+            i ++;
+            continue;
+        }
+        memmove(&arb->queue[i], &arb->queue[i + 1], (arb->queue_len - i - 1) * sizeof(ArbiterWaiter));
+        arb->queue_len --;
+        arb->stats.waiters_dead ++;
+        pthread_cond_broadcast(&arb->cond);
+    }
+    if (arb->holder && !process_alive(arb->holder)) {
+        arb->holder = 0;    // The bus mutex will be recovered by the next locker
+        pthread_cond_broadcast(&arb->cond);
+    }
+}
+
+
+// Acquire the bus through the arbiter, in FIFO order after waiters with higher priority
+static bool arbiter_acquire(Arbiter *arb) {
+    uint64_t start_us = monotonic_us();
+    if (!robust_lock(&arb->mutex, NULL)) {
+        return false;
+    }
+    pid_t pid = getpid();
+    bool contended = arb->holder != 0 || arb->queue_len > 0;
+    if (arb->queue_len < ARBITER_QUEUE_SIZE) {
+        uint32_t id = ++ arb->next_id;
+        int pos = arb->queue_len;
+        if (bus_priority) {
+            while (pos > 0 && !arb->queue[pos - 1].priority) {
+                pos --;
+            }
+            if (pos < arb->queue_len) {
+                arb->stats.priority_handoffs ++;
+            }
+        }
+        memmove(&arb->queue[pos + 1], &arb->queue[pos], (arb->queue_len - pos) * sizeof(ArbiterWaiter));
+        arb->queue[pos] = (ArbiterWaiter){ pid, id, bus_priority };
+        arb->queue_len ++;
+        while (arb->queue[0].id != id || arb->holder != 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += ARBITER_POLL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            int result = pthread_cond_timedwait(&arb->cond, &arb->mutex, &deadline);
+            if (result == EOWNERDEAD) {
+                pthread_mutex_consistent(&arb->mutex);
+            } else if (result == ETIMEDOUT) {
+                arbiter_prune(arb);
+            }
+        }
+        arb->queue_len --;
+        memmove(&arb->queue[0], &arb->queue[1], arb->queue_len * sizeof(ArbiterWaiter));
+        arb->holder = pid;      // Nobody holds the bus, reserve it so the next in queue keeps waiting
+    }
+    // Queue full: take the bus without ordering, holder is only set once the bus is locked
+    pthread_mutex_unlock(&arb->mutex);
+    
+    bool owner_dead = false;
+    if (!robust_lock(&arb->bus, &owner_dead)) {
+        robust_lock(&arb->mutex, NULL);
+        if (arb->holder == pid) {
+            arb->holder = 0;
+            pthread_cond_broadcast(&arb->cond);
+        }
+        pthread_mutex_unlock(&arb->mutex);
+        return false;
+    }
+    uint64_t wait_us = monotonic_us() - start_us;
+    robust_lock(&arb->mutex, NULL);
+    arb->holder = pid;
+    arb->stats.acquisitions ++;
+    arb->stats.contended += contended;
+    arb->stats.owner_dead += owner_dead;
+    arb->stats.wait_us_total += wait_us;
+    if (wait_us > arb->stats.wait_us_max) {
+        arb->stats.wait_us_max = wait_us;
+    }
+    pthread_mutex_unlock(&arb->mutex);
+    if (owner_dead) {
+        print_log_level(LOG_LEVEL_WARNING, "Recovered I2C bus from a process that died holding it\n");
+    }
+    return true;
+}
+
+
+// Release the bus to the next waiter
+static void arbiter_release(Arbiter *arb) {
+    pthread_mutex_unlock(&arb->bus);
+    robust_lock(&arb->mutex, NULL);
+    arb->holder = 0;
+    pthread_cond_broadcast(&arb->cond);
+    pthread_mutex_unlock(&arb->mutex);
+}
+
+
+/**
+ * Set whether the calling thread gets the I2C bus ahead of waiters with normal priority
+ * 
+ * @param high true for high priority
+ */
+void set_i2c_priority(bool high) {
+    bus_priority = high;
+}
+
+
+/**
+ * Also take the lock file while holding the I2C bus, for third-party tools that still use flock on it
+ * 
+ * @param enabled true to take the lock file too
+ */
+void set_flock_compat(bool enabled) {
+    flock_compat = enabled;
+}
+
+
+/**
+ * Allow recovery to reset the I2C controller (unbind and bind its driver) when the bus looks stuck
+ * 
+ * @param enabled true to allow the reset
+ */
+void set_controller_reset(bool enabled) {
+    controller_reset = enabled;
+}
+
+
+/**
+ * Get statistics of the I2C bus arbiter, shared by all processes
+ * 
+ * @param stats Pointer to store the statistics
+ * @return true if succeed, false if the arbiter is not available (lock file is used)
+ */
+bool get_arbiter_stats(ArbiterStats *stats) {
+    pthread_once(&arbiter_once, arbiter_map);
+    if (arbiter == NULL || !robust_lock(&arbiter->mutex, NULL)) {
+        return false;
+    }
+    *stats = arbiter->stats;
+    stats->waiters = arbiter->queue_len;
+    stats->holder = arbiter->holder;
+    pthread_mutex_unlock(&arbiter->mutex);
+    return true;
+}
+
+
+// Take the lock file while holding the arbiter, retried like the lock file path so a stuck tool can not block forever
+static bool lock_flock_compat(void) {
+    if (flock_compat_fd < 0) {
+        flock_compat_fd = open(I2C_LOCK, O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+        if (flock_compat_fd < 0) {
+            return false;
+        }
+        fchmod(flock_compat_fd, 0666);     // Only succeeds if we created it, instead of changing umask of the process
+    }
+    for (int attempts = 1; flock(flock_compat_fd, LOCK_EX | LOCK_NB) < 0; attempts ++) {
+        if ((errno != EWOULDBLOCK && errno != EINTR) || attempts >= ACQUIRE_I2C_LOCK_MAX_ATTEMPTS) {
+            return false;
+        }
+        bus_sleep(ACQUIRE_I2C_LOCK_INTERVAL_US);
+    }
+    return true;
+}
+
+
+// Acquire I2C lock, through the arbiter in shared memory, or the lock file if the arbiter is not available
+int lock_file() {
+    uint64_t start_us = (WP5_TRACE_ENABLED(lock_acquire) || trace_fp) ? monotonic_us() : 0;
+    int lock_fd = -1;
+    int attempts = 0;
+    if (i2c_transport->lock_delay) {
+        i2c_transport->lock_delay();
+    }
+    pthread_once(&arbiter_once, arbiter_map);
+    if (arbiter && arbiter_acquire(arbiter)) {
+        if (flock_compat && !lock_flock_compat()) {
+            print_log("Failed to acquire I2C lock file %s\n", I2C_LOCK);
+            arbiter_release(arbiter);
+            if (WP5_TRACE_ENABLED(lock_acquire)) {
+                WP5_TRACE(lock_acquire, ACQUIRE_I2C_LOCK_MAX_ATTEMPTS, monotonic_us() - start_us, 0);
+            }
+            return -1;
+        }
+        lock_fd = ARBITER_LOCK_TOKEN;
+        attempts = 1;
+    }
+    while (lock_fd < 0) {
+        attempts ++;
+        lock_fd = open(I2C_LOCK, O_CREAT | O_RDWR, 0666);
+        if (lock_fd < 0) {
+            print_log("Failed to open lock file %s\n", I2C_LOCK);
+            if (WP5_TRACE_ENABLED(lock_acquire)) {
+                WP5_TRACE(lock_acquire, attempts, monotonic_us() - start_us, 0);
+            }
+            return -1;
+        }
+        fchmod(lock_fd, 0666);     // Only succeeds if we created it, instead of changing umask of the process
+        if (flock(lock_fd, LOCK_EX) < 0) {
+            print_log("Failed to acquire I2C lock\n");
+            close(lock_fd);
+            if (attempts >= ACQUIRE_I2C_LOCK_MAX_ATTEMPTS) {
+                if (WP5_TRACE_ENABLED(lock_acquire)) {
+                    WP5_TRACE(lock_acquire, attempts, monotonic_us() - start_us, 0);
+                }
+                return -1;
+            }
+            lock_fd = -1;
+            bus_sleep(ACQUIRE_I2C_LOCK_INTERVAL_US);
+        }
+    }
+    if (WP5_TRACE_ENABLED(lock_acquire)) {
+        WP5_TRACE(lock_acquire, attempts, monotonic_us() - start_us, 1);
+    }
+    trace_span("lock", "lock wait", start_us, "\"attempts\":%d", attempts);
+    lock_acquired_us = WP5_TRACE_ENABLED(lock_release) ? monotonic_us() : 0;
+    return lock_fd;
+}
+
+
+// Release I2C lock
+void unlock_file(int lock_fd) {
+    if (lock_fd == ARBITER_LOCK_TOKEN) {
+        if (flock_compat && flock_compat_fd >= 0) {
+            flock(flock_compat_fd, LOCK_UN);
+        }
+        arbiter_release(arbiter);
+    } else {
+        flock(lock_fd, LOCK_UN);
+        close(lock_fd);
+    }
+    if (WP5_TRACE_ENABLED(lock_release) && lock_acquired_us) {
+        WP5_TRACE(lock_release, monotonic_us() - lock_acquired_us);
+    }
+}
+
+
+// Open I2C device on current transport, optionally without logging errors
+static int open_i2c_device_impl(bool quiet) {
+    uint64_t start_us = capture_fp ? monotonic_us() : 0;
+    int i2c_dev = i2c_transport->open(quiet);
+    if (capture_fp) {
+        capture_device('O', start_us, i2c_dev, errno);
+    }
+    return i2c_dev;
+}
+
+
+/**
+ * Open I2C device
+ *
+ * @return The handler of the device if open succesfully, -1 otherwise
+ */
+int open_i2c_device(void) {
+    return open_i2c_device_impl(false);
+}
+
+
+// Read one register with a single transaction, without retry or logging
+static int read_register_once(int i2c_dev, uint8_t index) {
+    int lock_fd = lock_file();
+    if (lock_fd < 0) {
+        return -1;
+    }
+    uint8_t value;
+    struct i2c_msg msgs[2] = {
+        { .addr = I2C_SLAVE_ADDR, .flags = 0, .len = 1, .buf = &index },
+        { .addr = I2C_SLAVE_ADDR, .flags = I2C_M_RD, .len = 1, .buf = &value },
+    };
+    struct i2c_rdwr_ioctl_data msgs_data = { .msgs = msgs, .nmsgs = 2 };
+    int result = i2c_transfer(i2c_dev, &msgs_data);
+    unlock_file(lock_fd);
+    return result < 0 ? -1 : value;
+}
+
+
+// Get milliseconds from monotonic clock
+static uint64_t monotonic_ms(void) {
+    return monotonic_us() / 1000;
+}
+
+
+// Record the result of a transaction, consecutive failures mean the board is lost
+static void report_transaction(bool success) {
+    pthread_mutex_lock(&board_mutex);
+    if (success) {
+        board_failures = 0;
+    } else if (board_state == BOARD_CONNECTED) {
+        board_failures ++;
+    }
+    pthread_mutex_unlock(&board_mutex);
+}
+
+
+// Get histogram bucket of latency, log-linear like HDR histogram
+static int latency_bucket(uint64_t us) {
+    if (us < LATENCY_SUB_BUCKETS) {
+        return (int)us;
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    int bucket = (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS
+                 + (int)((us >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+
+// Get the middle value of histogram bucket
+static double latency_bucket_value(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    uint64_t width = 1ULL << (exponent - LATENCY_SUB_BUCKET_BITS);
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (exponent - LATENCY_SUB_BUCKET_BITS);
+    return low + (width - 1) / 2.0;
+}
+
+
+// Record latency of an operation that started at start_us
+static void record_latency(TxClass tx_class, uint64_t start_us) {
+    int window = atomic_load_explicit(&latency_window, memory_order_relaxed);
+    uint64_t elapsed_us = monotonic_us() - start_us;
+    atomic_fetch_add_explicit(&latency_histogram[window][tx_class][latency_bucket(elapsed_us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&latency_sum_us[window][tx_class], elapsed_us, memory_order_relaxed);
+}
+
+
+/**
+ * Get latency statistics of a transaction class, over the current and previous windows
+ *
+ * @param tx_class The transaction class
+ * @param stats Pointer to store the statistics
+ */
+void get_latency_stats(TxClass tx_class, LatencyStats *stats) {
+    unsigned int counts[LATENCY_BUCKETS];
+    unsigned long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+        counts[i] = atomic_load_explicit(&latency_histogram[0][tx_class][i], memory_order_relaxed)
+                  + atomic_load_explicit(&latency_histogram[1][tx_class][i], memory_order_relaxed);
+        total += counts[i];
+    }
+    memset(stats, 0, sizeof(LatencyStats));
+    stats->count = total;
+    stats->sum_us = atomic_load_explicit(&latency_sum_us[0][tx_class], memory_order_relaxed)
+                  + atomic_load_explicit(&latency_sum_us[1][tx_class], memory_order_relaxed);
+    unsigned long p50_rank = (total + 1) / 2;
+    unsigned long p99_rank = total - total / 100;
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        seen += counts[i];
+        if (stats->p50_us == 0 && seen >= p50_rank) {
+            stats->p50_us = latency_bucket_value(i);
+        }
+        if (stats->p99_us == 0 && seen >= p99_rank) {
+            stats->p99_us = latency_bucket_value(i);
+        }
+        stats->max_us = latency_bucket_value(i);
+    }
+}
+
+
+/**
+ * Start a new latency window, statistics cover the current and previous windows
+ */
+void rotate_latency_window(void) {
+    int next = 1 - atomic_load(&latency_window);
+    for (int c = 0; c < TX_CLASS_COUNT; c ++) {
+        for (int i = 0; i < LATENCY_BUCKETS; i ++) {
+            atomic_store_explicit(&latency_histogram[next][c][i], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&latency_sum_us[next][c], 0, memory_order_relaxed);
+    }
+    atomic_store(&latency_window, next);
+}
+
+
+/**
+ * Get the retry policy for I2C register access
+ *
+ * @param policy Pointer to store the retry policy
+ */
+void get_retry_policy(RetryPolicy *policy) {
+    pthread_mutex_lock(&default_ctx.mutex);
+    *policy = default_ctx.retry_policy;
+    pthread_mutex_unlock(&default_ctx.mutex);
+}
+
+
+/**
+ * Set the retry policy for I2C register access
+ *
+ * @param policy The retry policy
+ */
+void set_retry_policy(const RetryPolicy *policy) {
+    wp5_ctx_set_retry_policy(&default_ctx, policy);
+}
+
+
+// Log through the sink of context if there is one
+static void ctx_log(wp5_ctx *ctx, LogLevel level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (ctx->log_sink) {
+        char text[LOG_LINE_MAX];
+        vsnprintf(text, sizeof(text), format, args);
+        ctx->log_sink(level, text, ctx->log_user_data);
+    } else {
+        vprint_log(level, format, args);
+    }
+    va_end(args);
+}
+
+
+// Update error rates of the register and the bus with the result of one transaction
+static void record_transaction(wp5_ctx *ctx, uint8_t index, bool ok) {
+    float sample = ok ? 0.0f : 1.0f;
+    ctx->reg_error_rate[index] += (sample - ctx->reg_error_rate[index]) / RETRY_ERROR_RATE_WEIGHT;
+    ctx->bus_error_rate += (sample - ctx->bus_error_rate) / RETRY_ERROR_RATE_WEIGHT;
+}
+
+
+// Get number of identical readings required by validated read of a single register
+static int read_validate_count(wp5_ctx *ctx, uint8_t index) {
+    if (ctx->retry_policy.adaptive && ctx->bus_error_rate < RETRY_HEALTHY_ERROR_RATE && ctx->reg_error_rate[index] < RETRY_HEALTHY_ERROR_RATE
+        && ++ ctx->fast_read_count % RETRY_SAMPLE_INTERVAL != 0) {
+        return 1;   // Clean bus, skip validation but keep sampling to notice errors
+    }
+    return ctx->retry_policy.read_validate_count;
+}
+
+
+// Get delay before next attempt, backs off exponentially with jitter when adaptive
+static useconds_t retry_delay(wp5_ctx *ctx, int attempt) {
+    if (!ctx->retry_policy.adaptive) {
+        return ctx->retry_policy.retry_delay_us;
+    }
+    uint64_t delay = (uint64_t)ctx->retry_policy.retry_delay_us << (attempt > 16 ? 16 : attempt - 1);
+    if (delay > (uint64_t)ctx->retry_policy.retry_delay_max_us) {
+        delay = ctx->retry_policy.retry_delay_max_us;
+    }
+    ctx->backoff_random ^= ctx->backoff_random << 13;
+    ctx->backoff_random ^= ctx->backoff_random >> 17;
+    ctx->backoff_random ^= ctx->backoff_random << 5;
+    return delay / 2 + ctx->backoff_random % (delay / 2 + 1);
+}
+
+
+// Check whether circuit breaker allows an operation, it lets one through to probe the bus after cooling down
+static bool breaker_allow(wp5_ctx *ctx) {
+    return !ctx->breaker_open || monotonic_ms() >= ctx->breaker_retry_ms;
+}
+
+
+// Record result of an operation in circuit breaker
+static void breaker_record(wp5_ctx *ctx, bool success) {
+    if (ctx->retry_policy.breaker_threshold <= 0) {
+        return;
+    }
+    if (success) {
+        if (ctx->breaker_open) {
+            ctx_log(ctx, LOG_LEVEL_INFO, "I2C bus is back, circuit breaker closed.\n");
+        }
+        ctx->breaker_failures = 0;
+        ctx->breaker_cooldown_ms = 0;
+        ctx->breaker_open = false;
+        return;
+    }
+    if (ctx->breaker_open || ++ ctx->breaker_failures >= ctx->retry_policy.breaker_threshold) {
+        ctx->breaker_cooldown_ms = ctx->breaker_cooldown_ms ? ctx->breaker_cooldown_ms * 2 : ctx->retry_policy.breaker_cooldown_ms;
+        if (ctx->breaker_cooldown_ms > BREAKER_COOLDOWN_MAX_MS) {
+            ctx->breaker_cooldown_ms = BREAKER_COOLDOWN_MAX_MS;
+        }
+        if (!ctx->breaker_open) {
+            ctx_log(ctx, LOG_LEVEL_ERROR, "I2C bus keeps failing, circuit breaker opened.\n");
+        }
+        ctx->breaker_open = true;
+        ctx->breaker_retry_ms = monotonic_ms() + ctx->breaker_cooldown_ms;
+    }
+}
+
+
+// Read value from I2C register, with or without validation, must hold ctx->mutex
+static int get_register(wp5_ctx *ctx, int i2c_dev, uint8_t index, bool validate) {
+    if (!breaker_allow(ctx)) {
+        return -1;
+    }
+    bool need_to_close = false;
+    if (i2c_dev < 0) {
+        i2c_dev = open_i2c_device();
+        if (i2c_dev < 0) {
+            ctx_log(ctx, LOG_LEVEL_INFO, "i2c_get: can not open I2C device.\n");
+            return -1;
+        }
+        need_to_close = true;
+    }
+
+    uint64_t start_us = monotonic_us();
+    int value = -1;
+    int attempts = 0;
+    int same_value_count = 0;
+    uint8_t last_read_value = 0;
+    int required_count = validate ? read_validate_count(ctx, index) : 1;
+
+    while (attempts < ctx->retry_policy.read_max_attempts && same_value_count < required_count) {
+        attempts++;
+
+        int lock_fd = lock_file();
+        if (lock_fd < 0) {
+            ctx_log(ctx, LOG_LEVEL_WARNING, "i2c_get: failed to lock I2C device.\n");
+            bus_sleep(retry_delay(ctx, attempts));
+            continue;
+        }
+
+        uint8_t read_buffer[1];
+        uint8_t read_addr_buffer[1];
+        read_addr_buffer[0] = index;
+
+        struct i2c_msg msgs[2];
+        struct i2c_rdwr_ioctl_data msgs_data;
+
+        msgs[0].addr = I2C_SLAVE_ADDR;
+        msgs[0].flags = 0;
+        msgs[0].len = 1;
+        msgs[0].buf = read_addr_buffer;
+
+        msgs[1].addr = I2C_SLAVE_ADDR;
+        msgs[1].flags = I2C_M_RD;
+        msgs[1].len = 1;
+        msgs[1].buf = read_buffer;
+
+        msgs_data.msgs = msgs;
+        msgs_data.nmsgs = 2;
+
+        if (i2c_transfer(i2c_dev, &msgs_data) < 0) {
+            WP5_TRACE(i2c_retry, index, attempts, errno);
+            trace_retry(index, attempts);
+            ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_get: read transaction failed for Reg%d on attempt %d: %s\n", index, attempts, strerror(errno));
+            unlock_file(lock_fd);
+            record_transaction(ctx, index, false);
+            bus_sleep(retry_delay(ctx, attempts));
+            continue;
+        }
+
+        unlock_file(lock_fd);
+
+        uint8_t current_read_value = read_buffer[0];
+
+        if (validate) {
+            if (attempts == 1) {
+                 last_read_value = current_read_value;
+                 same_value_count = 1;
+            } else {
+                if (current_read_value == last_read_value) {
+                    same_value_count++;
+                    record_transaction(ctx, index, true);
+                } else {
+                    record_transaction(ctx, index, false);
+                    ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_get: Reg%d value changed from 0x%02x to 0x%02x on attempt %d.\n", index, last_read_value, current_read_value, attempts);
+                    last_read_value = current_read_value;
+                    same_value_count = 1;
+                }
+            }
+        } else {
+            value = current_read_value;
+            break;
+        }
+
+        if (validate && same_value_count >= required_count) {
+             value = current_read_value;
+             break;
+        }
+    }
+    if (attempts >= ctx->retry_policy.read_max_attempts && (validate && same_value_count < required_count)) {
+        ctx_log(ctx, LOG_LEVEL_ERROR, "i2c_get: Failed to get stable reading for Reg%d after %d attempts.\n", index, attempts);
+        value = -1;
+    }
+    if (value >= 0 && required_count == 1) {
+        record_transaction(ctx, index, true);
+    }
+    breaker_record(ctx, value >= 0);
+    report_transaction(value >= 0);
+    ctx->stats.operations ++;
+    ctx->stats.attempts += attempts;
+    ctx->stats.failures += value < 0;
+    record_latency(in_stream ? TX_STREAM_CHUNK : validate ? TX_VALIDATED_READ : TX_READ, start_us);
+    if (WP5_TRACE_ENABLED(i2c_get)) {
+        WP5_TRACE(i2c_get, index, attempts, monotonic_us() - start_us, value);
+    }
+    trace_span("i2c", validate ? "i2c_get" : "i2c_get_impl", start_us, "\"reg\":%d,\"attempts\":%d,\"value\":%d", index, attempts, value);
+    if (need_to_close) {
+        close_i2c_device(i2c_dev);
+    }
+    return value;
+}
+
+
+/**
+ * Read value from I2C register, with or without validation
+ * When reading value that may change quickly, validation should not be used
+ *
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param index The index of the register
+ * @param validate Whether to validate the value
+ * @return The value if read succesfully, -1 otherwise
+ */
+int i2c_get_impl(int i2c_dev, uint8_t index, bool validate) {
+    pthread_mutex_lock(&default_ctx.mutex);
+    int value = get_register(&default_ctx, i2c_dev, index, validate);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    return value;
+}
+
+
+
+/**
+ * Read value from I2C register with validation
+ * 
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param index The index of the register
+ * @return The value if read succesfully, -1 otherwise
+ */
+int i2c_get(int i2c_dev, uint8_t index) {
+	return i2c_get_impl(i2c_dev, index, true);
+}
+
+
+// Read registers in batches of combined transactions, must hold the I2C lock
+static bool read_registers_once(int i2c_dev, const uint8_t *indexes, int count, uint8_t *values) {
+    struct i2c_msg msgs[I2C_BATCH_MAX_REGS * 2];
+    for (int first = 0; first < count; first += I2C_BATCH_MAX_REGS) {
+        int n = count - first < I2C_BATCH_MAX_REGS ? count - first : I2C_BATCH_MAX_REGS;
+        for (int i = 0; i < n; i ++) {
+            msgs[i * 2] = (struct i2c_msg){ .addr = I2C_SLAVE_ADDR, .flags = 0, .len = 1, .buf = (uint8_t *)&indexes[first + i] };
+            msgs[i * 2 + 1] = (struct i2c_msg){ .addr = I2C_SLAVE_ADDR, .flags = I2C_M_RD, .len = 1, .buf = &values[first + i] };
+        }
+        struct i2c_rdwr_ioctl_data msgs_data = { .msgs = msgs, .nmsgs = n * 2 };
+        if (i2c_transfer(i2c_dev, &msgs_data) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Read values from multiple I2C registers in batch, the first stable_count registers are validated, must hold ctx->mutex
+static bool get_registers_partly_validated(wp5_ctx *ctx, int i2c_dev, const uint8_t *indexes, int count, int stable_count, uint8_t *values) {
+    if (count <= 0 || !breaker_allow(ctx)) {
+        return false;
+    }
+    bool need_to_close = false;
+    if (i2c_dev < 0) {
+        i2c_dev = open_i2c_device();
+        if (i2c_dev < 0) {
+            ctx_log(ctx, LOG_LEVEL_INFO, "i2c_get_batch: can not open I2C device.\n");
+            return false;
+        }
+        need_to_close = true;
+    }
+    uint8_t *last_values = malloc(count);
+    if (last_values == NULL) {
+        if (need_to_close) {
+            close_i2c_device(i2c_dev);
+        }
+        return false;
+    }
+    uint64_t start_us = monotonic_us();
+    int required_count = stable_count > 0 ? ctx->retry_policy.read_validate_count : 1;   // No fast path, batches are asked to be coherent
+    int same_value_count = 0;
+    int attempts = 0;
+    while (attempts < ctx->retry_policy.read_max_attempts && same_value_count < required_count) {
+        attempts ++;
+        int lock_fd = lock_file();
+        if (lock_fd < 0) {
+            ctx_log(ctx, LOG_LEVEL_WARNING, "i2c_get_batch: failed to lock I2C device.\n");
+            bus_sleep(retry_delay(ctx, attempts));
+            continue;
+        }
+        bool ok = read_registers_once(i2c_dev, indexes, count, values);
+        unlock_file(lock_fd);
+        if (!ok) {
+            ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_get_batch: read transaction failed on attempt %d: %s\n", attempts, strerror(errno));
+            record_transaction(ctx, indexes[0], false);
+            same_value_count = 0;
+            bus_sleep(retry_delay(ctx, attempts));
+            continue;
+        }
+        if (same_value_count > 0 && memcmp(values, last_values, stable_count) != 0) {
+            ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_get_batch: values changed on attempt %d.\n", attempts);
+            record_transaction(ctx, indexes[0], false);
+            same_value_count = 0;
+        }
+        memcpy(last_values, values, count);
+        same_value_count ++;
+    }
+    free(last_values);
+    bool success = same_value_count >= required_count;
+    if (success) {
+        record_transaction(ctx, indexes[0], true);
+    } else {
+        ctx_log(ctx, LOG_LEVEL_ERROR, "i2c_get_batch: Failed to read %d registers from Reg%d after %d attempts.\n", count, indexes[0], attempts);
+    }
+    breaker_record(ctx, success);
+    report_transaction(success);
+    ctx->stats.operations ++;
+    ctx->stats.attempts += attempts;
+    ctx->stats.failures += !success;
+    record_latency(TX_RANGE_READ, start_us);
+    trace_span("i2c", "i2c_get_batch", start_us, "\"reg\":%d,\"count\":%d,\"attempts\":%d", indexes[0], count, attempts);
+    if (need_to_close) {
+        close_i2c_device(i2c_dev);
+    }
+    return success;
+}
+
+
+// Read values from multiple I2C registers in batch, must hold ctx->mutex
+static bool get_registers(wp5_ctx *ctx, int i2c_dev, const uint8_t *indexes, int count, uint8_t *values, bool validate) {
+    return get_registers_partly_validated(ctx, i2c_dev, indexes, count, validate ? count : 0, values);
+}
+
+
+/**
+ * Read values from multiple I2C registers, batched into as few bus transactions as the adapter allows
+ * With validation, the whole batch is read again until consecutive readings are identical,
+ * so the values are also coherent with each other (e.g. RTC time does not roll over in between)
+ *
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param indexes The indexes of the registers
+ * @param count The number of registers
+ * @param values Buffer to store the values, with at least count bytes
+ * @param validate Whether to validate the values
+ * @return true if read succesfully, false otherwise
+ */
+bool i2c_get_batch(int i2c_dev, const uint8_t *indexes, int count, uint8_t *values, bool validate) {
+    pthread_mutex_lock(&default_ctx.mutex);
+    bool success = get_registers(&default_ctx, i2c_dev, indexes, count, values, validate);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    return success;
+}
+
+
+/**
+ * Read data from specific I2C register until expected value is read
+ * 
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param index The index of the stream register
+ * @param buf The pointer to the buffer
+ * @param size The size of buffer
+ * @param expected The byte that would stop the reading
+ * @return The length of data read, -1 if error
+ */
+int i2c_read_stream_util(int i2c_dev, uint8_t index, uint8_t * buf, int size, uint8_t expected) {
+    bool need_to_close = false;
+    if (i2c_dev < 0) {
+        i2c_dev = open_i2c_device();
+        if (i2c_dev < 0) {
+            print_log("i2c_read_stream_util: can not open I2C device.\n");
+            return -1;
+        }
+        need_to_close = true;
+    }
+    uint64_t start_us = (WP5_TRACE_ENABLED(stream_read) || trace_fp) ? monotonic_us() : 0;
+    int i, len;
+    in_stream = true;
+    for (i = 0; i < size; i ++) {
+        int value = i2c_get_impl(i2c_dev, index, false);
+        if (value < 0) {
+            i = -2;
+            break;
+        }
+        buf[i] = (uint8_t)value;
+        if (buf[i] == expected) {
+            break;
+        }
+    }
+    in_stream = false;
+    len = i < size ? i + 1 : size;
+    if (WP5_TRACE_ENABLED(stream_read)) {
+        WP5_TRACE(stream_read, index, len, monotonic_us() - start_us);
+    }
+    trace_span("stream", "stream_read", start_us, "\"reg\":%d,\"len\":%d", index, len);
+    if (need_to_close) {
+        close_i2c_device(i2c_dev);
+    }
+    return len;
+}
+
+
+// Write value to I2C register, with or without validation, must hold ctx->mutex
+static bool set_register(wp5_ctx *ctx, int i2c_dev, uint8_t index, uint8_t value, bool validate) {
+    if (!breaker_allow(ctx)) {
+        return false;
+    }
+    bool need_to_close = false;
+    if (i2c_dev < 0) {
+        i2c_dev = open_i2c_device();
+        if (i2c_dev < 0) {
+            ctx_log(ctx, LOG_LEVEL_INFO, "i2c_set: can not open I2C device.\n");
+            return false;
+        }
+        need_to_close = true;
+    }
+    uint64_t start_us = monotonic_us();
+    bool success = true;
+    int attempts = 0;
+    while (true) {
+        attempts++;
+        if (attempts > ctx->retry_policy.write_max_attempts) {
+            ctx_log(ctx, LOG_LEVEL_ERROR, "i2c_set: too many retries, give up.\n");
+            success = false;
+            break;
+        }
+
+        int lock_fd = lock_file();
+        if (lock_fd < 0) {
+            ctx_log(ctx, LOG_LEVEL_WARNING, "i2c_set: failed to lock I2C device.\n");
+            success = false;
+            bus_sleep(retry_delay(ctx, attempts));
+            continue;
+        }
+
+        if (!validate) {    // Write without validation
+            uint8_t buffer[2];
+            buffer[0] = index;
+            buffer[1] = value;
+
+            struct i2c_msg msg;
+            struct i2c_rdwr_ioctl_data msgs_data;
+
+            msg.addr = I2C_SLAVE_ADDR;
+            msg.flags = 0;
+            msg.len = 2;
+            msg.buf = buffer;
+
+            msgs_data.msgs = &msg;
+            msgs_data.nmsgs = 1;
+
+            if (i2c_transfer(i2c_dev, &msgs_data) < 0) {
+                ctx_log(ctx, LOG_LEVEL_WARNING, "i2c_set: simple write failed.\n");
+                success = false;
+            }
+            record_transaction(ctx, index, success);
+            unlock_file(lock_fd);
+            break;
+        } else {            // Write and validate
+            // Write the value with 1 message
+            uint8_t write_buffer[2];
+            write_buffer[0] = index;
+            write_buffer[1] = value;
+        
+            struct i2c_msg write_msg;
+            struct i2c_rdwr_ioctl_data write_msgs_data;
+        
+            write_msg.addr = I2C_SLAVE_ADDR;
+            write_msg.flags = 0;
+            write_msg.len = 2;
+            write_msg.buf = write_buffer;
+        
+            write_msgs_data.msgs = &write_msg;
+            write_msgs_data.nmsgs = 1;
+        
+            if (i2c_transfer(i2c_dev, &write_msgs_data) < 0) {
+                WP5_TRACE(i2c_retry, index, attempts, errno);
+                trace_retry(index, attempts);
+                ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_set: Error writing I2C register.\n");
+                success = false;
+                unlock_file(lock_fd);
+                record_transaction(ctx, index, false);
+                bus_sleep(retry_delay(ctx, attempts));
+                continue;
+            }
+
+            // Some delay
+            bus_sleep(ctx->retry_policy.write_validate_delay_us);
+        
+            // Read back the value with 2 messages (writing index and reading value)
+            uint8_t read_buffer[1];
+            uint8_t read_addr_buffer[1];
+            read_addr_buffer[0] = index;
+        
+            struct i2c_msg read_msgs[2];
+            struct i2c_rdwr_ioctl_data read_msgs_data;
+        
+            read_msgs[0].addr = I2C_SLAVE_ADDR;
+            read_msgs[0].flags = 0;
+            read_msgs[0].len = 1;
+            read_msgs[0].buf = read_addr_buffer;
+        
+            read_msgs[1].addr = I2C_SLAVE_ADDR;
+            read_msgs[1].flags = I2C_M_RD;
+            read_msgs[1].len = 1;
+            read_msgs[1].buf = read_buffer;
+        
+            read_msgs_data.msgs = read_msgs;
+            read_msgs_data.nmsgs = 2;
+        
+            if (i2c_transfer(i2c_dev, &read_msgs_data) < 0) {
+                WP5_TRACE(i2c_retry, index, attempts, errno);
+                trace_retry(index, attempts);
+                ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_set: Error reading I2C register for validation.\n");
+                success = false;
+                unlock_file(lock_fd);
+                record_transaction(ctx, index, false);
+                bus_sleep(retry_delay(ctx, attempts));
+                continue;
+            }
+            
+            unlock_file(lock_fd);
+
+            // Validate the value
+            if (read_buffer[0] == value) {
+                record_transaction(ctx, index, true);
+                success = true;
+                break;
+            } else {
+                record_transaction(ctx, index, false);
+                ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_set: set Reg%d to 0x%02x but read back 0x%02x. Retrying...\n", index, value, read_buffer[0]);
+            }
+        }
+    }
+    breaker_record(ctx, success);
+    report_transaction(success);
+    ctx->stats.operations ++;
+    ctx->stats.attempts += attempts;
+    ctx->stats.failures += !success;
+    record_latency(in_stream ? TX_STREAM_CHUNK : validate ? TX_VALIDATED_WRITE : TX_WRITE, start_us);
+    if (WP5_TRACE_ENABLED(i2c_set)) {
+        WP5_TRACE(i2c_set, index, value, attempts, monotonic_us() - start_us, success);
+    }
+    trace_span("i2c", validate ? "i2c_set" : "i2c_set_impl", start_us, "\"reg\":%d,\"value\":%d,\"attempts\":%d,\"ok\":%s", index, value, attempts, success ? "true" : "false");
+    if (need_to_close) {
+        close_i2c_device(i2c_dev);
+    }
+    return success;
+}
+
+
+// Write multiple I2C registers in as few bus transactions as the adapter allows
+static bool write_registers_once(int i2c_dev, const uint8_t *indexes, const uint8_t *values, int count) {
+    struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+    uint8_t buffers[I2C_RDWR_IOCTL_MAX_MSGS][2];
+    for (int first = 0; first < count; first += I2C_RDWR_IOCTL_MAX_MSGS) {
+        int n = count - first < I2C_RDWR_IOCTL_MAX_MSGS ? count - first : I2C_RDWR_IOCTL_MAX_MSGS;
+        for (int i = 0; i < n; i ++) {
+            buffers[i][0] = indexes[first + i];
+            buffers[i][1] = values[first + i];
+            msgs[i] = (struct i2c_msg){ .addr = I2C_SLAVE_ADDR, .flags = 0, .len = 2, .buf = buffers[i] };
+        }
+        struct i2c_rdwr_ioctl_data msgs_data = { .msgs = msgs, .nmsgs = n };
+        if (i2c_transfer(i2c_dev, &msgs_data) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Write values to multiple I2C registers in batch and read them all back in batch, must hold ctx->mutex
+static bool set_registers(wp5_ctx *ctx, int i2c_dev, const uint8_t *indexes, const uint8_t *values, int count) {
+    if (count <= 0 || !breaker_allow(ctx)) {
+        return false;
+    }
+    bool need_to_close = false;
+    if (i2c_dev < 0) {
+        i2c_dev = open_i2c_device();
+        if (i2c_dev < 0) {
+            ctx_log(ctx, LOG_LEVEL_INFO, "i2c_set_batch: can not open I2C device.\n");
+            return false;
+        }
+        need_to_close = true;
+    }
+    uint8_t *read_back = malloc(count * 2);    // Two readings, to compare with each other
+    if (read_back == NULL) {
+        if (need_to_close) {
+            close_i2c_device(i2c_dev);
+        }
+        return false;
+    }
+    uint64_t start_us = monotonic_us();
+    bool success = false;
+    int attempts = 0;
+    while (!success && attempts < ctx->retry_policy.write_max_attempts) {
+        attempts ++;
+        int lock_fd = lock_file();
+        if (lock_fd < 0) {
+            ctx_log(ctx, LOG_LEVEL_WARNING, "i2c_set_batch: failed to lock I2C device.\n");
+            bus_sleep(retry_delay(ctx, attempts));
+            continue;
+        }
+        bool ok = write_registers_once(i2c_dev, indexes, values, count);
+        bool stable = true;
+        if (ok) {
+            bus_sleep(ctx->retry_policy.write_validate_delay_us);
+            ok = read_registers_once(i2c_dev, indexes, count, read_back);
+        }
+        // Read back as many times as a validated read, so a flipped bit can not pass for the written value
+        for (int i = 1; ok && stable && i < ctx->retry_policy.read_validate_count; i ++) {
+            ok = read_registers_once(i2c_dev, indexes, count, read_back + count);
+            stable = ok && memcmp(read_back, read_back + count, count) == 0;
+        }
+        unlock_file(lock_fd);
+        if (!ok) {
+            ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_set_batch: transaction failed on attempt %d: %s\n", attempts, strerror(errno));
+        } else if (!stable) {
+            ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_set_batch: read back changing values on attempt %d.\n", attempts);
+        } else if (memcmp(read_back, values, count) != 0) {
+            ctx_log(ctx, LOG_LEVEL_DEBUG, "i2c_set_batch: read back different values on attempt %d.\n", attempts);
+        } else {
+            success = true;
+        }
+        record_transaction(ctx, indexes[0], success);
+        if (!success) {
+            bus_sleep(retry_delay(ctx, attempts));
+        }
+    }
+    free(read_back);
+    if (!success) {
+        ctx_log(ctx, LOG_LEVEL_ERROR, "i2c_set_batch: Failed to write %d registers from Reg%d after %d attempts.\n", count, indexes[0], attempts);
+    }
+    breaker_record(ctx, success);
+    report_transaction(success);
+    ctx->stats.operations ++;
+    ctx->stats.attempts += attempts;
+    ctx->stats.failures += !success;
+    record_latency(TX_BATCH_WRITE, start_us);
+    trace_span("i2c", "i2c_set_batch", start_us, "\"reg\":%d,\"count\":%d,\"attempts\":%d,\"ok\":%s", indexes[0], count, attempts, success ? "true" : "false");
+    if (need_to_close) {
+        close_i2c_device(i2c_dev);
+    }
+    return success;
+}
+
+
+/**
+ * Write value to I2C register, with or without validation
+ * 
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param index The index of the register
+ * @param value The value of the register
+ * @param validate Whether to validate the value
+ * @return true if successfully written, false otherwise
+ */
+bool i2c_set_impl(int i2c_dev, uint8_t index, uint8_t value, bool validate) {
+    pthread_mutex_lock(&default_ctx.mutex);
+    bool success = set_register(&default_ctx, i2c_dev, index, value, validate);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    return success;
+}
+
+
+/**
+ * Write value to I2C register with validation
+ *
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param index The index of the register
+ * @param value The value of the register
+ * @return true if successfully written, false otherwise
+ */
+bool i2c_set(int i2c_dev, uint8_t index, uint8_t value) {
+	return i2c_set_impl(i2c_dev, index, value, true);
+}
+
+
+/**
+ * Write values to multiple I2C registers, batched into as few bus transactions as the adapter allows
+ * All registers are then read back in batch, and the whole batch is written again if any differs
+ *
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param indexes The indexes of the registers
+ * @param values The values of the registers
+ * @param count The number of registers
+ * @return true if successfully written, false otherwise
+ */
+bool i2c_set_batch(int i2c_dev, const uint8_t *indexes, const uint8_t *values, int count) {
+    pthread_mutex_lock(&default_ctx.mutex);
+    bool success = set_registers(&default_ctx, i2c_dev, indexes, values, count);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    return success;
+}
+
+
+/**
+ * Get the default context, which is used by the functions without context argument
+ *
+ * @return The default context
+ */
+wp5_ctx *wp5_default_ctx(void) {
+    return &default_ctx;
+}
+
+
+/**
+ * Create a context, it has its own retry policy, bus health, log sink and statistics
+ * Operations on one context are serialized, so it can be shared by threads, or each thread can have its own
+ *
+ * @return The context, or NULL if out of memory
+ */
+wp5_ctx *wp5_ctx_new(void) {
+    wp5_ctx *ctx = calloc(1, sizeof(wp5_ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->mutex, NULL);
+    ctx->i2c_dev = -1;
+    ctx->retry_policy = default_ctx.retry_policy;
+    ctx->backoff_random = default_ctx.backoff_random ^ (uint32_t)(uintptr_t)ctx;
+    return ctx;
+}
+
+
+/**
+ * Free a context created by wp5_ctx_new(), and close its I2C device
+ *
+ * @param ctx The context
+ */
+void wp5_ctx_free(wp5_ctx *ctx) {
+    if (ctx == NULL || ctx == &default_ctx) {
+        return;
+    }
+    close_i2c_device(ctx->i2c_dev);
+    pthread_mutex_destroy(&ctx->mutex);
+    free(ctx);
+}
+
+
+/**
+ * Set the log sink of a context, messages (of all levels) from operations on the context go to the sink instead of stdout
+ *
+ * @param ctx The context
+ * @param sink The function to receive messages, NULL to use the global log
+ * @param user_data Pointer passed to the sink
+ */
+void wp5_ctx_set_log_sink(wp5_ctx *ctx, Wp5LogSink sink, void *user_data) {
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->log_sink = sink;
+    ctx->log_user_data = user_data;
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+
+/**
+ * Set the retry policy of a context, bus health learned so far is discarded
+ *
+ * @param ctx The context
+ * @param policy The retry policy
+ */
+void wp5_ctx_set_retry_policy(wp5_ctx *ctx, const RetryPolicy *policy) {
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->retry_policy = *policy;
+    memset(ctx->reg_error_rate, 0, sizeof(ctx->reg_error_rate));
+    ctx->bus_error_rate = 0;
+    ctx->fast_read_count = 0;
+    ctx->breaker_failures = 0;
+    ctx->breaker_open = false;
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+
+/**
+ * Get the statistics of a context
+ *
+ * @param ctx The context
+ * @param stats Pointer to store the statistics
+ */
+void wp5_ctx_get_stats(wp5_ctx *ctx, Wp5Stats *stats) {
+    pthread_mutex_lock(&ctx->mutex);
+    *stats = ctx->stats;
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+
+// Get the device handler kept by context, open it if needed, must hold ctx->mutex
+static int ctx_device(wp5_ctx *ctx) {
+    if (ctx->i2c_dev < 0) {
+        ctx->i2c_dev = open_i2c_device_impl(true);
+    }
+    return ctx->i2c_dev;
+}
+
+
+/**
+ * Read value from I2C register in a context
+ *
+ * @param ctx The context
+ * @param index The index of the register
+ * @param validate Whether to validate the value
+ * @return The value if read succesfully, -1 otherwise
+ */
+int wp5_get(wp5_ctx *ctx, uint8_t index, bool validate) {
+    pthread_mutex_lock(&ctx->mutex);
+    int value = get_register(ctx, ctx_device(ctx), index, validate);
+    pthread_mutex_unlock(&ctx->mutex);
+    return value;
+}
+
+
+/**
+ * Read values from multiple I2C registers in a context, see i2c_get_batch()
+ *
+ * @param ctx The context
+ * @param indexes The indexes of the registers
+ * @param count The number of registers
+ * @param values Buffer to store the values, with at least count bytes
+ * @param validate Whether to validate the values
+ * @return true if read succesfully, false otherwise
+ */
+bool wp5_get_batch(wp5_ctx *ctx, const uint8_t *indexes, int count, uint8_t *values, bool validate) {
+    pthread_mutex_lock(&ctx->mutex);
+    bool success = get_registers(ctx, ctx_device(ctx), indexes, count, values, validate);
+    pthread_mutex_unlock(&ctx->mutex);
+    return success;
+}
+
+
+/**
+ * Write value to I2C register in a context
+ *
+ * @param ctx The context
+ * @param index The index of the register
+ * @param value The value of the register
+ * @param validate Whether to validate the value
+ * @return true if successfully written, false otherwise
+ */
+bool wp5_set(wp5_ctx *ctx, uint8_t index, uint8_t value, bool validate) {
+    pthread_mutex_lock(&ctx->mutex);
+    bool success = set_register(ctx, ctx_device(ctx), index, value, validate);
+    pthread_mutex_unlock(&ctx->mutex);
+    return success;
+}
+
+
+/**
+ * Find a register value by name, case insensitive
+ * 
+ * @param name The name of the register value, as in WP5_REGISTERS
+ * @return The RegisterId, -1 if not found
+ */
+int find_register(const char *name) {
+    for (int i = 0; name && i < REG_COUNT; i ++) {
+        if (strcasecmp(register_table[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * Read a register value, see GET_REGISTER() for reading by name
+ * 
+ * @param id The register value
+ * @param value Pointer to store the value in unit
+ * @return true if read succesfully, false otherwise
+ */
+bool get_register_value(RegisterId id, double *value) {
+    return get_register_values(&id, 1, value);
+}
+
+
+/**
+ * Read multiple register values in burst
+ * Values are grouped by volatility, so the static, config and clock values are read in one validated batch,
+ * and the live values in one batch without validation; command registers are read one by one
+ * 
+ * @param ids The register values, at most REG_COUNT
+ * @param count The number of register values
+ * @param values Buffer to store the values in unit, with at least count items
+ * @return true if read succesfully, false otherwise
+ */
+bool get_register_values(const RegisterId *ids, int count, double *values) {
+    if (count <= 0 || count > REG_COUNT) {
+        return false;
+    }
+    // Window 0 is validated, window 1 is not
+    uint8_t indexes[2][REG_COUNT * 2];
+    uint8_t raw[2][REG_COUNT * 2];
+    int used[2] = { 0, 0 };
+    for (int i = 0; i < count; i ++) {
+        if (ids[i] < 0 || ids[i] >= REG_COUNT || !(register_table[ids[i]].access & REG_ACCESS_RO)) {
+            return false;
+        }
+        const RegisterInfo *reg = &register_table[ids[i]];
+        if (reg->volatility != REG_VOLATILITY_COMMAND) {
+            int w = reg->volatility == REG_VOLATILITY_LIVE;
+            for (int j = 0; j < reg->width; j ++) {
+                indexes[w][used[w] ++] = reg->index + j;
+            }
+        }
+    }
+    int i2c_dev = open_i2c_device();
+    if (i2c_dev < 0) {
+        return false;
+    }
+    bool success = true;
+    for (int w = 0; w < 2 && success; w ++) {
+        if (used[w] > 0) {
+            success = i2c_get_batch(i2c_dev, indexes[w], used[w], raw[w], w == 0);
+        }
+    }
+    int pos[2] = { 0, 0 };
+    for (int i = 0; i < count && success; i ++) {
+        const RegisterInfo *reg = &register_table[ids[i]];
+        if (reg->volatility == REG_VOLATILITY_COMMAND) {
+            int value = i2c_get_impl(i2c_dev, reg->index, false);
+            uint8_t byte = (uint8_t)value;
+            success = value >= 0;
+            values[i] = decode_register_value(reg, &byte);
+        } else {
+            int w = reg->volatility == REG_VOLATILITY_LIVE;
+            values[i] = decode_register_value(reg, &raw[w][pos[w]]);
+            pos[w] += reg->width;
+        }
+    }
+    close_i2c_device(i2c_dev);
+    return success;
+}
+
+
+// Take a snapshot of all readable registers, or only the live ones
+static bool take_register_snapshot(RegisterSnapshot *snap, bool live_only) {
+    // Validated registers first
+    uint8_t indexes[I2C_VREG_LAST + 1];
+    int count = 0;
+    int stable_count = 0;
+    for (int live = live_only ? 1 : 0; live <= 1; live ++) {
+        for (int i = 0; i < REG_COUNT; i ++) {
+            const RegisterInfo *reg = &register_table[i];
+            if (reg->volatility == REG_VOLATILITY_COMMAND || !(reg->access & REG_ACCESS_RO)
+                || (reg->volatility == REG_VOLATILITY_LIVE) != live) {
+                continue;
+            }
+            for (int j = 0; j < reg->width; j ++) {
+                indexes[count ++] = reg->index + j;
+            }
+        }
+        if (!live) {
+            stable_count = count;
+        }
+    }
+    uint8_t values[I2C_VREG_LAST + 1];
+    pthread_mutex_lock(&default_ctx.mutex);
+    bool success = get_registers_partly_validated(&default_ctx, -1, indexes, count, stable_count, values);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    if (success) {
+        memset(snap, 0, sizeof(RegisterSnapshot));
+        for (int i = 0; i < count; i ++) {
+            snap->regs[indexes[i]] = values[i];
+        }
+    }
+    return success;
+}
+
+
+/**
+ * Read all registers in WP5_REGISTERS (except command registers) at once, in a few batched transactions under one lock
+ * The static, config and clock registers are validated, the live ones are read once
+ * 
+ * @param snap Pointer to store the snapshot
+ * @return true if read succesfully, false otherwise
+ */
+bool get_register_snapshot(RegisterSnapshot *snap) {
+    return take_register_snapshot(snap, false);
+}
+
+
+/**
+ * Read only the live registers in WP5_REGISTERS at once, in one transaction, other registers are left zero
+ * 
+ * @param snap Pointer to store the snapshot
+ * @return true if read succesfully, false otherwise
+ */
+bool get_live_snapshot(RegisterSnapshot *snap) {
+    return take_register_snapshot(snap, true);
+}
+
+
+// Registers published by wp5d in shared memory, guarded by a sequence lock
+typedef struct {
+    atomic_uint seq;                            // Odd while being written
+    uint32_t size;                              // Size of this structure, to detect other layout
+    atomic_ullong sampled_us;                   // Monotonic time of the sample
+    RegisterSnapshot snap;
+} PublishedSnapshot;
+
+static PublishedSnapshot *published = NULL;
+
+static int snapshot_viewer_fd = -1;
+
+
+// Create the published snapshot, writable by this process only
+static PublishedSnapshot *map_published_snapshot(void) {
+    if (published) {
+        return published;
+    }
+    shm_unlink(I2C_SNAPSHOT);   // Never reuse an object that somebody else may have created
+    int fd = shm_open(I2C_SNAPSHOT, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fchmod(fd, 0644) < 0 || ftruncate(fd, sizeof(PublishedSnapshot)) < 0) {
+        close(fd);
+        shm_unlink(I2C_SNAPSHOT);
+        return NULL;
+    }
+    PublishedSnapshot *shared = mmap(NULL, sizeof(PublishedSnapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        return NULL;
+    }
+    shared->size = sizeof(PublishedSnapshot);
+    published = shared;
+    return published;
+}
+
+
+/**
+ * Publish a register snapshot in shared memory, for viewers such as "wp5 top"
+ * 
+ * @param snap The snapshot
+ * @return true if succeed, otherwise false
+ */
+bool publish_register_snapshot(const RegisterSnapshot *snap) {
+    PublishedSnapshot *shared = map_published_snapshot();
+    if (shared == NULL) {
+        return false;
+    }
+    atomic_fetch_add(&shared->seq, 1);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&shared->snap, snap, sizeof(RegisterSnapshot));
+    atomic_store(&shared->sampled_us, monotonic_us());
+    atomic_fetch_add(&shared->seq, 1);
+    return true;
+}
+
+
+/**
+ * Read the register snapshot published by wp5d, only if it is published by root
+ * 
+ * @param snap Pointer to store the snapshot
+ * @param sampled_us Pointer to store the monotonic time (in microseconds) when it was sampled
+ * @return true if succeed, false if nothing is published
+ */
+bool read_published_snapshot(RegisterSnapshot *snap, uint64_t *sampled_us) {
+    // Let wp5d know there is a viewer, by touching the modification time of the viewer object
+    int viewer_fd = shm_open(I2C_SNAPSHOT_VIEWER, O_WRONLY, 0);
+    if (viewer_fd >= 0) {
+        futimens(viewer_fd, NULL);
+        close(viewer_fd);
+    }
+    
+    // Map it read-only for this read, so a restarted wp5d is followed
+    int fd = shm_open(I2C_SNAPSHOT, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 || st.st_size != sizeof(PublishedSnapshot)) {
+        close(fd);
+        return false;
+    }
+    PublishedSnapshot *shared = mmap(NULL, sizeof(PublishedSnapshot), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        return false;
+    }
+    bool success = false;
+    for (int attempt = 0; attempt < 100 && shared->size == sizeof(PublishedSnapshot); attempt ++) {
+        unsigned int seq = atomic_load(&shared->seq);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(snap, &shared->snap, sizeof(RegisterSnapshot));
+        *sampled_us = atomic_load(&shared->sampled_us);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load(&shared->seq) == seq) {
+            success = *sampled_us > 0;
+            break;
+        }
+    }
+    munmap(shared, sizeof(PublishedSnapshot));
+    return success;
+}
+
+
+/**
+ * Get time since a viewer last read the published snapshot
+ * 
+ * @return Milliseconds since the last read, -1 if never read
+ */
+long published_snapshot_idle_ms(void) {
+    if (snapshot_viewer_fd < 0) {
+        // Viewers only touch it, this process never maps it so nobody can make it fault
+        shm_unlink(I2C_SNAPSHOT_VIEWER);
+        snapshot_viewer_fd = shm_open(I2C_SNAPSHOT_VIEWER, O_RDONLY | O_CREAT | O_EXCL, 0666);
+        if (snapshot_viewer_fd < 0) {
+            return -1;
+        }
+        const struct timespec never[2] = { { 0, 0 }, { 0, 0 } };
+        fchmod(snapshot_viewer_fd, 0666);
+        futimens(snapshot_viewer_fd, never);
+    }
+    struct stat st;
+    if (fstat(snapshot_viewer_fd, &st) < 0 || st.st_mtim.tv_sec == 0) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long idle_ms = (long)(now.tv_sec - st.st_mtim.tv_sec) * 1000 + (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+    return idle_ms > 0 ? idle_ms : 0;
+}
+
+
+/**
+ * Write a register value, see SET_REGISTER() for writing by name
  * 
- * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param id The register value
+ * @param value The value in unit
+ * @return true if successfully written, false if failed, out of range or the register is read-only
+ */
+bool set_register_value(RegisterId id, double value) {
+    if (id < 0 || id >= REG_COUNT || !(register_table[id].access & REG_ACCESS_WO)) {
+        return false;
+    }
+    const RegisterInfo *reg = &register_table[id];
+    uint8_t raw[2];
+    if (!encode_register_value(reg, value, raw)) {
+        print_log_level(LOG_LEVEL_WARNING, "Value %g is out of range for %s (%g~%g)\n", value, reg->name, reg->min, reg->max);
+        return false;
+    }
+    int i2c_dev = open_i2c_device();
+    if (i2c_dev < 0) {
+        return false;
+    }
+    bool success = true;
+    for (int j = 0; j < reg->width && success; j ++) {    // MSB first
+        success = i2c_set_impl(i2c_dev, reg->index + j, raw[j], reg->volatility != REG_VOLATILITY_COMMAND);
+    }
+    close_i2c_device(i2c_dev);
+    return success;
+}
+
+
+/**
+ * Format a register value with the precision of its scale and its unit, e.g. "+0.05V"
+ * 
+ * @param id The register value
+ * @param value The value in unit
+ * @param buf The buffer to store the string
+ * @param size The size of the buffer
+ * @return The length of the string, as snprintf()
+ */
+int format_register_value(RegisterId id, double value, char *buf, int size) {
+    if (id < 0 || id >= REG_COUNT) {
+        return snprintf(buf, size, "%g", value);
+    }
+    const RegisterInfo *reg = &register_table[id];
+    int decimals = 0;
+    for (int s = reg->scale; s > 1; s = (s + 9) / 10) {
+        decimals ++;
+    }
+    bool is_signed = reg->codec == REG_CODEC_S8 || reg->codec == REG_CODEC_S12;
+    return snprintf(buf, size, is_signed ? "%+.*f%s" : "%.*f%s", decimals, value, reg->unit);
+}
+
+
+/**
+ * Start a register transaction, with nothing staged
+ * 
+ * @param txn The transaction
+ */
+void reg_txn_begin(RegisterTransaction *txn) {
+    txn->count = 0;
+    txn->written = 0;
+}
+
+
+/**
+ * Stage a raw register value in a transaction, staging the same register again replaces its value
+ * 
+ * @param txn The transaction
  * @param index The index of the register
- * @return The value if read succesfully, -1 otherwise
+ * @param value The value of the register
+ * @return true if staged, false if the transaction is full
  */
-int i2c_get(int i2c_dev, uint8_t index) {
-	return i2c_get_impl(i2c_dev, index, true);
+bool reg_txn_stage(RegisterTransaction *txn, uint8_t index, uint8_t value) {
+    for (int i = 0; i < txn->count; i ++) {
+        if (txn->indexes[i] == index) {
+            txn->values[i] = value;
+            return true;
+        }
+    }
+    if (txn->count >= (int)sizeof(txn->indexes)) {
+        return false;
+    }
+    txn->indexes[txn->count] = index;
+    txn->values[txn->count] = value;
+    txn->count ++;
+    return true;
 }
 
 
 /**
- * Read data from specific I2C register until expected value is read
+ * Stage a register value (in unit) in a transaction, range checked as in set_register_value()
+ * 
+ * @param txn The transaction
+ * @param id The register value, must be writable and not a command register
+ * @param value The value in unit
+ * @return true if staged, false if not writable or out of range
+ */
+bool reg_txn_stage_value(RegisterTransaction *txn, RegisterId id, double value) {
+    if (id < 0 || id >= REG_COUNT || !(register_table[id].access & REG_ACCESS_WO)
+        || register_table[id].volatility == REG_VOLATILITY_COMMAND) {
+        return false;
+    }
+    const RegisterInfo *reg = &register_table[id];
+    uint8_t raw[2];
+    if (!encode_register_value(reg, value, raw)) {
+        print_log_level(LOG_LEVEL_WARNING, "Value %g is out of range for %s (%g~%g)\n", value, reg->name, reg->min, reg->max);
+        return false;
+    }
+    bool success = true;
+    for (int j = 0; j < reg->width && success; j ++) {    // MSB first
+        success = reg_txn_stage(txn, reg->index + j, raw[j]);
+    }
+    return success;
+}
+
+
+/**
+ * Commit a register transaction: read the previous values of the staged registers, write the ones that
+ * differ in one batch and read them all back. If they can not be verified, the previous values are written back.
+ * 
+ * @param txn The transaction, txn->written tells how many registers were written
+ * @return The result
+ */
+TxnResult reg_txn_commit(RegisterTransaction *txn) {
+    txn->written = 0;
+    if (txn->count <= 0) {
+        return TXN_FAILED;
+    }
+    pthread_mutex_lock(&default_ctx.mutex);
+    int i2c_dev = open_i2c_device();
+    uint8_t previous[sizeof(txn->indexes)];
+    if (i2c_dev < 0 || !get_registers(&default_ctx, i2c_dev, txn->indexes, txn->count, previous, true)) {
+        close_i2c_device(i2c_dev);
+        pthread_mutex_unlock(&default_ctx.mutex);
+        print_log_level(LOG_LEVEL_ERROR, "Transaction of %d registers from Reg%d failed: can not read previous values.\n", txn->count, txn->indexes[0]);
+        return TXN_FAILED;
+    }
+    
+    // Only write the registers that differ, keeping the staged order
+    uint8_t indexes[sizeof(txn->indexes)], values[sizeof(txn->indexes)], restore[sizeof(txn->indexes)];
+    int count = 0;
+    for (int i = 0; i < txn->count; i ++) {
+        if (previous[i] != txn->values[i]) {
+            indexes[count] = txn->indexes[i];
+            values[count] = txn->values[i];
+            restore[count] = previous[i];
+            count ++;
+        }
+    }
+    TxnResult result = TXN_COMMITTED;
+    if (count > 0 && !set_registers(&default_ctx, i2c_dev, indexes, values, count)) {
+        print_log_level(LOG_LEVEL_WARNING, "Transaction of %d registers from Reg%d failed, restoring previous values...\n", count, indexes[0]);
+        result = set_registers(&default_ctx, i2c_dev, indexes, restore, count) ? TXN_ROLLED_BACK : TXN_ROLLBACK_FAILED;
+        if (result == TXN_ROLLBACK_FAILED) {
+            print_log_level(LOG_LEVEL_ERROR, "Transaction of %d registers from Reg%d failed, and previous values could not be restored.\n", count, indexes[0]);
+        }
+    }
+    close_i2c_device(i2c_dev);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    txn->written = result == TXN_COMMITTED ? count : 0;
+    return result;
+}
+
+
+/**
+ * Write data to specific I2C register until expected value appear
  * 
  * @param i2c_dev The I2C device handler, use -1 to get one internally
  * @param index The index of the stream register
  * @param buf The pointer to the buffer
  * @param size The size of buffer
- * @param expected The byte that would stop the reading
- * @return The length of data read, -1 if error
+ * @param expected The byte that would stop the writing
+ * @return The length of data wrote, -1 if error
  */
-int i2c_read_stream_util(int i2c_dev, uint8_t index, uint8_t * buf, int size, uint8_t expected) {
+int i2c_write_stream_util(int i2c_dev, uint8_t index, uint8_t * buf, int size, uint8_t expected) {
     bool need_to_close = false;
     if (i2c_dev < 0) {
         i2c_dev = open_i2c_device();
         if (i2c_dev < 0) {
-            print_log("i2c_read_stream_util: can not open I2C device.\n");
+            print_log("i2c_write_stream_util: can not open I2C device.\n");
             return -1;
         }
         need_to_close = true;
     }
+    uint64_t start_us = (WP5_TRACE_ENABLED(stream_write) || trace_fp) ? monotonic_us() : 0;
     int i, len;
+    in_stream = true;
     for (i = 0; i < size; i ++) {
-        buf[i] = (uint8_t)i2c_get_impl(i2c_dev, index, false);
+        if (!i2c_set_impl(i2c_dev, index, buf[i], false)) {
+            i = -2;
+            break;
+        }
         if (buf[i] == expected) {
             break;
         }
     }
-    len = i + 1;
+    in_stream = false;
+    len = i < size ? i + 1 : size;
+    if (WP5_TRACE_ENABLED(stream_write)) {
+        WP5_TRACE(stream_write, index, len, monotonic_us() - start_us);
+    }
+    trace_span("stream", "stream_write", start_us, "\"reg\":%d,\"len\":%d", index, len);
     if (need_to_close) {
-        close(i2c_dev);
+        close_i2c_device(i2c_dev);
     }
     return len;
 }
 
 
 /**
- * Write value to I2C register, with or without validation
- * 
- * @param i2c_dev The I2C device handler, use -1 to get one internally
- * @param index The index of the register
- * @param value The value of the register
- * @param validate Whether to validate the value
- * @return true if successfully written, false otherwise
+ * Close I2C device
+ *
+ * @param i2c_dev The I2C device handler
  */
-bool i2c_set_impl(int i2c_dev, uint8_t index, uint8_t value, bool validate) {
-    bool need_to_close = false;
-    if (i2c_dev < 0) {
-        i2c_dev = open_i2c_device();
-        if (i2c_dev < 0) {
-            print_log("i2c_set: can not open I2C device.\n");
-            return false;
+void close_i2c_device(int i2c_dev) {
+    if (i2c_dev >= 0) {
+        uint64_t start_us = capture_fp ? monotonic_us() : 0;
+        i2c_transport->close(i2c_dev);
+        if (capture_fp) {
+            capture_device('C', start_us, 0, 0);
         }
-        need_to_close = true;
     }
-    bool success = true;
-    int attempts = 0;
-    while (true) {
-        attempts++;
-        if (attempts > I2C_WRITE_MAX_ATTEMPTS) {
-            print_log("i2c_set: too many retries, give up.\n");
-            success = false;
-            break;
+}
+
+
+// Probe the board by reading firmware id and version, update cached information
+static bool probe_board(void) {
+    int dev = open_i2c_device_impl(true);
+    if (dev < 0) {
+        return false;
+    }
+    int fw_id = -1;
+    for (int attempts = 0; attempts < BOARD_PROBE_ATTEMPTS && fw_id < 0; attempts ++) {
+        if (attempts > 0) {
+            usleep(BOARD_PROBE_RETRY_DELAY_US);
         }
+        fw_id = read_register_once(dev, I2C_FW_ID);
+    }
+    int model = MODEL_UNKNOWN;
+    switch (fw_id) {
+        case FW_ID_WITTYPI_5:
+            model = MODEL_WITTYPI_5;
+            break;
+        case FW_ID_WITTYPI_5_MINI:
+            model = MODEL_WITTYPI_5_MINI;
+            break;
+        case FW_ID_WITTYPI_5_L3V7:
+            model = MODEL_WITTYPI_5_L3V7;
+            break;
+    }
+    if (model != MODEL_UNKNOWN) {
+        board_fw_major = read_register_once(dev, I2C_FW_VERSION_MAJOR);
+        board_fw_minor = read_register_once(dev, I2C_FW_VERSION_MINOR);
+    }
+    close_i2c_device(dev);
+    board_model = model;
+    return model != MODEL_UNKNOWN;
+}
 
-        int lock_fd = lock_file();
-        if (lock_fd < 0) {
-            print_log("i2c_set: failed to lock I2C device.\n");
-            success = false;
-            usleep(1000);
-            continue;
+
+/**
+ * Update board connection state
+ * The board is probed only when it is not connected and the backoff time has passed,
+ * a connected board is considered lost after several consecutive failed transactions
+ *
+ * @return The current board connection state
+ */
+BoardState update_board_state(void) {
+    pthread_mutex_lock(&board_mutex);
+    uint64_t now = monotonic_ms();
+    if (board_state == BOARD_CONNECTED) {
+        if (board_failures >= BOARD_LOST_FAILURES) {
+            board_state = BOARD_LOST;
+            board_backoff_ms = BOARD_BACKOFF_MIN_MS;
+            board_next_probe_ms = now + board_backoff_ms;
         }
+    } else if (now >= board_next_probe_ms) {
+        board_state = BOARD_PROBING;
+        if (probe_board()) {
+            board_state = BOARD_CONNECTED;
+            board_failures = 0;
+            board_backoff_ms = 0;
+        } else {
+            board_state = BOARD_ABSENT;
+            board_backoff_ms = board_backoff_ms == 0 ? BOARD_BACKOFF_MIN_MS : board_backoff_ms * 2;
+            if (board_backoff_ms > BOARD_BACKOFF_MAX_MS) {
+                board_backoff_ms = BOARD_BACKOFF_MAX_MS;
+            }
+            board_next_probe_ms = monotonic_ms() + board_backoff_ms;
+        }
+    }
+    BoardState state = board_state;
+    pthread_mutex_unlock(&board_mutex);
+    return state;
+}
 
-        if (!validate) {    // Write without validation
-            uint8_t buffer[2];
-            buffer[0] = index;
-            buffer[1] = value;
 
-            struct i2c_msg msg;
-            struct i2c_rdwr_ioctl_data msgs_data;
+/**
+ * Mark the board as lost, e.g. when its firmware is known to be rebooting
+ */
+void mark_board_lost(void) {
+    pthread_mutex_lock(&board_mutex);
+    board_state = BOARD_LOST;
+    board_failures = 0;
+    board_backoff_ms = BOARD_BACKOFF_MIN_MS;
+    board_next_probe_ms = monotonic_ms() + board_backoff_ms;
+    pthread_mutex_unlock(&board_mutex);
+}
 
-            msg.addr = I2C_SLAVE_ADDR;
-            msg.flags = 0;
-            msg.len = 2;
-            msg.buf = buffer;
 
-            msgs_data.msgs = &msg;
-            msgs_data.nmsgs = 1;
+/**
+ * Wait until the board is connected
+ *
+ * @param timeout_ms The maximum time to wait, in milliseconds
+ * @return true if connected, false if timeout
+ */
+bool wait_for_board(int timeout_ms) {
+    uint64_t deadline = monotonic_ms() + timeout_ms;
+    while (update_board_state() != BOARD_CONNECTED) {
+        uint64_t now = monotonic_ms();
+        if (now >= deadline) {
+            return false;
+        }
+        uint64_t next = board_next_probe_ms < deadline ? board_next_probe_ms : deadline;
+        if (next > now) {
+            usleep((next - now) * 1000);
+        }
+    }
+    return true;
+}
 
-            if (ioctl(i2c_dev, I2C_RDWR, &msgs_data) < 0) {
-                print_log("i2c_set: simple write failed.\n");
-                success = false;
-            }
-            unlock_file(lock_fd);
-            break;
-        } else {            // Write and validate
-            // Write the value with 1 message
-            uint8_t write_buffer[2];
-            write_buffer[0] = index;
-            write_buffer[1] = value;
-        
-            struct i2c_msg write_msg;
-            struct i2c_rdwr_ioctl_data write_msgs_data;
-        
-            write_msg.addr = I2C_SLAVE_ADDR;
-            write_msg.flags = 0;
-            write_msg.len = 2;
-            write_msg.buf = write_buffer;
-        
-            write_msgs_data.msgs = &write_msg;
-            write_msgs_data.nmsgs = 1;
-        
-            if (ioctl(i2c_dev, I2C_RDWR, &write_msgs_data) < 0) {
-                print_log("i2c_set: Error writing I2C register.\n");
-                success = false;
-                unlock_file(lock_fd);
-                continue;
-            }
 
-            // Some delay
-            usleep(I2C_WRITE_VALIDATE_DELAY_US);
-        
-            // Read back the value with 2 messages (writing index and reading value)
-            uint8_t read_buffer[1];
-            uint8_t read_addr_buffer[1];
-            read_addr_buffer[0] = index;
-        
-            struct i2c_msg read_msgs[2];
-            struct i2c_rdwr_ioctl_data read_msgs_data;
-        
-            read_msgs[0].addr = I2C_SLAVE_ADDR;
-            read_msgs[0].flags = 0;
-            read_msgs[0].len = 1;
-            read_msgs[0].buf = read_addr_buffer;
-        
-            read_msgs[1].addr = I2C_SLAVE_ADDR;
-            read_msgs[1].flags = I2C_M_RD;
-            read_msgs[1].len = 1;
-            read_msgs[1].buf = read_buffer;
-        
-            read_msgs_data.msgs = read_msgs;
-            read_msgs_data.nmsgs = 2;
-        
-            if (ioctl(i2c_dev, I2C_RDWR, &read_msgs_data) < 0) {
-                print_log("i2c_set: Error reading I2C register for validation.\n");
-                success = false;
-                unlock_file(lock_fd);
-                continue;
-            }
-            
-            unlock_file(lock_fd);
+/**
+ * Get Witty Pi model
+ * The model is cached while the board stays connected
+ *
+ * @return The model of Witty Pi
+ */
+int get_wittypi_model(void) {
+    return update_board_state() == BOARD_CONNECTED ? board_model : MODEL_UNKNOWN;
+}
 
-            // Validate the value
-            if (read_buffer[0] == value) {
-                success = true;
-                break;
-            } else {
-                print_log("i2c_set: set Reg%d to 0x%02x but read back 0x%02x. Retrying...\n", index, value, read_buffer[0]);
-            }
-        }
+
+/**
+ * Get firmware version of the connected board
+ *
+ * @param major Pointer to store the major version
+ * @param minor Pointer to store the minor version
+ * @return true if board is connected and version is known, otherwise false
+ */
+bool get_firmware_version(int * major, int * minor) {
+    if (update_board_state() != BOARD_CONNECTED || board_fw_major < 0 || board_fw_minor < 0) {
+        return false;
     }
-    if (need_to_close) {
-        close(i2c_dev);
+    if (major) *major = board_fw_major;
+    if (minor) *minor = board_fw_minor;
+    return true;
+}
+
+
+// Remember when the firmware was told to reload, in the arbiter too so other processes know it
+static void note_firmware_reload(void) {
+    uint64_t now_ms = monotonic_ms();
+    local_reload_ms = now_ms;
+    pthread_once(&arbiter_once, arbiter_map);
+    if (arbiter && robust_lock(&arbiter->mutex, NULL)) {
+        arbiter->reload_ms = now_ms;
+        pthread_mutex_unlock(&arbiter->mutex);
+    }
+}
+
+
+// Whether the firmware may still be reloading after a command from any process
+static bool firmware_reloading(void) {
+    uint64_t reload_ms = local_reload_ms;
+    pthread_once(&arbiter_once, arbiter_map);
+    if (arbiter && robust_lock(&arbiter->mutex, NULL)) {
+        if (arbiter->reload_ms > reload_ms) {
+            reload_ms = arbiter->reload_ms;
+        }
+        pthread_mutex_unlock(&arbiter->mutex);
     }
-    return success;
+    return reload_ms != 0 && monotonic_ms() - reload_ms < FIRMWARE_RELOAD_WINDOW_MS;
 }
 
 
 /**
- * Write value to I2C register with validation
+ * Recover from persistent I2C failures: close the device, reopen it and validate the board.
+ * If that is not enough and the adapter keeps timing out, reset the I2C adapter (where supported,
+ * only if allowed with set_controller_reset and never while the firmware may be reloading).
+ * All is done within a time budget.
  *
- * @param i2c_dev The I2C device handler, use -1 to get one internally
- * @param index The index of the register
- * @param value The value of the register
- * @return true if successfully written, false otherwise
+ * @param i2c_dev The I2C device handler in use (will be closed), or -1
+ * @return The new I2C device handler if recovered, -1 otherwise
  */
-bool i2c_set(int i2c_dev, uint8_t index, uint8_t value) {
-	return i2c_set_impl(i2c_dev, index, value, true);
-}
-
+int recover_i2c_device(int i2c_dev) {
+    uint64_t start_ms = monotonic_ms();
+    uint64_t deadline_ms = start_ms + RECOVERY_BUDGET_MS;
+    recovery_stats.attempts ++;
+    close_i2c_device(i2c_dev);
 
-/**
- * Write data to specific I2C register until expected value appear
- * 
- * @param i2c_dev The I2C device handler, use -1 to get one internally
- * @param index The index of the stream register
- * @param buf The pointer to the buffer
- * @param size The size of buffer
- * @param expected The byte that would stop the writing
- * @return The length of data wrote, -1 if error
- */
-int i2c_write_stream_util(int i2c_dev, uint8_t index, uint8_t * buf, int size, uint8_t expected) {
-    bool need_to_close = false;
-    if (i2c_dev < 0) {
-        i2c_dev = open_i2c_device();
-        if (i2c_dev < 0) {
-            print_log("i2c_write_stream_util: can not open I2C device.\n");
-            return -1;
-        }
-        need_to_close = true;
-    }
-    int i, len;
-    for (i = 0; i < size; i ++) {
-        if (-1 == i2c_set_impl(i2c_dev, index, buf[i], false)) {
-            i = -2;
+    bool reset_done = false;
+    int delay_ms = RECOVERY_RETRY_DELAY_MIN_MS;
+    while (true) {
+        last_transfer_errno = 0;
+        i2c_dev = open_i2c_device_impl(true);
+        if (i2c_dev >= 0 && probe_board()) {
             break;
         }
-        if (buf[i] == expected) {
+        close_i2c_device(i2c_dev);
+        i2c_dev = -1;
+        // NAK means the board is absent or rebooting, only a timeout from the adapter means the bus is stuck
+        bool stuck = last_transfer_errno == ETIMEDOUT || last_transfer_errno == EAGAIN;
+        if (controller_reset && !reset_done && stuck && i2c_transport->reset
+            && monotonic_ms() - start_ms >= RECOVERY_BUDGET_MS / 5 && !firmware_reloading()) {
+            reset_done = true;      // Reopening does not help, reset the adapter once
+            if (i2c_transport->reset()) {
+                recovery_stats.adapter_resets ++;
+            } else {
+                print_log_level(LOG_LEVEL_WARNING, "Failed to reset I2C controller.\n");
+            }
+        }
+        uint64_t now = monotonic_ms();
+        if (now + delay_ms >= deadline_ms) {
             break;
         }
+        usleep(delay_ms * 1000);
+        delay_ms = delay_ms * 2 > RECOVERY_RETRY_DELAY_MAX_MS ? RECOVERY_RETRY_DELAY_MAX_MS : delay_ms * 2;
     }
-    len = i + 1;
-    if (need_to_close) {
-        close(i2c_dev);
-    }
-    return len;
-}
 
-
-/**
- * Close I2C device
- *
- * @param i2c_dev The I2C device handler
- */
-void close_i2c_device(int i2c_dev) {
-    if (i2c_dev >= 0) {
-        close(i2c_dev);
+    int elapsed_ms = (int)(monotonic_ms() - start_ms);
+    if (i2c_dev < 0) {
+        recovery_stats.failed ++;
+        print_log_level(LOG_LEVEL_ERROR, "I2C bus not recovered after %d ms.\n", elapsed_ms);
+        return -1;
+    }
+    pthread_mutex_lock(&board_mutex);
+    board_state = BOARD_CONNECTED;
+    board_failures = 0;
+    board_backoff_ms = 0;
+    pthread_mutex_unlock(&board_mutex);
+    pthread_mutex_lock(&default_ctx.mutex);
+    breaker_record(&default_ctx, true);
+    pthread_mutex_unlock(&default_ctx.mutex);
+    recovery_stats.recovered ++;
+    recovery_stats.last_ms = elapsed_ms;
+    recovery_stats.total_ms += elapsed_ms;
+    if (elapsed_ms > recovery_stats.max_ms) {
+        recovery_stats.max_ms = elapsed_ms;
     }
+    print_log("I2C bus recovered in %d ms%s.\n", elapsed_ms, reset_done ? " (controller reset)" : "");
+    return i2c_dev;
 }
 
 
 /**
- * Get Witty Pi model
+ * Get metrics of I2C bus recovery
  *
- * @return The model of Witty Pi
+ * @param stats Pointer to store the metrics
  */
-int get_wittypi_model(void) {
-    LogMode bk_mode = log_mode;
-    log_mode = LOG_NONE;
-    int dev = open_i2c_device();
-    if (dev < 0) {
-        log_mode = bk_mode;
-        return MODEL_UNKNOWN;
-    }
-    int fw_id = -1;
-    int attempts = 0;
-    while(fw_id == -1) {
-        fw_id = i2c_get_impl(dev, I2C_FW_ID, false);
-        attempts ++;
-        if (attempts >= 3) {
-            log_mode = bk_mode;
-			return MODEL_UNKNOWN;
-		}
-		if (fw_id == -1) {
-		    usleep(100000);
-	    }
-    }
-    close(dev);
-    log_mode = bk_mode;
-    switch (fw_id) {
-        case FW_ID_WITTYPI_5:
-            return MODEL_WITTYPI_5;
-        case FW_ID_WITTYPI_5_MINI:
-            return MODEL_WITTYPI_5_MINI;
-        case FW_ID_WITTYPI_5_L3V7:
-            return MODEL_WITTYPI_5_L3V7;
-    }
-    return MODEL_UNKNOWN;
+void get_recovery_stats(RecoveryStats *stats) {
+    *stats = recovery_stats;
 }
 
 
@@ -630,20 +3659,11 @@ int get_power_mode(void) {
  * @return Temperature in Celsius degree, -1000.0 if error
  */
 float get_temperature(void) {
-	int dev = open_i2c_device();
-    if (dev < 0) {
+    double celsius;
+    if (!GET_REGISTER(TEMPERATURE, &celsius)) {
         return -1000.0f;
     }
-	int msb = i2c_get_impl(dev, I2C_VREG_TMP112_TEMP_MSB, false);
-    int lsb = i2c_get_impl(dev, I2C_VREG_TMP112_TEMP_LSB, false);
-	if (msb < 0 || lsb < 0) {
-		return -1000.0f;
-	}
-	int16_t raw = (msb << 4) | (lsb >> 4);
-    if (raw & 0x800) {
-        raw |= 0xF000;
-    }
-    return (float)((int32_t)raw * 625) / 10000.0f;
+    return (float)celsius;
 }
 
 
@@ -658,16 +3678,13 @@ float celsius_to_fahrenheit(float celsius) {
 }
 
 
-// Get 16-bit value from two I2C registers and return its thousandth value
-float get_thousandth(uint8_t msb_index, uint8_t lsb_index) {
-    int dev = open_i2c_device();
-    if (dev < 0) {
+// Get a live register value, -1 if fail
+static float get_live_value(RegisterId id) {
+    double value;
+    if (!get_register_value(id, &value)) {
         return -1.0f;
     }
-    int msb = i2c_get_impl(dev, msb_index, false) & 0x7F;
-    int lsb = i2c_get_impl(dev, lsb_index, false);
-    close(dev);
-    return (float)((msb << 8) | lsb) / 1000.0f;
+    return (float)value;
 }
 
 
@@ -677,7 +3694,7 @@ float get_thousandth(uint8_t msb_index, uint8_t lsb_index) {
  * @return Input voltage
  */
 float get_vin(void) {
-    return get_thousandth(I2C_VIN_MV_MSB, I2C_VIN_MV_LSB);
+    return get_live_value(REG_VIN);
 }
 
 
@@ -687,7 +3704,7 @@ float get_vin(void) {
  * @return USB-C voltage
  */
 float get_vusb(void) {
-    return get_thousandth(I2C_VUSB_MV_MSB, I2C_VUSB_MV_LSB);
+    return get_live_value(REG_VUSB);
 }
 
 
@@ -697,7 +3714,7 @@ float get_vusb(void) {
  * @return Output voltage
  */
 float get_vout(void) {
-    return get_thousandth(I2C_VOUT_MV_MSB, I2C_VOUT_MV_LSB);
+    return get_live_value(REG_VOUT);
 }
 
 
@@ -707,7 +3724,7 @@ float get_vout(void) {
  * @return Output current
  */
 float get_iout(void) {
-    return get_thousandth(I2C_IOUT_MA_MSB, I2C_IOUT_MA_LSB);
+    return get_live_value(REG_IOUT);
 }
 
 
@@ -741,7 +3758,41 @@ bool get_system_time(DateTime * dt) {
 
 
 /**
- * Get RTC time information
+ * Check if system time is synchronized (e.g. disciplined by NTP)
+ * 
+ * @return true if kernel reports synchronized clock, otherwise false
+ */
+bool is_system_time_synced(void) {
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    int state = adjtimex(&tx);
+    if (state < 0 || state == TIME_ERROR) {
+        return false;
+    }
+    return !(tx.status & STA_UNSYNC) && tx.maxerror < SYNCED_MAX_ERROR_US;
+}
+
+
+// Get the midpoint of two timespec values, in seconds
+static double timespec_midpoint(struct timespec *a, struct timespec *b) {
+    return ((double)a->tv_sec + (double)b->tv_sec) / 2.0 + ((double)a->tv_nsec + (double)b->tv_nsec) / 2e9;
+}
+
+
+// Decode RTC time from registers RX8025_SEC to RX8025_YEAR
+static void decode_rtc_time(const uint8_t *values, DateTime *dt) {
+    dt->sec = bcd_to_dec(values[0]);
+    dt->min = bcd_to_dec(values[1]);
+    dt->hour = bcd_to_dec(values[2]);
+    dt->wday = bcd_to_dec(values[3]) & 0x07;
+    dt->day = bcd_to_dec(values[4]);
+    dt->month = bcd_to_dec(values[5]);
+    dt->year = 2000 + bcd_to_dec(values[6]);
+}
+
+
+/**
+ * Get RTC time information, the clock registers are read in one burst until identical readings validate it
  *
  * @param dt The DateTime object to save the result
  * @return true if succeed, otherwise false
@@ -751,32 +3802,27 @@ bool get_rtc_time(DateTime * dt) {
         return false;
     }
 
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
+    static const uint8_t indexes[] = {
+        I2C_VREG_RX8025_SEC, I2C_VREG_RX8025_MIN, I2C_VREG_RX8025_HOUR, I2C_VREG_RX8025_WEEKDAY,
+        I2C_VREG_RX8025_DAY, I2C_VREG_RX8025_MONTH, I2C_VREG_RX8025_YEAR
+    };
+    uint8_t values[sizeof(indexes)];
+    if (!i2c_get_batch(-1, indexes, sizeof(indexes), values, true)) {
         return false;
     }
-    int sec = i2c_get(i2c_dev, I2C_VREG_RX8025_SEC);
-    int min = i2c_get(i2c_dev, I2C_VREG_RX8025_MIN);
-    int hour = i2c_get(i2c_dev, I2C_VREG_RX8025_HOUR);
-    int wday = i2c_get(i2c_dev, I2C_VREG_RX8025_WEEKDAY);
-    int day = i2c_get(i2c_dev, I2C_VREG_RX8025_DAY);
-    int month = i2c_get(i2c_dev, I2C_VREG_RX8025_MONTH);
-    int year = i2c_get(i2c_dev, I2C_VREG_RX8025_YEAR);
-    close_i2c_device(i2c_dev);
+    decode_rtc_time(values, dt);
+	return true;
+}
 
-    if (sec < 0 || min < 0 || hour < 0 || wday < 0 ||
-        day < 0 || month < 0 || year < 0) {
-        return false;
-    }
 
-    dt->sec = bcd_to_dec(sec);
-    dt->min = bcd_to_dec(min);
-    dt->hour = bcd_to_dec(hour);
-    dt->wday = bcd_to_dec(wday) & 0x07;
-    dt->day = bcd_to_dec(day);
-    dt->month = bcd_to_dec(month);
-    dt->year = 2000 + bcd_to_dec(year);
-	return true;
+/**
+ * Get RTC time from a snapshot
+ * 
+ * @param snap The snapshot
+ * @param dt The DateTime object to save the result
+ */
+void snapshot_rtc_time(const RegisterSnapshot *snap, DateTime *dt) {
+    decode_rtc_time(&snap->regs[I2C_VREG_RX8025_SEC], dt);
 }
 
 
@@ -823,6 +3869,68 @@ bool system_to_rtc(void) {
 }
 
 
+/**
+ * Write system time into RTC, aligned to the second boundary of system time
+ * The seconds register is written last, exactly on the boundary, so the RTC
+ * starts counting the new second in phase with the system clock
+ *
+ * @return true if succeed, otherwise false
+ */
+bool system_to_rtc_precise(void) {
+    int i2c_dev = open_i2c_device();
+    if (i2c_dev < 0) {
+        return false;
+    }
+
+    // Hold seconds at zero, so other fields will not roll over while being written
+    bool success = i2c_set(i2c_dev, I2C_VREG_RX8025_SEC, 0);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time_t target = now.tv_sec + 1;
+    if (1000000000L - now.tv_nsec < RTC_WRITE_MARGIN_NS) {
+        target ++;
+    }
+    struct tm tm_target;
+    localtime_r(&target, &tm_target);
+
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_MIN, dec_to_bcd(tm_target.tm_min));
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_HOUR, dec_to_bcd(tm_target.tm_hour));
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_WEEKDAY, BIT_VALUE(dec_to_bcd(tm_target.tm_wday)));
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_DAY, dec_to_bcd(tm_target.tm_mday));
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_MONTH, dec_to_bcd(tm_target.tm_mon + 1));
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_YEAR, dec_to_bcd(tm_target.tm_year + 1900 - 2000));
+
+    // Wait for the boundary and then write seconds, which also resets RTC sub-second counter
+    struct timespec boundary = { .tv_sec = target, .tv_nsec = 0 };
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &boundary, NULL) == EINTR);
+    success &= i2c_set(i2c_dev, I2C_VREG_RX8025_SEC, dec_to_bcd(tm_target.tm_sec));
+
+    close_i2c_device(i2c_dev);
+    return success;
+}
+
+
+// Set system time in-process, fall back to "sudo date" if not permitted
+static bool set_system_time(const struct timespec *ts) {
+    if (clock_settime(CLOCK_REALTIME, ts) == 0) {
+        return true;
+    }
+    if (errno != EPERM) {
+        print_log("Failed setting system time: %s\n", strerror(errno));
+        return false;
+    }
+    struct tm local_tm;
+    localtime_r(&ts->tv_sec, &local_tm);
+    char date_cmd[64];
+    snprintf(date_cmd, sizeof(date_cmd),
+            "sudo date -s \"%04d-%02d-%02d %02d:%02d:%02d\"",
+            local_tm.tm_year + 1900, local_tm.tm_mon + 1, local_tm.tm_mday,
+            local_tm.tm_hour, local_tm.tm_min, local_tm.tm_sec);
+    return system(date_cmd) == 0;
+}
+
+
 /**
  * Write RTC time into system
  *
@@ -831,17 +3939,385 @@ bool system_to_rtc(void) {
 bool rtc_to_system(void) {
 	DateTime rtc_dt;
 	if (get_rtc_time(&rtc_dt)) {
-        char date_cmd[64];
-        snprintf(date_cmd, sizeof(date_cmd),
-                "sudo date -s \"%04d-%02d-%02d %02d:%02d:%02d\"",
-                rtc_dt.year, rtc_dt.month, rtc_dt.day,
-                rtc_dt.hour, rtc_dt.min, rtc_dt.sec);
-        int result = system(date_cmd);
-        if (result == 0) {
-            return true;
+        struct tm rtc_tm;
+        memset(&rtc_tm, 0, sizeof(rtc_tm));
+        rtc_tm.tm_year = rtc_dt.year - 1900;
+        rtc_tm.tm_mon = rtc_dt.month - 1;
+        rtc_tm.tm_mday = rtc_dt.day;
+        rtc_tm.tm_hour = rtc_dt.hour;
+        rtc_tm.tm_min = rtc_dt.min;
+        rtc_tm.tm_sec = rtc_dt.sec;
+        rtc_tm.tm_isdst = -1;
+        struct timespec ts = { .tv_sec = mktime(&rtc_tm), .tv_nsec = 0 };
+        if (ts.tv_sec != (time_t)-1) {
+            return set_system_time(&ts);
+        }
+	}
+	return false;
+}
+
+
+/**
+ * Measure the offset between RTC time and system time
+ * RTC only provides whole seconds, so the register for seconds is polled until
+ * it changes, and the moment of change is used as the RTC second boundary
+ * 
+ * @param offset Pointer to store the offset in seconds (RTC time minus system time)
+ * @return true if succeed, otherwise false
+ */
+bool get_rtc_offset(double * offset) {
+    if (offset == NULL) {
+        return false;
+    }
+    int i2c_dev = open_i2c_device();
+    if (i2c_dev < 0) {
+        return false;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_REALTIME, &start);
+    int first = i2c_get_impl(i2c_dev, I2C_VREG_RX8025_SEC, false);
+    clock_gettime(CLOCK_REALTIME, &end);
+    if (first < 0) {
+        close_i2c_device(i2c_dev);
+        return false;
+    }
+    double prev_mid = timespec_midpoint(&start, &end);
+    double deadline = prev_mid + RTC_OFFSET_TIMEOUT_US / 1e6;
+    double boundary = -1.0;
+    int sec = first;
+    while (prev_mid < deadline) {
+        usleep(RTC_OFFSET_POLL_INTERVAL_US);
+        clock_gettime(CLOCK_REALTIME, &start);
+        sec = i2c_get_impl(i2c_dev, I2C_VREG_RX8025_SEC, false);
+        clock_gettime(CLOCK_REALTIME, &end);
+        if (sec < 0) {
+            break;
+        }
+        double mid = timespec_midpoint(&start, &end);
+        if (sec != first) {
+            boundary = (prev_mid + mid) / 2.0;
+            break;
+        }
+        prev_mid = mid;
+    }
+    if (boundary < 0) {
+        print_log("get_rtc_offset: RTC second boundary not detected.\n");
+        close_i2c_device(i2c_dev);
+        return false;
+    }
+
+    int min = i2c_get(i2c_dev, I2C_VREG_RX8025_MIN);
+    int hour = i2c_get(i2c_dev, I2C_VREG_RX8025_HOUR);
+    int day = i2c_get(i2c_dev, I2C_VREG_RX8025_DAY);
+    int month = i2c_get(i2c_dev, I2C_VREG_RX8025_MONTH);
+    int year = i2c_get(i2c_dev, I2C_VREG_RX8025_YEAR);
+    close_i2c_device(i2c_dev);
+    if (min < 0 || hour < 0 || day < 0 || month < 0 || year < 0) {
+        return false;
+    }
+
+    struct tm rtc_tm;
+    memset(&rtc_tm, 0, sizeof(rtc_tm));
+    rtc_tm.tm_sec = bcd_to_dec(sec);
+    rtc_tm.tm_min = bcd_to_dec(min);
+    rtc_tm.tm_hour = bcd_to_dec(hour);
+    rtc_tm.tm_mday = bcd_to_dec(day);
+    rtc_tm.tm_mon = bcd_to_dec(month) - 1;
+    rtc_tm.tm_year = 2000 + bcd_to_dec(year) - 1900;
+    rtc_tm.tm_isdst = -1;
+    time_t rtc_time = mktime(&rtc_tm);
+    if (rtc_time == (time_t)-1) {
+        return false;
+    }
+    *offset = (double)rtc_time - boundary;
+    return true;
+}
+
+
+/**
+ * Set the list of NTP servers used for network time synchronization
+ * 
+ * @param servers Comma separated list of "host" or "host:port", NULL to use default list
+ */
+void set_ntp_servers(const char * servers) {
+    snprintf(ntp_servers, sizeof(ntp_servers), "%s", servers ? servers : NTP_DEFAULT_SERVERS);
+}
+
+
+// Split "host", "host:port" or "[ipv6]:port" into host and port strings
+static void split_host_port(char *entry, char **host, char **port) {
+    *port = NTP_DEFAULT_PORT;
+    if (entry[0] == '[') {
+        char *end = strchr(entry, ']');
+        *host = entry + 1;
+        if (end) {
+            *end = '\0';
+            if (end[1] == ':' && end[2]) {
+                *port = end + 2;
+            }
+        }
+        return;
+    }
+    *host = entry;
+    char *colon = strchr(entry, ':');
+    if (colon && strchr(colon + 1, ':') == NULL) {
+        *colon = '\0';
+        if (colon[1]) {
+            *port = colon + 1;
+        }
+    }
+}
+
+
+// Convert timespec to NTP 64-bit timestamp
+static uint64_t timespec_to_ntp(const struct timespec *ts) {
+    uint64_t sec = (uint64_t)ts->tv_sec + NTP_UNIX_EPOCH_DIFF;
+    uint64_t frac = ((uint64_t)ts->tv_nsec << 32) / 1000000000ULL;
+    return (sec << 32) | frac;
+}
+
+
+// Convert NTP 64-bit timestamp to seconds since Unix epoch
+static double ntp_to_seconds(uint64_t ntp) {
+    return (double)((int64_t)(ntp >> 32) - NTP_UNIX_EPOCH_DIFF) + (double)(ntp & 0xFFFFFFFFULL) / 4294967296.0;
+}
+
+
+// Read big-endian 64-bit value
+static uint64_t read_be64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i ++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+
+// Write big-endian 64-bit value
+static void write_be64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i --) {
+        p[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+
+// Name lookup of one NTP server, on heap because a lookup that can not be canceled outlives sntp_query()
+typedef struct {
+    struct gaicb req;
+    struct addrinfo hints;
+    atomic_int refs;        // Held by sntp_query() and by the completion notification
+    char entry[];           // Host and port referred by req
+} SntpLookup;
+
+
+// Drop a reference of the lookup, the last one frees it
+static void release_sntp_lookup(SntpLookup *lookup) {
+    if (atomic_fetch_sub(&lookup->refs, 1) == 1) {
+        if (lookup->req.ar_result) {
+            freeaddrinfo(lookup->req.ar_result);
+        }
+        free(lookup);
+    }
+}
+
+
+// Completion notification of a lookup, runs in a thread of its own
+static void sntp_lookup_done(union sigval value) {
+    release_sntp_lookup(value.sival_ptr);
+}
+
+
+// Start looking up a server, given as "host", "host:port" or "[IPv6]:port"
+static SntpLookup *start_sntp_lookup(const char *entry) {
+    SntpLookup *lookup = calloc(1, sizeof(SntpLookup) + strlen(entry) + 1);
+    if (lookup == NULL) {
+        return NULL;
+    }
+    strcpy(lookup->entry, entry);
+    char *host, *port;
+    split_host_port(lookup->entry, &host, &port);
+    lookup->hints.ai_family = AF_UNSPEC;
+    lookup->hints.ai_socktype = SOCK_DGRAM;
+    lookup->req.ar_name = host;
+    lookup->req.ar_service = port;
+    lookup->req.ar_request = &lookup->hints;
+    atomic_init(&lookup->refs, 2);
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = sntp_lookup_done;
+    sev.sigev_value.sival_ptr = lookup;
+    struct gaicb *list[1] = { &lookup->req };
+    if (getaddrinfo_a(GAI_NOWAIT, list, 1, &sev) != 0) {
+        free(lookup);
+        return NULL;
+    }
+    return lookup;
+}
+
+
+// Finish with a lookup, one still in progress is canceled or left to its completion notification to free
+static void end_sntp_lookup(SntpLookup *lookup) {
+    if (gai_cancel(&lookup->req) == EAI_CANCELED) {
+        release_sntp_lookup(lookup);    // No notification for canceled lookup
+    }
+    release_sntp_lookup(lookup);
+}
+
+
+/**
+ * Query the configured NTP servers in parallel and pick the best sample
+ * Offset and delay are calculated as described in RFC 4330, and the sample
+ * with the smallest round-trip delay wins
+ * 
+ * @param offset Pointer to store the offset in seconds (server time minus system time)
+ * @param delay Pointer to store the round-trip delay in seconds, can be NULL
+ * @return true if at least one valid response is received, otherwise false
+ */
+bool sntp_query(double * offset, double * delay) {
+    if (offset == NULL) {
+        return false;
+    }
+
+    // Resolve all servers in parallel
+    char list[sizeof(ntp_servers)];
+    snprintf(list, sizeof(list), "%s", ntp_servers);
+    SntpLookup *lookups[SNTP_MAX_SERVERS];
+    int count = 0;
+    char *saveptr = NULL;
+    for (char *entry = strtok_r(list, ", ", &saveptr); entry && count < SNTP_MAX_SERVERS; entry = strtok_r(NULL, ", ", &saveptr)) {
+        SntpLookup *lookup = start_sntp_lookup(entry);
+        if (lookup) {
+            lookups[count ++] = lookup;
+        } else {
+            print_log("sntp: can not look up %s\n", entry);
+        }
+    }
+    if (count == 0) {
+        return false;
+    }
+    uint64_t resolve_deadline_ms = monotonic_ms() + SNTP_TIMEOUT_MS;
+    while (true) {
+        const struct gaicb *pending[SNTP_MAX_SERVERS];
+        int pending_count = 0;
+        for (int i = 0; i < count; i ++) {
+            if (gai_error(&lookups[i]->req) == EAI_INPROGRESS) {
+                pending[pending_count ++] = &lookups[i]->req;
+            }
+        }
+        uint64_t now_ms = monotonic_ms();
+        if (pending_count == 0 || now_ms >= resolve_deadline_ms) {
+            break;
+        }
+        uint64_t remaining_ms = resolve_deadline_ms - now_ms;
+        struct timespec timeout = { .tv_sec = remaining_ms / 1000, .tv_nsec = (remaining_ms % 1000) * 1000000L };
+        gai_suspend(pending, pending_count, &timeout);
+    }
+
+    // Send one request to each server
+    struct pollfd fds[SNTP_MAX_SERVERS];
+    uint64_t sent[SNTP_MAX_SERVERS];
+    struct timespec t1[SNTP_MAX_SERVERS];
+    const char *names[SNTP_MAX_SERVERS];
+    int active = 0;
+    for (int i = 0; i < count; i ++) {
+        fds[i].fd = -1;
+        fds[i].events = POLLIN;
+        names[i] = lookups[i]->req.ar_name;
+        if (gai_error(&lookups[i]->req) != 0) {
+            print_log("sntp: can not resolve %s\n", names[i]);
+            continue;
+        }
+        struct addrinfo *ai = lookups[i]->req.ar_result;
+        int fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            uint8_t packet[NTP_PACKET_SIZE] = { 0 };
+            packet[0] = (0 << 6) | (4 << 3) | 3;    // LI=0, VN=4, Mode=3 (client)
+            clock_gettime(CLOCK_REALTIME, &t1[i]);
+            sent[i] = timespec_to_ntp(&t1[i]);
+            write_be64(packet + 40, sent[i]);
+            if (send(fd, packet, sizeof(packet), 0) == sizeof(packet)) {
+                fds[i].fd = fd;
+                active ++;
+                fd = -1;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Collect responses until all answered or timeout
+    bool found = false;
+    double best_offset = 0, best_delay = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (active > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed_ms >= SNTP_TIMEOUT_MS || poll(fds, count, SNTP_TIMEOUT_MS - elapsed_ms) <= 0) {
+            break;
+        }
+        for (int i = 0; i < count; i ++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLERR))) {
+                continue;
+            }
+            uint8_t packet[NTP_PACKET_SIZE];
+            ssize_t n = recv(fds[i].fd, packet, sizeof(packet), 0);
+            struct timespec t4;
+            clock_gettime(CLOCK_REALTIME, &t4);
+            if (n < 0 && errno == EAGAIN) {
+                continue;
+            }
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            active --;
+            if (n < NTP_PACKET_SIZE) {
+                print_log("sntp: no valid response from %s\n", names[i]);
+                continue;
+            }
+
+            uint8_t li = packet[0] >> 6;
+            uint8_t mode = packet[0] & 0x07;
+            uint8_t stratum = packet[1];
+            uint64_t originate = read_be64(packet + 24);
+            uint64_t receive = read_be64(packet + 32);
+            uint64_t transmit = read_be64(packet + 40);
+            if (li == 3 || (mode != 4 && mode != 5) || stratum == 0 || stratum > 15
+                || originate != sent[i] || receive == 0 || transmit == 0) {
+                print_log("sntp: invalid response from %s\n", names[i]);
+                continue;
+            }
+            double T1 = (double)t1[i].tv_sec + t1[i].tv_nsec / 1e9;
+            double T2 = ntp_to_seconds(receive);
+            double T3 = ntp_to_seconds(transmit);
+            double T4 = (double)t4.tv_sec + t4.tv_nsec / 1e9;
+            double d = (T4 - T1) - (T3 - T2);
+            double t = ((T2 - T1) + (T3 - T4)) / 2.0;
+            print_log("sntp: %s offset=%+.6fs delay=%.6fs stratum=%d\n", names[i], t, d, stratum);
+            if (d >= 0 && (!found || d < best_delay)) {
+                found = true;
+                best_offset = t;
+                best_delay = d;
+            }
         }
-	}
-	return false;
+    }
+    for (int i = 0; i < count; i ++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+        end_sntp_lookup(lookups[i]);
+    }
+    if (found) {
+        *offset = best_offset;
+        if (delay) {
+            *delay = best_delay;
+        }
+    }
+    return found;
 }
 
 
@@ -851,110 +4327,21 @@ bool rtc_to_system(void) {
  * @return true if succeed, otherwise false
  */
 bool network_to_system_and_rtc(void) {
-    int sockfd;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-    char buffer[4096] = {0};
-    char http_request[] = "HEAD / HTTP/1.1\r\nHost: www.google.com\r\nConnection: close\r\n\r\n";
-    char date_header[128] = {0};
-    struct tm time_info = {0};
-    
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        return false;
-    }
-    
-    struct timeval timeout;
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
-    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
-    
-    server = gethostbyname("www.google.com");
-    if (server == NULL) {
-        close(sockfd);
-        return false;
-    }
-    
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    memcpy(&serv_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    serv_addr.sin_port = htons(80);
-    
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        close(sockfd);
-        return false;
-    }
-    
-    if (write(sockfd, http_request, strlen(http_request)) < 0) {
-        close(sockfd);
-        return false;
-    }
-    
-    int n = read(sockfd, buffer, sizeof(buffer) - 1);
-    close(sockfd);
-    if (n <= 0) {
+    double offset, delay;
+    if (!sntp_query(&offset, &delay)) {
         return false;
     }
-    buffer[n] = 0;
-    
-    // Find Date header in HTTP response
-    char *date_ptr = strstr(buffer, "Date: ");
-    if (!date_ptr) {
-        return false;
-    }
-    
-    int i = 0;
-    date_ptr += 6;  // Skip "Date: "
-    while (*date_ptr && *date_ptr != '\r' && i < sizeof(date_header) - 1) {
-        date_header[i++] = *date_ptr++;
-    }
-    date_header[i] = 0;
-    
-    // Parse date string (format: "Day, DD Mon YYYY HH:MM:SS GMT")
-    if (strptime(date_header, "%a, %d %b %Y %H:%M:%S GMT", &time_info) == NULL) {
-        return false;
-    }
-    
-    time_t utc_time;
-    time_info.tm_isdst = 0;
-    
-    char *old_tz = getenv("TZ");
-    char old_tz_buf[256] = {0};
-    if (old_tz) {
-        strncpy(old_tz_buf, old_tz, sizeof(old_tz_buf) - 1);
-    }
-    
-    setenv("TZ", "UTC", 1);
-    tzset();
-    
-    utc_time = mktime(&time_info);
-    
-    if (old_tz) {
-        setenv("TZ", old_tz_buf, 1);
-    } else {
-        unsetenv("TZ");
-    }
-    tzset();
-    
-    if (utc_time == (time_t)-1) {
-        return false;
-    }
-    
-    // Convert UTC time to local time
-    struct tm *local_tm = localtime(&utc_time);
-    
-    char date_cmd[64];
-    snprintf(date_cmd, sizeof(date_cmd),
-            "sudo date -s \"%04d-%02d-%02d %02d:%02d:%02d\"",
-            local_tm->tm_year + 1900, local_tm->tm_mon + 1, local_tm->tm_mday,
-            local_tm->tm_hour, local_tm->tm_min, local_tm->tm_sec);
-    int result = system(date_cmd);
-    if (result != 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double corrected = (double)now.tv_sec + now.tv_nsec / 1e9 + offset;
+    struct timespec ts;
+    ts.tv_sec = (time_t)corrected;
+    ts.tv_nsec = (long)((corrected - (double)ts.tv_sec) * 1e9);
+    if (!set_system_time(&ts)) {
         return false;
     }
-    
-    return system_to_rtc();
+    print_log("System time is adjusted by %+.6fs (delay %.6fs)\n", offset, delay);
+    return system_to_rtc_precise();
 }
 
 
@@ -972,26 +4359,16 @@ bool get_startup_time(uint8_t * date, uint8_t * hour, uint8_t * minute, uint8_t
 		return false;
 	}
 	
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-    
-    int sec_val = i2c_get(i2c_dev, I2C_CONF_ALARM1_SECOND);
-    int min_val = i2c_get(i2c_dev, I2C_CONF_ALARM1_MINUTE);
-    int hour_val = i2c_get(i2c_dev, I2C_CONF_ALARM1_HOUR);
-    int day_val = i2c_get(i2c_dev, I2C_CONF_ALARM1_DAY);
-    
-    close_i2c_device(i2c_dev);
-    
-    if (sec_val < 0 || min_val < 0 || hour_val < 0 || day_val < 0) {
+    static const RegisterId ids[] = { REG_CONF_ALARM1_SECOND, REG_CONF_ALARM1_MINUTE, REG_CONF_ALARM1_HOUR, REG_CONF_ALARM1_DAY };
+    double values[4];
+    if (!get_register_values(ids, 4, values)) {
         return false;
     }
     
-    *second = bcd_to_dec((uint8_t)sec_val);
-    *minute = bcd_to_dec((uint8_t)min_val);
-    *hour = bcd_to_dec((uint8_t)hour_val);
-    *date = bcd_to_dec((uint8_t)day_val);
+    *second = (uint8_t)values[0];
+    *minute = (uint8_t)values[1];
+    *hour = (uint8_t)values[2];
+    *date = (uint8_t)values[3];
     
     if (*second > 59 || *minute > 59 || *hour > 23 || *date == 0 || *date > 31) {
         return false;
@@ -1014,26 +4391,16 @@ bool get_shutdown_time(uint8_t * date, uint8_t * hour, uint8_t * minute, uint8_t
 		return false;
 	}
 	
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-    
-    int sec_val = i2c_get(i2c_dev, I2C_CONF_ALARM2_SECOND);
-    int min_val = i2c_get(i2c_dev, I2C_CONF_ALARM2_MINUTE);
-    int hour_val = i2c_get(i2c_dev, I2C_CONF_ALARM2_HOUR);
-    int day_val = i2c_get(i2c_dev, I2C_CONF_ALARM2_DAY);
-    
-    close_i2c_device(i2c_dev);
-    
-    if (sec_val < 0 || min_val < 0 || hour_val < 0 || day_val < 0) {
+    static const RegisterId ids[] = { REG_CONF_ALARM2_SECOND, REG_CONF_ALARM2_MINUTE, REG_CONF_ALARM2_HOUR, REG_CONF_ALARM2_DAY };
+    double values[4];
+    if (!get_register_values(ids, 4, values)) {
         return false;
     }
     
-    *second = bcd_to_dec((uint8_t)sec_val);
-    *minute = bcd_to_dec((uint8_t)min_val);
-    *hour = bcd_to_dec((uint8_t)hour_val);
-    *date = bcd_to_dec((uint8_t)day_val);
+    *second = (uint8_t)values[0];
+    *minute = (uint8_t)values[1];
+    *hour = (uint8_t)values[2];
+    *date = (uint8_t)values[3];
     
     if (*second > 59 || *minute > 59 || *hour > 23 || *date == 0 || *date > 31) {
         return false;
@@ -1042,6 +4409,18 @@ bool get_shutdown_time(uint8_t * date, uint8_t * hour, uint8_t * minute, uint8_t
 }
 
 
+// Write alarm registers (second, minute, hour, day) in one transaction, so the alarm is never half updated
+static bool write_alarm(uint8_t first_index, uint8_t date, uint8_t hour, uint8_t minute, uint8_t second) {
+    RegisterTransaction txn;
+    reg_txn_begin(&txn);
+    reg_txn_stage(&txn, first_index, dec_to_bcd(second));
+    reg_txn_stage(&txn, first_index + 1, dec_to_bcd(minute));
+    reg_txn_stage(&txn, first_index + 2, dec_to_bcd(hour));
+    reg_txn_stage(&txn, first_index + 3, dec_to_bcd(date));
+    return reg_txn_commit(&txn) == TXN_COMMITTED;
+}
+
+
 /**
  * Set scheduled startup time
  * 
@@ -1055,25 +4434,7 @@ bool set_startup_time(uint8_t date, uint8_t hour, uint8_t minute, uint8_t second
     if (date < 1 || date > 31 || hour > 23 || minute > 59 || second > 59) {
         return false;
     }
-    
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-    
-    uint8_t bcd_second = dec_to_bcd(second);
-    uint8_t bcd_minute = dec_to_bcd(minute);
-    uint8_t bcd_hour = dec_to_bcd(hour);
-    uint8_t bcd_date = dec_to_bcd(date);
-    
-    bool success = true;
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_SECOND, bcd_second);
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_MINUTE, bcd_minute);
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_HOUR, bcd_hour);
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_DAY, bcd_date);
-    
-    close_i2c_device(i2c_dev);
-    return success;
+    return write_alarm(I2C_CONF_ALARM1_SECOND, date, hour, minute, second);
 }
 
 
@@ -1083,17 +4444,7 @@ bool set_startup_time(uint8_t date, uint8_t hour, uint8_t minute, uint8_t second
  * @return true if succeed, false if fail
  */
 bool clear_startup_time() {
-	int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-	bool success = true;
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_SECOND, 0);
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_MINUTE, 0);
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_HOUR, 0);
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM1_DAY, 0);
-	close_i2c_device(i2c_dev);
-    return success;	
+    return write_alarm(I2C_CONF_ALARM1_SECOND, 0, 0, 0, 0);
 }
 
 
@@ -1110,25 +4461,7 @@ bool set_shutdown_time(uint8_t date, uint8_t hour, uint8_t minute, uint8_t secon
     if (date < 1 || date > 31 || hour > 23 || minute > 59 || second > 59) {
         return false;
     }
-    
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-    
-    uint8_t bcd_second = dec_to_bcd(second);
-    uint8_t bcd_minute = dec_to_bcd(minute);
-    uint8_t bcd_hour = dec_to_bcd(hour);
-    uint8_t bcd_date = dec_to_bcd(date);
-    
-    bool success = true;
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_SECOND, bcd_second);
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_MINUTE, bcd_minute);
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_HOUR, bcd_hour);
-    success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_DAY, bcd_date);
-    
-    close_i2c_device(i2c_dev);
-    return success;
+    return write_alarm(I2C_CONF_ALARM2_SECOND, date, hour, minute, second);
 }
 
 
@@ -1138,17 +4471,7 @@ bool set_shutdown_time(uint8_t date, uint8_t hour, uint8_t minute, uint8_t secon
  * @return true if succeed, false if fail
  */
 bool clear_shutdown_time() {
-	int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-	bool success = true;
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_SECOND, 0);
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_MINUTE, 0);
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_HOUR, 0);
-	success &= i2c_set(i2c_dev, I2C_CONF_ALARM2_DAY, 0);
-	close_i2c_device(i2c_dev);
-    return success;	
+    return write_alarm(I2C_CONF_ALARM2_SECOND, 0, 0, 0, 0);
 }
 
 
@@ -1158,16 +4481,11 @@ bool clear_shutdown_time() {
  * @return The low voltage threshold in Volt, -1 if fail
  */
 float get_low_voltage_threshold(void) {
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
+    double value;
+    if (!GET_REGISTER(CONF_LOW_VOLTAGE, &value) || value <= 0) {
         return -1;
     }
-    int value = i2c_get(i2c_dev, I2C_CONF_LOW_VOLTAGE);
-    close_i2c_device(i2c_dev);
-    if (value <= 0) {
-        return -1;
-    }
-    return value / 10.0f;
+    return (float)value;
 }
 
 
@@ -1178,17 +4496,7 @@ float get_low_voltage_threshold(void) {
  * @return true if succeed, false if fail
  */
 bool set_low_voltage_threshold(float threshold) {
-    if (threshold < 0) {
-        return false;
-    }
-    uint8_t value = (uint8_t)(threshold * 10.0f);
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
-    }
-    bool result = i2c_set(i2c_dev, I2C_CONF_LOW_VOLTAGE, value);
-    close_i2c_device(i2c_dev);
-    return result;
+    return SET_REGISTER(CONF_LOW_VOLTAGE, threshold);
 }
 
 
@@ -1198,16 +4506,11 @@ bool set_low_voltage_threshold(float threshold) {
  * @return The recovery voltage threshold in Volt, -1 if fail
  */
 float get_recovery_voltage_threshold(void) {
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return -1;
-    }
-    int value = i2c_get(i2c_dev, I2C_CONF_RECOVERY_VOLTAGE);
-    close_i2c_device(i2c_dev);
-    if (value <= 0) {
+    double value;
+    if (!GET_REGISTER(CONF_RECOVERY_VOLTAGE, &value) || value <= 0) {
         return -1;
     }
-    return value / 10.0f;
+    return (float)value;
 }
 
 
@@ -1218,17 +4521,59 @@ float get_recovery_voltage_threshold(void) {
  * @return true if succeed, false if fail
  */
 bool set_recovery_voltage_threshold(float threshold) {
-    if (threshold < 0) {
+    return SET_REGISTER(CONF_RECOVERY_VOLTAGE, threshold);
+}
+
+
+// Get generation of file listings shared by all processes, false if the arbiter is not available
+static bool get_listing_generation(uint32_t *generation) {
+    pthread_once(&arbiter_once, arbiter_map);
+    if (arbiter == NULL || !robust_lock(&arbiter->mutex, NULL)) {
         return false;
     }
-    uint8_t value = (uint8_t)(threshold * 10.0f);
-    int i2c_dev = open_i2c_device();
-    if (i2c_dev < 0) {
-        return false;
+    *generation = arbiter->listing_generation;
+    pthread_mutex_unlock(&arbiter->mutex);
+    return true;
+}
+
+
+// Make cached listings of all users stale, after commands that may write files on Witty Pi disk
+static void invalidate_file_listings(void) {
+    pthread_once(&arbiter_once, arbiter_map);
+    if (arbiter && robust_lock(&arbiter->mutex, NULL)) {
+        arbiter->listing_generation ++;
+        pthread_mutex_unlock(&arbiter->mutex);
+        return;
     }
-    bool result = i2c_set(i2c_dev, I2C_CONF_RECOVERY_VOLTAGE, value);
-    close_i2c_device(i2c_dev);
-    return result;
+    // Without arbiter only our own caches can be removed, those of other users expire
+    for (int dir = DIRECTORY_ROOT; dir <= DIRECTORY_SCHEDULE; dir ++) {
+        char path[64];
+        snprintf(path, sizeof(path), LISTING_CACHE_PATH, (unsigned)geteuid(), dir);
+        unlink(path);
+    }
+}
+
+
+// Whether the administrative command may write files on Witty Pi disk
+static bool admin_command_writes_disk(uint16_t psw_cmd) {
+    switch (psw_cmd) {
+        case I2C_ADMIN_PWD_CMD_FORMAT_DISK:
+        case I2C_ADMIN_PWD_CMD_SYNC_CONF:
+        case I2C_ADMIN_PWD_CMD_SAVE_LOG:
+        case I2C_ADMIN_PWD_CMD_LOAD_SCRIPT:
+        case I2C_ADMIN_PWD_CMD_CHOOSE_SCRIPT:
+        case I2C_ADMIN_PWD_CMD_PURGE_SCRIPT:
+        case I2C_ADMIN_PWD_CMD_RESET_CONF:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// Whether the firmware reloads (and disappears from the bus for a while) after running the command
+static bool admin_command_reloads(uint16_t psw_cmd) {
+    return psw_cmd == I2C_ADMIN_PWD_CMD_CHOOSE_SCRIPT;
 }
 
 
@@ -1243,16 +4588,302 @@ bool run_admin_command(uint16_t psw_cmd) {
     if (i2c_dev < 0) {
         return false;
     }
+    uint64_t start_us = WP5_TRACE_ENABLED(admin_command) ? monotonic_us() : 0;
+    trace_begin("admin_command");
     bool result = true;
 	uint8_t psw = (psw_cmd >> 8);
 	uint8_t cmd = (psw_cmd & 0xFF);
 	result &= i2c_set(i2c_dev, I2C_ADMIN_PASSWORD, psw);
 	result &= i2c_set_impl(i2c_dev, I2C_ADMIN_COMMAND, cmd, false);
     close_i2c_device(i2c_dev);
+    if (admin_command_writes_disk(psw_cmd)) {
+        invalidate_file_listings();
+    }
+    if (admin_command_reloads(psw_cmd)) {
+        note_firmware_reload();
+    }
+    if (WP5_TRACE_ENABLED(admin_command)) {
+        WP5_TRACE(admin_command, psw_cmd, monotonic_us() - start_us, result);
+    }
+    trace_end("admin_command");
+    return result;
+}
+
+
+/**
+ * Run administrative command and wait for its completion
+ * The command register is polled with growing interval until the firmware clears it. For commands that
+ * make the firmware reload, it waits until the board is gone and connected again.
+ * 
+ * @param psw_cmd The 16 bit integer that stores password and command
+ * @param timeout_ms The maximum time to wait, in milliseconds
+ * @param elapsed_ms Pointer to store the elapsed time in milliseconds, can be NULL
+ * @return ADMIN_DONE, ADMIN_TIMEOUT, or ADMIN_FAILED if the command could not be sent
+ */
+AdminResult run_admin_command_wait(uint16_t psw_cmd, int timeout_ms, int *elapsed_ms) {
+    uint64_t start_ms = monotonic_ms();
+    uint64_t deadline_ms = start_ms + (timeout_ms > 0 ? (uint64_t)timeout_ms : 0);
+    AdminResult result = ADMIN_FAILED;
+    if (run_admin_command(psw_cmd)) {
+        result = ADMIN_TIMEOUT;
+        bool reloads = admin_command_reloads(psw_cmd);
+        bool gone = false;
+        uint64_t cleared_ms = 0;
+        uint64_t delay_ms = ADMIN_POLL_MIN_MS;
+        int i2c_dev = open_i2c_device();
+        while (i2c_dev >= 0) {
+            int value = i2c_get_impl(i2c_dev, I2C_ADMIN_COMMAND, false);
+            uint64_t now_ms = monotonic_ms();
+            if (value < 0 && reloads) {
+                gone = true;
+                break;
+            }
+            if (value == 0 && cleared_ms == 0) {
+                cleared_ms = now_ms;
+            }
+            if (cleared_ms && (!reloads || now_ms - cleared_ms >= ADMIN_RELOAD_GRACE_MS)) {
+                result = ADMIN_DONE;    // Done, or reloaded faster than polling could notice
+                break;
+            }
+            if (now_ms >= deadline_ms) {
+                break;
+            }
+            bus_sleep((now_ms + delay_ms < deadline_ms ? delay_ms : deadline_ms - now_ms) * 1000);
+            delay_ms = delay_ms * 2 < ADMIN_POLL_MAX_MS ? delay_ms * 2 : ADMIN_POLL_MAX_MS;
+        }
+        close_i2c_device(i2c_dev);
+        if (gone) {
+            mark_board_lost();
+            uint64_t now_ms = monotonic_ms();
+            if (now_ms < deadline_ms && wait_for_board(deadline_ms - now_ms)) {
+                result = ADMIN_DONE;
+            }
+        }
+    }
+    int elapsed = (int)(monotonic_ms() - start_ms);
+    if (result != ADMIN_DONE) {
+        print_log_level(LOG_LEVEL_WARNING, "Administrative command 0x%04X %s after %d ms.\n", psw_cmd, result == ADMIN_TIMEOUT ? "timed out" : "failed", elapsed);
+    }
+    if (elapsed_ms) {
+        *elapsed_ms = elapsed;
+    }
     return result;
 }
 
 
+/**
+ * Initialize an empty file listing
+ * 
+ * @param list The listing
+ */
+void init_file_listing(FileListing *list) {
+    memset(list, 0, sizeof(FileListing));
+}
+
+
+/**
+ * Release the memory of a file listing
+ * 
+ * @param list The listing
+ */
+void free_file_listing(FileListing *list) {
+    free(list->arena);
+    free(list->offsets);
+    init_file_listing(list);
+}
+
+
+// Append a byte to the arena of file listing
+static bool listing_append(FileListing *list, char c) {
+    if (list->arena_used >= list->arena_size) {
+        size_t size = list->arena_size ? list->arena_size * 2 : LISTING_ARENA_INITIAL;
+        char *arena = realloc(list->arena, size);
+        if (arena == NULL) {
+            return false;
+        }
+        list->arena = arena;
+        list->arena_size = size;
+    }
+    list->arena[list->arena_used ++] = c;
+    return true;
+}
+
+
+/**
+ * Parse the next part of a directory listing from the download stream
+ * Entries are available as soon as their delimiter is parsed, the field before LIST_END is not an entry
+ * 
+ * @param list The listing
+ * @param data The next part of the stream
+ * @param len The length of data
+ * @param filter Called for each entry once parsed, return false to leave it out; can be NULL
+ * @param arg The argument for filter
+ * @return The number of new entries, -1 if out of memory
+ */
+int feed_file_listing(FileListing *list, const uint8_t *data, int len, ListingFilter filter, void *arg) {
+    int added = 0;
+    for (int i = 0; i < len && !list->complete; i ++) {
+        char c = (char)data[i];
+        if (!list->started) {
+            list->started = (c == LIST_BEGIN);
+            list->segment = list->arena_used;
+        } else if (c == LIST_END) {
+            list->arena_used = list->segment;
+            list->complete = true;
+        } else if (c == LIST_DELIMITER) {
+            if (list->arena_used == list->segment) {
+                continue;   // Empty field
+            }
+            if (!listing_append(list, '\0')) {
+                return -1;
+            }
+            if (filter && !filter(list->arena + list->segment, list->count, arg)) {
+                list->arena_used = list->segment;
+                continue;
+            }
+            if (list->count >= list->capacity) {
+                int capacity = list->capacity ? list->capacity * 2 : LISTING_ENTRIES_INITIAL;
+                size_t *offsets = realloc(list->offsets, capacity * sizeof(size_t));
+                if (offsets == NULL) {
+                    return -1;
+                }
+                list->offsets = offsets;
+                list->capacity = capacity;
+            }
+            list->offsets[list->count ++] = list->segment;
+            list->segment = list->arena_used;
+            added ++;
+        } else if (!listing_append(list, c)) {
+            return -1;
+        }
+    }
+    return added;
+}
+
+
+/**
+ * Get an entry in file listing
+ * 
+ * @param list The listing
+ * @param index The index of the entry, from 0
+ * @return The file name, NULL if index is out of range
+ */
+const char *get_file_listing_entry(const FileListing *list, int index) {
+    return index >= 0 && index < list->count ? list->arena + list->offsets[index] : NULL;
+}
+
+
+/**
+ * List files in a directory on Witty Pi disk, the download stream is parsed chunk by chunk while being read
+ * 
+ * @param dir The directory, see DIRECTORY_???
+ * @param list The listing to fill, initialized by init_file_listing()
+ * @param filter Called for each entry once downloaded, return false to leave it out; can be NULL
+ * @param arg The argument for filter
+ * @return true if the whole listing is downloaded, false otherwise
+ */
+bool download_file_listing(uint8_t dir, FileListing *list, ListingFilter filter, void *arg) {
+    int i2c_dev = open_i2c_device();
+    if (i2c_dev < 0) {
+        return false;
+    }
+    bool success = i2c_set(i2c_dev, I2C_ADMIN_DIR, dir)
+                   && run_admin_command_wait(I2C_ADMIN_PWD_CMD_LIST_FILES, LISTING_TIMEOUT_MS, NULL) == ADMIN_DONE;
+    uint8_t chunk[LISTING_CHUNK_SIZE];
+    for (int total = 0; success && !list->complete; total += LISTING_CHUNK_SIZE) {
+        int len = total < LISTING_MAX_BYTES ? i2c_read_stream_util(i2c_dev, I2C_ADMIN_DOWNLOAD, chunk, LISTING_CHUNK_SIZE, LIST_END) : -1;
+        success = len > 0 && feed_file_listing(list, chunk, len, filter, arg) >= 0;
+    }
+    close_i2c_device(i2c_dev);
+    if (!success) {
+        print_log_level(LOG_LEVEL_WARNING, "Failed to list files in directory %d.\n", dir);
+    }
+    return success;
+}
+
+
+// Filter that also writes each downloaded entry into the cache file
+typedef struct {
+    ListingFilter filter;
+    void *arg;
+    FILE *fp;
+} CachingFilter;
+
+static bool cache_listing_entry(const char *name, int index, void *arg) {
+    CachingFilter *caching = arg;
+    if (caching->fp) {
+        fprintf(caching->fp, "%s%c", name, LIST_DELIMITER);
+    }
+    return caching->filter ? caching->filter(name, index, caching->arg) : true;
+}
+
+
+/**
+ * List files in a directory on Witty Pi disk, from cache if it is fresh, otherwise download and cache it
+ * The cache is shared by processes of the same user, and gets stale after administrative commands that may write files
+ * 
+ * @param dir The directory, see DIRECTORY_???
+ * @param list The listing to fill, initialized by init_file_listing()
+ * @param filter Called for each entry, return false to leave it out; can be NULL
+ * @param arg The argument for filter
+ * @param cached Pointer to store whether the listing comes from cache, can be NULL
+ * @return true if succeed, false otherwise
+ */
+bool get_file_listing(uint8_t dir, FileListing *list, ListingFilter filter, void *arg, bool *cached) {
+    char path[64], tmp_path[72];
+    snprintf(path, sizeof(path), LISTING_CACHE_PATH, (unsigned)geteuid(), dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+    if (cached) {
+        *cached = false;
+    }
+    uint32_t generation = 0;
+    bool shared = get_listing_generation(&generation);
+    
+    // Try the cache first, its header is the generation it was listed in
+    struct stat st;
+    unsigned cache_generation;
+    FILE *fp = fopen(path, "r");
+    if (fp && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid()    // Not planted by another user
+        && time(NULL) - st.st_mtime < LISTING_CACHE_TTL_SEC
+        && fscanf(fp, "%u ", &cache_generation) == 1 && (!shared || cache_generation == generation)) {
+        uint8_t chunk[LISTING_CHUNK_SIZE];
+        size_t len;
+        while (!list->complete && (len = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+            if (feed_file_listing(list, chunk, len, filter, arg) < 0) {
+                break;
+            }
+        }
+        fclose(fp);
+        if (list->complete) {
+            if (cached) {
+                *cached = true;
+            }
+            return true;
+        }
+        free_file_listing(list);    // Broken cache file, download again
+    } else if (fp) {
+        fclose(fp);
+    }
+    
+    // Download and write the entries into cache along the way
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    CachingFilter caching = { filter, arg, fd >= 0 ? fdopen(fd, "w") : NULL };
+    if (caching.fp) {
+        fprintf(caching.fp, "%u\n%c", (unsigned)generation, LIST_BEGIN);
+    }
+    bool success = download_file_listing(dir, list, cache_listing_entry, &caching);
+    if (caching.fp) {
+        fputc(LIST_END, caching.fp);
+        if (fclose(caching.fp) == 0 && success) {
+            rename(tmp_path, path);
+        } else {
+            unlink(tmp_path);
+        }
+    }
+    return success;
+}
+
+
 /**
  * Check if schedule script is in use
  * 
@@ -18,6 +18,9 @@
 #define I2C_DEVICE              "/dev/i2c-1"
 #define I2C_SLAVE_ADDR          0x51
 #define I2C_LOCK                "/var/lock/wittypi5_i2c.lock"
+#define I2C_ARBITER             "/wp5_i2c_arbiter"     // Shared memory object in /dev/shm
+#define I2C_SNAPSHOT            "/wp5_snapshot"        // Shared memory object in /dev/shm, published by wp5d
+#define I2C_SNAPSHOT_VIEWER     "/wp5_snapshot_viewer" // Shared memory object in /dev/shm, touched by viewers of the snapshot
 
 /*
  * read-only registers
@@ -155,6 +158,96 @@
 #define I2C_VREG_LAST                       103 // ------
 
 
+/*
+ * Register schema, one row for each value stored in the registers:
+ *
+ *   X(id, index, codec, scale, min, max, access, volatility, unit, label)
+ *
+ * id          Name of the value, REG_<id> in RegisterId
+ * index       Index of the (first) register
+ * codec       U8, S8 (signed), BCD, U15 (MSB/LSB pair, MSB bit 7 reserved) or S12 (TMP112 left justified, signed)
+ * scale       Raw value divided by scale gives the value in unit
+ * min, max    Range of the value in unit, writing a value out of range is rejected
+ * access      RO, WO or RW
+ * volatility  STATIC (fixed for the firmware), CONFIG (changes only when written), LIVE (measurement or state),
+ *             CLOCK (time fields, changing by itself) or COMMAND (side effect on access, never batched)
+ * unit, label For formatting
+ *
+ * A new register only needs a row here, accessors, batching and formatting are generated from it.
+ */
+#define WP5_REGISTERS(X) \
+    X(FW_ID,                  I2C_FW_ID,                  U8,  1,    0,      255,      RO, STATIC,  "",    "Firmware id") \
+    X(FW_VERSION_MAJOR,       I2C_FW_VERSION_MAJOR,       U8,  1,    0,      255,      RO, STATIC,  "",    "Firmware major version") \
+    X(FW_VERSION_MINOR,       I2C_FW_VERSION_MINOR,       U8,  1,    0,      255,      RO, STATIC,  "",    "Firmware minor version") \
+    X(VUSB,                   I2C_VUSB_MV_MSB,            U15, 1000, 0,      32.767,   RO, LIVE,    "V",   "V-USB") \
+    X(VIN,                    I2C_VIN_MV_MSB,             U15, 1000, 0,      32.767,   RO, LIVE,    "V",   "V-IN") \
+    X(VOUT,                   I2C_VOUT_MV_MSB,            U15, 1000, 0,      32.767,   RO, LIVE,    "V",   "V-OUT") \
+    X(IOUT,                   I2C_IOUT_MA_MSB,            U15, 1000, 0,      32.767,   RO, LIVE,    "A",   "I-OUT") \
+    X(POWER_MODE,             I2C_POWER_MODE,             U8,  1,    0,      1,        RO, LIVE,    "",    "Power mode (0=V-USB, 1=V-IN)") \
+    X(MISSED_HEARTBEAT,       I2C_MISSED_HEARTBEAT,       U8,  1,    0,      255,      RO, LIVE,    "",    "Missed heartbeats") \
+    X(RPI_STATE,              I2C_RPI_STATE,              U8,  1,    0,      3,        RO, LIVE,    "",    "Raspberry Pi state") \
+    X(ACTION_REASON,          I2C_ACTION_REASON,          U8,  1,    0,      255,      RO, LIVE,    "",    "Latest action reasons") \
+    X(MISC,                   I2C_MISC,                   U8,  1,    0,      255,      RO, LIVE,    "",    "Miscellaneous state") \
+    X(CONF_ADDRESS,           I2C_CONF_ADDRESS,           U8,  1,    0x08,   0x77,     RW, CONFIG,  "",    "I2C slave address") \
+    X(CONF_DEFAULT_ON_DELAY,  I2C_CONF_DEFAULT_ON_DELAY,  U8,  1,    0,      255,      RW, CONFIG,  "s",   "Default ON delay (255=default OFF)") \
+    X(CONF_POWER_CUT_DELAY,   I2C_CONF_POWER_CUT_DELAY,   U8,  1,    0,      255,      RW, CONFIG,  "s",   "Power cut delay after shutdown") \
+    X(CONF_PULSE_INTERVAL,    I2C_CONF_PULSE_INTERVAL,    U8,  1,    0,      255,      RW, CONFIG,  "s",   "Pulsing interval during sleep") \
+    X(CONF_BLINK_LED,         I2C_CONF_BLINK_LED,         U8,  1,    0,      255,      RW, CONFIG,  "ms",  "White LED pulse length") \
+    X(CONF_DUMMY_LOAD,        I2C_CONF_DUMMY_LOAD,        U8,  1,    0,      255,      RW, CONFIG,  "ms",  "Dummy load pulse length") \
+    X(CONF_LOW_VOLTAGE,       I2C_CONF_LOW_VOLTAGE,       U8,  10,   0,      25.5,     RW, CONFIG,  "V",   "Low voltage threshold (0=disabled)") \
+    X(CONF_RECOVERY_VOLTAGE,  I2C_CONF_RECOVERY_VOLTAGE,  U8,  10,   0,      25.5,     RW, CONFIG,  "V",   "Recovery voltage threshold (0=disabled)") \
+    X(CONF_PS_PRIORITY,       I2C_CONF_PS_PRIORITY,       U8,  1,    0,      1,        RW, CONFIG,  "",    "Power source priority (0=V-USB, 1=V-IN)") \
+    X(CONF_ADJ_VUSB,          I2C_CONF_ADJ_VUSB,          S8,  100,  -1.27,  1.27,     RW, CONFIG,  "V",   "V-USB adjustment") \
+    X(CONF_ADJ_VIN,           I2C_CONF_ADJ_VIN,           S8,  100,  -1.27,  1.27,     RW, CONFIG,  "V",   "V-IN adjustment") \
+    X(CONF_ADJ_VOUT,          I2C_CONF_ADJ_VOUT,          S8,  100,  -1.27,  1.27,     RW, CONFIG,  "V",   "V-OUT adjustment") \
+    X(CONF_ADJ_IOUT,          I2C_CONF_ADJ_IOUT,          S8,  1000, -0.127, 0.127,    RW, CONFIG,  "A",   "I-OUT adjustment") \
+    X(CONF_WATCHDOG,          I2C_CONF_WATCHDOG,          U8,  1,    0,      255,      RW, CONFIG,  "",    "Allowed missing heartbeats (0=disabled)") \
+    X(CONF_LOG_TO_FILE,       I2C_CONF_LOG_TO_FILE,       U8,  1,    0,      1,        RW, CONFIG,  "",    "Log to file on Witty Pi") \
+    X(CONF_BOOTSEL_FTY_RST,   I2C_CONF_BOOTSEL_FTY_RST,   U8,  1,    0,      1,        RW, CONFIG,  "",    "Allow factory reset with BOOTSEL") \
+    X(CONF_ALARM1_SECOND,     I2C_CONF_ALARM1_SECOND,     BCD, 1,    0,      59,       RW, CONFIG,  "",    "Startup alarm second") \
+    X(CONF_ALARM1_MINUTE,     I2C_CONF_ALARM1_MINUTE,     BCD, 1,    0,      59,       RW, CONFIG,  "",    "Startup alarm minute") \
+    X(CONF_ALARM1_HOUR,       I2C_CONF_ALARM1_HOUR,       BCD, 1,    0,      23,       RW, CONFIG,  "",    "Startup alarm hour") \
+    X(CONF_ALARM1_DAY,        I2C_CONF_ALARM1_DAY,        BCD, 1,    0,      31,       RW, CONFIG,  "",    "Startup alarm day (0=cleared)") \
+    X(CONF_ALARM2_SECOND,     I2C_CONF_ALARM2_SECOND,     BCD, 1,    0,      59,       RW, CONFIG,  "",    "Shutdown alarm second") \
+    X(CONF_ALARM2_MINUTE,     I2C_CONF_ALARM2_MINUTE,     BCD, 1,    0,      59,       RW, CONFIG,  "",    "Shutdown alarm minute") \
+    X(CONF_ALARM2_HOUR,       I2C_CONF_ALARM2_HOUR,       BCD, 1,    0,      23,       RW, CONFIG,  "",    "Shutdown alarm hour") \
+    X(CONF_ALARM2_DAY,        I2C_CONF_ALARM2_DAY,        BCD, 1,    0,      31,       RW, CONFIG,  "",    "Shutdown alarm day (0=cleared)") \
+    X(CONF_BELOW_TEMP_ACTION, I2C_CONF_BELOW_TEMP_ACTION, U8,  1,    0,      2,        RW, CONFIG,  "",    "Below temperature action") \
+    X(CONF_BELOW_TEMP_POINT,  I2C_CONF_BELOW_TEMP_POINT,  S8,  1,    -127,   127,      RW, CONFIG,  "°C",  "Below temperature set point") \
+    X(CONF_OVER_TEMP_ACTION,  I2C_CONF_OVER_TEMP_ACTION,  U8,  1,    0,      2,        RW, CONFIG,  "",    "Over temperature action") \
+    X(CONF_OVER_TEMP_POINT,   I2C_CONF_OVER_TEMP_POINT,   S8,  1,    -127,   127,      RW, CONFIG,  "°C",  "Over temperature set point") \
+    X(CONF_DST_OFFSET,        I2C_CONF_DST_OFFSET,        U8,  1,    0,      255,      RW, CONFIG,  "",    "DST mode and offset") \
+    X(CONF_DST_BEGIN_MON,     I2C_CONF_DST_BEGIN_MON,     BCD, 1,    0,      12,       RW, CONFIG,  "",    "DST begin month") \
+    X(CONF_DST_BEGIN_DAY,     I2C_CONF_DST_BEGIN_DAY,     U8,  1,    0,      255,      RW, CONFIG,  "",    "DST begin day") \
+    X(CONF_DST_BEGIN_HOUR,    I2C_CONF_DST_BEGIN_HOUR,    BCD, 1,    0,      23,       RW, CONFIG,  "",    "DST begin hour") \
+    X(CONF_DST_BEGIN_MIN,     I2C_CONF_DST_BEGIN_MIN,     BCD, 1,    0,      59,       RW, CONFIG,  "",    "DST begin minute") \
+    X(CONF_DST_END_MON,       I2C_CONF_DST_END_MON,       BCD, 1,    0,      12,       RW, CONFIG,  "",    "DST end month") \
+    X(CONF_DST_END_DAY,       I2C_CONF_DST_END_DAY,       U8,  1,    0,      255,      RW, CONFIG,  "",    "DST end day") \
+    X(CONF_DST_END_HOUR,      I2C_CONF_DST_END_HOUR,      BCD, 1,    0,      23,       RW, CONFIG,  "",    "DST end hour") \
+    X(CONF_DST_END_MIN,       I2C_CONF_DST_END_MIN,       BCD, 1,    0,      59,       RW, CONFIG,  "",    "DST end minute") \
+    X(CONF_DST_APPLIED,       I2C_CONF_DST_APPLIED,       U8,  1,    0,      1,        RW, LIVE,    "",    "DST applied") \
+    X(CONF_SYS_CLOCK_MHZ,     I2C_CONF_SYS_CLOCK_MHZ,     U8,  1,    0,      255,      RW, CONFIG,  "MHz", "System clock of RP2350") \
+    X(ADMIN_DIR,              I2C_ADMIN_DIR,              U8,  1,    0,      255,      RW, COMMAND, "",    "Directory") \
+    X(ADMIN_CONTEXT,          I2C_ADMIN_CONTEXT,          U8,  1,    0,      255,      RW, COMMAND, "",    "Command context") \
+    X(ADMIN_DOWNLOAD,         I2C_ADMIN_DOWNLOAD,         U8,  1,    0,      255,      RO, COMMAND, "",    "Download stream") \
+    X(ADMIN_UPLOAD,           I2C_ADMIN_UPLOAD,           U8,  1,    0,      255,      WO, COMMAND, "",    "Upload stream") \
+    X(ADMIN_PASSWORD,         I2C_ADMIN_PASSWORD,         U8,  1,    0,      255,      WO, COMMAND, "",    "Command password") \
+    X(ADMIN_COMMAND,          I2C_ADMIN_COMMAND,          U8,  1,    0,      255,      RW, COMMAND, "",    "Command") \
+    X(ADMIN_HEARTBEAT,        I2C_ADMIN_HEARTBEAT,        U8,  1,    0,      255,      RW, COMMAND, "",    "Heartbeat") \
+    X(ADMIN_SHUTDOWN,         I2C_ADMIN_SHUTDOWN,         U8,  1,    0,      255,      RW, COMMAND, "",    "Shutdown request") \
+    X(RTC_SEC,                I2C_VREG_RX8025_SEC,        BCD, 1,    0,      59,       RW, CLOCK,   "",    "RTC second") \
+    X(RTC_MIN,                I2C_VREG_RX8025_MIN,        BCD, 1,    0,      59,       RW, CLOCK,   "",    "RTC minute") \
+    X(RTC_HOUR,               I2C_VREG_RX8025_HOUR,       BCD, 1,    0,      23,       RW, CLOCK,   "",    "RTC hour") \
+    X(RTC_WEEKDAY,            I2C_VREG_RX8025_WEEKDAY,    U8,  1,    0,      127,      RW, CLOCK,   "",    "RTC weekday (bit mask)") \
+    X(RTC_DAY,                I2C_VREG_RX8025_DAY,        BCD, 1,    1,      31,       RW, CLOCK,   "",    "RTC day") \
+    X(RTC_MONTH,              I2C_VREG_RX8025_MONTH,      BCD, 1,    1,      12,       RW, CLOCK,   "",    "RTC month") \
+    X(RTC_YEAR,               I2C_VREG_RX8025_YEAR,       BCD, 1,    0,      99,       RW, CLOCK,   "",    "RTC year (since 2000)") \
+    X(RTC_RAM,                I2C_VREG_RX8025_RAM,        U8,  1,    0,      255,      RW, CONFIG,  "",    "RTC RAM") \
+    X(TEMPERATURE,            I2C_VREG_TMP112_TEMP_MSB,   S12, 16,   -128,   127.9375, RO, LIVE,    "°C",  "Temperature") \
+    X(TEMP_LOW_LIMIT,         I2C_VREG_TMP112_TLOW_MSB,   S12, 16,   -128,   127.9375, RW, CONFIG,  "°C",  "Temperature sensor low limit") \
+    X(TEMP_HIGH_LIMIT,        I2C_VREG_TMP112_THIGH_MSB,  S12, 16,   -128,   127.9375, RW, CONFIG,  "°C",  "Temperature sensor high limit")
+
+
 /*
  * I2C administrative command form: 2 bytes (password + command)
  * When writing it via I2C, make sure to write password byte first
@@ -236,6 +329,45 @@ typedef enum {
     LOG_NONE,
 } LogMode;
 
+// Log level
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} LogLevel;
+
+// Board connection state
+typedef enum {
+    BOARD_ABSENT,
+    BOARD_PROBING,
+    BOARD_CONNECTED,
+    BOARD_LOST,
+} BoardState;
+
+// Result of run_admin_command_wait()
+typedef enum {
+    ADMIN_DONE,                     // Command is cleared by firmware (and board is back if firmware reloads)
+    ADMIN_TIMEOUT,                  // Command is not done in time
+    ADMIN_FAILED,                   // Command could not be sent
+} AdminResult;
+
+// File names from a directory listing on Witty Pi disk, see download_file_listing()
+typedef struct {
+    char *arena;                    // Names, each terminated by '\0'
+    size_t arena_used;
+    size_t arena_size;
+    size_t *offsets;                // Offset of each name in arena
+    int count;                      // Number of names
+    int capacity;
+    size_t segment;                 // Offset of the field being parsed
+    bool started;                   // LIST_BEGIN is parsed
+    bool complete;                  // LIST_END is parsed
+} FileListing;
+
+// Called for each entry of file listing once parsed, return false to leave it out
+typedef bool (*ListingFilter)(const char *name, int index, void *arg);
+
 // DateTime structure
 typedef struct {
     int16_t year;   // 2000~2099
@@ -247,6 +379,186 @@ typedef struct {
     int8_t wday;    // 0~6 (Sunday~Saturday)
 } DateTime;
 
+// Library context, see wp5_ctx_new()
+typedef struct wp5_ctx wp5_ctx;
+
+// Receiver of log messages from operations on a context
+typedef void (*Wp5LogSink)(LogLevel level, const char *message, void *user_data);
+
+// Statistics of operations on a context
+typedef struct {
+    unsigned long operations;       // Register reads and writes
+    unsigned long attempts;         // Attempts made by the operations, including retries
+    unsigned long failures;         // Operations that failed
+} Wp5Stats;
+
+// Transaction classes for latency statistics
+typedef enum {
+    TX_READ,                        // Single register read
+    TX_VALIDATED_READ,              // Register read with validation
+    TX_WRITE,                       // Single register write
+    TX_VALIDATED_WRITE,             // Register write with read back
+    TX_RANGE_READ,                  // Multiple registers read in batch
+    TX_BATCH_WRITE,                 // Multiple registers written and read back in batch
+    TX_STREAM_CHUNK,                // One byte of upload or download stream
+    TX_CLASS_COUNT,
+} TxClass;
+
+// Latency statistics of a transaction class
+typedef struct {
+    unsigned long count;            // Number of operations
+    double p50_us;                  // Median latency
+    double p99_us;                  // 99th percentile latency
+    double max_us;                  // Max latency
+    double sum_us;                  // Sum of latencies
+} LatencyStats;
+
+// Metrics of I2C bus recovery
+typedef struct {
+    int attempts;                   // Recoveries started
+    int recovered;                  // Recoveries succeeded
+    int failed;                     // Recoveries that ran out of time budget
+    int adapter_resets;             // Times the I2C controller was reset
+    int last_ms;                    // Time to recover of the last successful recovery
+    int max_ms;                     // Longest time to recover
+    long total_ms;                  // Sum of time to recover, for the mean
+} RecoveryStats;
+
+// Statistics of the I2C bus arbiter, shared by all processes
+typedef struct {
+    unsigned long acquisitions;     // Times the bus was acquired
+    unsigned long contended;        // Acquisitions that found the bus held or other waiters
+    unsigned long priority_handoffs;// High priority waiters queued ahead of normal ones
+    unsigned long owner_dead;       // Times the bus was recovered from a process that died holding it
+    unsigned long waiters_dead;     // Crashed processes removed from the queue
+    uint64_t wait_us_total;         // Sum of time waited for the bus
+    uint64_t wait_us_max;           // Longest time waited for the bus
+    int waiters;                    // Processes waiting now
+    int holder;                     // Process holding the bus now, 0 if free
+} ArbiterStats;
+
+// Retry policy for I2C register access
+typedef struct {
+    int read_max_attempts;          // Max attempts to read a register
+    int read_validate_count;        // Identical readings required for validated read
+    int write_max_attempts;         // Max attempts to write a register
+    int retry_delay_us;             // Delay before retrying a failed transaction
+    int write_validate_delay_us;    // Delay between write and read back
+    bool adaptive;                  // Skip validation of single register reads on clean bus, back off exponentially with jitter on errors
+    int retry_delay_max_us;         // Max delay when backing off
+    int breaker_threshold;          // Failed operations in a row that open the circuit breaker, 0 to disable
+    int breaker_cooldown_ms;        // Initial time the circuit breaker stays open, doubles while bus is dead
+} RetryPolicy;
+
+// Fault probabilities (0~1) of simulated transport
+typedef struct {
+    double nak;                     // Transaction not acknowledged
+    double bit_flip;                // One bit of a read byte flipped
+    double stuck;                   // Read returns previous byte on the bus, or write is not taken
+    double stretch;                 // Slave stretches the clock
+    int stretch_us;                 // Duration of clock stretching
+    double contention;              // I2C lock held by another process
+    int contention_us;              // Time the lock is held by another process
+} SimFaults;
+
+// Result of retry policy benchmark
+typedef struct {
+    int operations;                 // Register reads and writes performed
+    int succeeded;                  // Operations that reported success with correct value
+    int failed;                     // Operations that reported failure
+    int corrupted;                  // Operations that reported success with wrong value
+    double mean_us;                 // Mean latency of operations
+    double p99_us;                  // 99th percentile latency of operations
+    double amplification;           // Bus transactions per operation
+} BenchResult;
+
+// Encoding of register values, see WP5_REGISTERS
+typedef enum {
+    REG_CODEC_U8,                   // Unsigned byte
+    REG_CODEC_S8,                   // Signed byte
+    REG_CODEC_BCD,                  // Binary-coded decimal byte
+    REG_CODEC_U15,                  // MSB and LSB in two registers, bit 7 of MSB reserved
+    REG_CODEC_S12,                  // Signed 12-bit, left justified in MSB and LSB (TMP112)
+} RegisterCodec;
+
+// Access to register values
+typedef enum {
+    REG_ACCESS_RO = 1,
+    REG_ACCESS_WO = 2,
+    REG_ACCESS_RW = 3,
+} RegisterAccess;
+
+// How often register values change
+typedef enum {
+    REG_VOLATILITY_STATIC,          // Fixed for the firmware, may be cached forever
+    REG_VOLATILITY_CONFIG,          // Changes only when written, read with validation
+    REG_VOLATILITY_LIVE,            // Measurement or state, read without validation
+    REG_VOLATILITY_CLOCK,           // Changes by itself, read with validation so the fields are coherent
+    REG_VOLATILITY_COMMAND,         // Access has side effect, never batched or cached
+} RegisterVolatility;
+
+// Register values defined in WP5_REGISTERS
+#define REG_ENUM(id, ...) REG_##id,
+typedef enum {
+    WP5_REGISTERS(REG_ENUM)
+    REG_COUNT,
+} RegisterId;
+#undef REG_ENUM
+
+// Descriptor of a register value
+typedef struct {
+    const char *name;               // Name for command line
+    uint8_t index;                  // Index of the (first) register
+    uint8_t width;                  // Number of registers
+    RegisterCodec codec;
+    int scale;                      // Raw value divided by scale gives the value in unit
+    double min;                     // Range of the value in unit
+    double max;
+    RegisterAccess access;
+    RegisterVolatility volatility;
+    const char *unit;
+    const char *label;
+} RegisterInfo;
+
+// All registers in WP5_REGISTERS read at once, see get_register_snapshot()
+typedef struct {
+    uint8_t regs[I2C_VREG_LAST + 1];    // Indexed by register index, command registers are not read
+} RegisterSnapshot;
+
+// Register writes staged to be committed together, see reg_txn_commit()
+typedef struct {
+    int count;                              // Number of staged registers
+    uint8_t indexes[I2C_VREG_LAST + 1];     // Staged registers, in the order they will be written
+    uint8_t values[I2C_VREG_LAST + 1];
+    int written;                            // Registers that differed and were written by the last commit
+} RegisterTransaction;
+
+// Result of reg_txn_commit()
+typedef enum {
+    TXN_COMMITTED,                  // All staged values are on the board (written or already there)
+    TXN_FAILED,                     // Nothing written: nothing staged, or previous values could not be read
+    TXN_ROLLED_BACK,                // Verification failed, previous values are restored
+    TXN_ROLLBACK_FAILED,            // Verification failed, and previous values could not be restored
+} TxnResult;
+
+// Access of each register value as constant, for compile time check in GET_REGISTER() and SET_REGISTER()
+#define REG_ACCESS_ENUM(id, index, codec, scale, min, max, access, ...) REG_ACCESS_OF_##id = REG_ACCESS_##access,
+enum {
+    WP5_REGISTERS(REG_ACCESS_ENUM)
+};
+#undef REG_ACCESS_ENUM
+
+// Number of registers used by a codec
+#define REG_CODEC_WIDTH(codec) ((codec) == REG_CODEC_U15 || (codec) == REG_CODEC_S12 ? 2 : 1)
+
+// Read a register value by name, e.g. GET_REGISTER(VIN, &volts), fails to compile if the register is write-only
+#define GET_REGISTER(id, value) \
+    ((void)sizeof(char[(REG_ACCESS_OF_##id & REG_ACCESS_RO) ? 1 : -1]), get_register_value(REG_##id, (value)))
+
+// Write a register value by name, e.g. SET_REGISTER(CONF_LOW_VOLTAGE, 3.2), fails to compile if the register is read-only
+#define SET_REGISTER(id, value) \
+    ((void)sizeof(char[(REG_ACCESS_OF_##id & REG_ACCESS_WO) ? 1 : -1]), set_register_value(REG_##id, (value)))
+
 // Witty Pi 5 models
 extern const char *wittypi_models[];
 extern const int wittypi_models_count;
@@ -255,6 +567,12 @@ extern const int wittypi_models_count;
 extern const char *action_reasons[];
 extern const int action_reasons_count;
 
+// Names of transaction classes
+extern const char *tx_class_names[];
+
+// Descriptors of register values, indexed by RegisterId
+extern const RegisterInfo register_table[];
+
 
 /**
  * Get actual value for a binary-coded decimal (BCD) byte
@@ -278,6 +596,82 @@ static inline uint8_t dec_to_bcd(uint8_t dec) {
 }
 
 
+/**
+ * Decode a register value from raw register bytes
+ * 
+ * @param reg The register descriptor
+ * @param raw The raw bytes, reg->width of them
+ * @return The value in unit
+ */
+static inline double decode_register_value(const RegisterInfo *reg, const uint8_t *raw) {
+    int value;
+    switch (reg->codec) {
+        case REG_CODEC_S8:
+            value = (int8_t)raw[0];
+            break;
+        case REG_CODEC_BCD:
+            value = bcd_to_dec(raw[0]);
+            break;
+        case REG_CODEC_U15:
+            value = ((raw[0] & 0x7F) << 8) | raw[1];
+            break;
+        case REG_CODEC_S12:
+            value = (int16_t)((raw[0] << 8) | raw[1]) >> 4;
+            break;
+        default:
+            value = raw[0];
+            break;
+    }
+    return (double)value / reg->scale;
+}
+
+
+/**
+ * Get a register value from a snapshot
+ * 
+ * @param snap The snapshot
+ * @param id The register value
+ * @return The value in unit
+ */
+static inline double snapshot_value(const RegisterSnapshot *snap, RegisterId id) {
+    return decode_register_value(&register_table[id], &snap->regs[register_table[id].index]);
+}
+
+
+/**
+ * Encode a register value into raw register bytes
+ * 
+ * @param reg The register descriptor
+ * @param value The value in unit
+ * @param raw Buffer to store the raw bytes, with at least reg->width bytes
+ * @return true if the value is in range, otherwise false
+ */
+static inline bool encode_register_value(const RegisterInfo *reg, double value, uint8_t *raw) {
+    if (!(value >= reg->min && value <= reg->max)) {
+        return false;
+    }
+    double scaled = value * reg->scale;
+    int ival = (int)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+    switch (reg->codec) {
+        case REG_CODEC_BCD:
+            raw[0] = dec_to_bcd((uint8_t)ival);
+            break;
+        case REG_CODEC_U15:
+            raw[0] = (ival >> 8) & 0x7F;
+            raw[1] = ival & 0xFF;
+            break;
+        case REG_CODEC_S12:
+            raw[0] = (ival >> 4) & 0xFF;
+            raw[1] = (ival << 4) & 0xF0;
+            break;
+        default:
+            raw[0] = (uint8_t)ival;
+            break;
+    }
+    return true;
+}
+
+
 /**
  * Set log mode
  * 
@@ -286,6 +680,31 @@ static inline uint8_t dec_to_bcd(uint8_t dec) {
 void set_log_mode(LogMode mode);
 
 
+/**
+ * Set log level, messages less important than this level are discarded
+ * 
+ * @param level The log level to be used
+ */
+void set_log_level(LogLevel level);
+
+
+/**
+ * Enable or disable asynchronous logging
+ * When enabled, messages are formatted into a preallocated ring buffer and written by a
+ * background thread, so logging never blocks the caller. Consecutive repeated messages
+ * are folded and the output rate is limited.
+ * 
+ * @param async true to enable asynchronous logging
+ */
+void set_log_async(bool async);
+
+
+/**
+ * Flush pending log messages and stop the background writer
+ */
+void flush_log(void);
+
+
 /**
  * Print log function that accepts same arguments as printf
  * 
@@ -296,6 +715,140 @@ void set_log_mode(LogMode mode);
 int print_log(const char *format, ...);
 
 
+/**
+ * Print log with specific level, accepts same arguments as printf after level
+ * 
+ * @param level The log level of this message
+ * @param format Format string in printf style
+ * @param ... Variable arguments for the format string
+ * @return Number of characters printed (excluding null byte)
+ */
+int print_log_level(LogLevel level, const char *format, ...);
+
+
+/**
+ * Start recording bus activity into a file in Chrome trace-event JSON format
+ * The file can be loaded by chrome://tracing or https://ui.perfetto.dev
+ * 
+ * @param path The path of the trace file
+ * @return true if succeed, otherwise false
+ */
+bool start_trace_recording(const char * path);
+
+
+/**
+ * Stop recording and close the trace file
+ */
+void stop_trace_recording(void);
+
+
+/**
+ * Begin a named span in the trace (e.g. a session), spans can be nested
+ * 
+ * @param name The name of the span
+ */
+void trace_begin(const char * name);
+
+
+/**
+ * End the span most recently begun with the same name
+ * 
+ * @param name The name of the span
+ */
+void trace_end(const char * name);
+
+
+/**
+ * Start capturing every I2C transaction (request and response bytes with timing) into a binary trace file
+ * The file can be replayed later with use_replay_transport()
+ * 
+ * @param path The path of the capture file
+ * @return true if succeed, otherwise false
+ */
+bool start_capture(const char * path);
+
+
+/**
+ * Stop capturing and close the capture file
+ */
+void stop_capture(void);
+
+
+/**
+ * Replace the I2C adapter with a trace captured by start_capture(), the recorded responses will be
+ * fed back in order. Requests that differ from the recording are resynchronized by looking ahead,
+ * and fail with EIO if no matching record is found.
+ * 
+ * @param path The path of the capture file
+ * @param realtime Whether to take the recorded time for each transaction
+ * @return true if succeed, otherwise false
+ */
+bool use_replay_transport(const char * path, bool realtime);
+
+
+/**
+ * Get statistics of the replay transport
+ * 
+ * @param matched Pointer to store the number of transactions answered from the recording
+ * @param mismatched Pointer to store the number of transactions that found no matching record
+ * @param skipped Pointer to store the number of records skipped while resynchronizing
+ * @param remaining Pointer to store the number of records not yet consumed
+ */
+void get_replay_stats(int *matched, int *mismatched, int *skipped, int *remaining);
+
+
+/**
+ * Replace the I2C adapter with a simulated Witty Pi that injects faults, for benchmarking retry policies
+ * 
+ * @param faults The probabilities of faults
+ * @param seed Seed of the fault generator, same seed produces same faults
+ */
+void use_simulated_transport(const SimFaults *faults, unsigned int seed);
+
+
+/**
+ * Get the retry policy for I2C register access
+ * 
+ * @param policy Pointer to store the retry policy
+ */
+void get_retry_policy(RetryPolicy *policy);
+
+
+/**
+ * Set the retry policy for I2C register access
+ * 
+ * @param policy The retry policy
+ */
+void set_retry_policy(const RetryPolicy *policy);
+
+
+/**
+ * Get latency statistics of a transaction class, over the current and previous windows
+ * 
+ * @param tx_class The transaction class
+ * @param stats Pointer to store the statistics
+ */
+void get_latency_stats(TxClass tx_class, LatencyStats *stats);
+
+
+/**
+ * Start a new latency window, statistics cover the current and previous windows
+ */
+void rotate_latency_window(void);
+
+
+/**
+ * Benchmark a retry policy by doing validated reads and writes on simulated transport
+ * use_simulated_transport() should be called first
+ * 
+ * @param policy The retry policy to benchmark
+ * @param operations The number of operations to perform
+ * @param result Pointer to store the result
+ * @return true if succeed, false if simulated transport is not in use
+ */
+bool benchmark_retry_policy(const RetryPolicy *policy, int operations, BenchResult *result);
+
+
 /**
  * Print system information
  */
@@ -318,6 +871,39 @@ void print_pi_info(void);
 uint8_t calculate_crc8(const uint8_t *data, size_t len);
 
 
+/**
+ * Set whether the calling thread gets the I2C bus ahead of waiters with normal priority
+ * 
+ * @param high true for high priority
+ */
+void set_i2c_priority(bool high);
+
+
+/**
+ * Also take the lock file while holding the I2C bus, for third-party tools that still use flock on it
+ * 
+ * @param enabled true to take the lock file too
+ */
+void set_flock_compat(bool enabled);
+
+
+/**
+ * Allow recovery to reset the I2C controller (unbind and bind its driver) when the bus looks stuck
+ * 
+ * @param enabled true to allow the reset
+ */
+void set_controller_reset(bool enabled);
+
+
+/**
+ * Get statistics of the I2C bus arbiter, shared by all processes
+ * 
+ * @param stats Pointer to store the statistics
+ * @return true if succeed, false if the arbiter is not available (lock file is used)
+ */
+bool get_arbiter_stats(ArbiterStats *stats);
+
+
 /**
  * Open I2C device
  * 
@@ -348,6 +934,21 @@ int i2c_get_impl(int i2c_dev, uint8_t index, bool validate);
 int i2c_get(int i2c_dev, uint8_t index);
 
 
+/**
+ * Read values from multiple I2C registers, batched into as few bus transactions as the adapter allows
+ * With validation, the whole batch is read again until consecutive readings are identical,
+ * so the values are also coherent with each other (e.g. RTC time does not roll over in between)
+ * 
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param indexes The indexes of the registers
+ * @param count The number of registers
+ * @param values Buffer to store the values, with at least count bytes
+ * @param validate Whether to validate the values
+ * @return true if read succesfully, false otherwise
+ */
+bool i2c_get_batch(int i2c_dev, const uint8_t *indexes, int count, uint8_t *values, bool validate);
+
+
 /**
  * Read data from specific I2C register until expected value is read
  * 
@@ -384,6 +985,255 @@ bool i2c_set_impl(int i2c_dev, uint8_t index, uint8_t value, bool validate);
 bool i2c_set(int i2c_dev, uint8_t index, uint8_t value);
 
 
+/**
+ * Write values to multiple I2C registers, batched into as few bus transactions as the adapter allows
+ * All registers are then read back in batch, and the whole batch is written again if any differs
+ * 
+ * @param i2c_dev The I2C device handler, use -1 to get one internally
+ * @param indexes The indexes of the registers
+ * @param values The values of the registers
+ * @param count The number of registers
+ * @return true if successfully written, false otherwise
+ */
+bool i2c_set_batch(int i2c_dev, const uint8_t *indexes, const uint8_t *values, int count);
+
+
+/**
+ * Get the default context, which is used by the functions without context argument
+ * 
+ * @return The default context
+ */
+wp5_ctx *wp5_default_ctx(void);
+
+
+/**
+ * Create a context, it has its own retry policy, bus health, log sink and statistics
+ * Operations on one context are serialized, so it can be shared by threads, or each thread can have its own
+ * 
+ * @return The context, or NULL if out of memory
+ */
+wp5_ctx *wp5_ctx_new(void);
+
+
+/**
+ * Free a context created by wp5_ctx_new(), and close its I2C device
+ * 
+ * @param ctx The context
+ */
+void wp5_ctx_free(wp5_ctx *ctx);
+
+
+/**
+ * Set the log sink of a context, messages (of all levels) from operations on the context go to the sink instead of stdout
+ * 
+ * @param ctx The context
+ * @param sink The function to receive messages, NULL to use the global log
+ * @param user_data Pointer passed to the sink
+ */
+void wp5_ctx_set_log_sink(wp5_ctx *ctx, Wp5LogSink sink, void *user_data);
+
+
+/**
+ * Set the retry policy of a context, bus health learned so far is discarded
+ * 
+ * @param ctx The context
+ * @param policy The retry policy
+ */
+void wp5_ctx_set_retry_policy(wp5_ctx *ctx, const RetryPolicy *policy);
+
+
+/**
+ * Get the statistics of a context
+ * 
+ * @param ctx The context
+ * @param stats Pointer to store the statistics
+ */
+void wp5_ctx_get_stats(wp5_ctx *ctx, Wp5Stats *stats);
+
+
+/**
+ * Read value from I2C register in a context
+ * 
+ * @param ctx The context
+ * @param index The index of the register
+ * @param validate Whether to validate the value
+ * @return The value if read succesfully, -1 otherwise
+ */
+int wp5_get(wp5_ctx *ctx, uint8_t index, bool validate);
+
+
+/**
+ * Read values from multiple I2C registers in a context, see i2c_get_batch()
+ * 
+ * @param ctx The context
+ * @param indexes The indexes of the registers
+ * @param count The number of registers
+ * @param values Buffer to store the values, with at least count bytes
+ * @param validate Whether to validate the values
+ * @return true if read succesfully, false otherwise
+ */
+bool wp5_get_batch(wp5_ctx *ctx, const uint8_t *indexes, int count, uint8_t *values, bool validate);
+
+
+/**
+ * Write value to I2C register in a context
+ * 
+ * @param ctx The context
+ * @param index The index of the register
+ * @param value The value of the register
+ * @param validate Whether to validate the value
+ * @return true if successfully written, false otherwise
+ */
+bool wp5_set(wp5_ctx *ctx, uint8_t index, uint8_t value, bool validate);
+
+
+/**
+ * Find a register value by name, case insensitive
+ * 
+ * @param name The name of the register value, as in WP5_REGISTERS
+ * @return The RegisterId, -1 if not found
+ */
+int find_register(const char *name);
+
+
+/**
+ * Read a register value, see GET_REGISTER() for reading by name
+ * 
+ * @param id The register value
+ * @param value Pointer to store the value in unit
+ * @return true if read succesfully, false otherwise
+ */
+bool get_register_value(RegisterId id, double *value);
+
+
+/**
+ * Read multiple register values in burst
+ * Values are grouped by volatility, so the static, config and clock values are read in one validated batch,
+ * and the live values in one batch without validation; command registers are read one by one
+ * 
+ * @param ids The register values, at most REG_COUNT
+ * @param count The number of register values
+ * @param values Buffer to store the values in unit, with at least count items
+ * @return true if read succesfully, false otherwise
+ */
+bool get_register_values(const RegisterId *ids, int count, double *values);
+
+
+/**
+ * Read all registers in WP5_REGISTERS (except command registers) at once, in a few batched transactions under one lock
+ * The static, config and clock registers are validated, the live ones are read once
+ * 
+ * @param snap Pointer to store the snapshot
+ * @return true if read succesfully, false otherwise
+ */
+bool get_register_snapshot(RegisterSnapshot *snap);
+
+
+/**
+ * Read only the live registers in WP5_REGISTERS at once, in one transaction, other registers are left zero
+ * 
+ * @param snap Pointer to store the snapshot
+ * @return true if read succesfully, false otherwise
+ */
+bool get_live_snapshot(RegisterSnapshot *snap);
+
+
+/**
+ * Get RTC time from a snapshot
+ * 
+ * @param snap The snapshot
+ * @param dt The DateTime object to save the result
+ */
+void snapshot_rtc_time(const RegisterSnapshot *snap, DateTime *dt);
+
+
+/**
+ * Publish a register snapshot in shared memory, for viewers such as "wp5 top"
+ * 
+ * @param snap The snapshot
+ * @return true if succeed, otherwise false
+ */
+bool publish_register_snapshot(const RegisterSnapshot *snap);
+
+
+/**
+ * Read the register snapshot published by wp5d, only if it is published by root
+ * 
+ * @param snap Pointer to store the snapshot
+ * @param sampled_us Pointer to store the monotonic time (in microseconds) when it was sampled
+ * @return true if succeed, false if nothing is published
+ */
+bool read_published_snapshot(RegisterSnapshot *snap, uint64_t *sampled_us);
+
+
+/**
+ * Get time since a viewer last read the published snapshot
+ * 
+ * @return Milliseconds since the last read, -1 if never read
+ */
+long published_snapshot_idle_ms(void);
+
+/**
+ * Write a register value, see SET_REGISTER() for writing by name
+ * 
+ * @param id The register value
+ * @param value The value in unit
+ * @return true if successfully written, false if failed, out of range or the register is read-only
+ */
+bool set_register_value(RegisterId id, double value);
+
+
+/**
+ * Format a register value with the precision of its scale and its unit, e.g. "+0.05V"
+ * 
+ * @param id The register value
+ * @param value The value in unit
+ * @param buf The buffer to store the string
+ * @param size The size of the buffer
+ * @return The length of the string, as snprintf()
+ */
+int format_register_value(RegisterId id, double value, char *buf, int size);
+
+/**
+ * Start a register transaction, with nothing staged
+ * 
+ * @param txn The transaction
+ */
+void reg_txn_begin(RegisterTransaction *txn);
+
+
+/**
+ * Stage a raw register value in a transaction, staging the same register again replaces its value
+ * 
+ * @param txn The transaction
+ * @param index The index of the register
+ * @param value The value of the register
+ * @return true if staged, false if the transaction is full
+ */
+bool reg_txn_stage(RegisterTransaction *txn, uint8_t index, uint8_t value);
+
+
+/**
+ * Stage a register value (in unit) in a transaction, range checked as in set_register_value()
+ * 
+ * @param txn The transaction
+ * @param id The register value, must be writable and not a command register
+ * @param value The value in unit
+ * @return true if staged, false if not writable or out of range
+ */
+bool reg_txn_stage_value(RegisterTransaction *txn, RegisterId id, double value);
+
+
+/**
+ * Commit a register transaction: read the previous values of the staged registers, write the ones that
+ * differ in one batch and read them all back. If they can not be verified, the previous values are written back.
+ * 
+ * @param txn The transaction, txn->written tells how many registers were written
+ * @return The result
+ */
+TxnResult reg_txn_commit(RegisterTransaction *txn);
+
+
 /**
  * Write data to specific I2C register until expected value appear
  * 
@@ -405,14 +1255,70 @@ int i2c_write_stream_util(int i2c_dev, uint8_t index, uint8_t * buf, int size, u
 void close_i2c_device(int i2c_dev);
 
 
+/**
+ * Update board connection state
+ * The board is probed only when it is not connected and the backoff time has passed,
+ * a connected board is considered lost after several consecutive failed transactions
+ * 
+ * @return The current board connection state
+ */
+BoardState update_board_state(void);
+
+
+/**
+ * Mark the board as lost, e.g. when its firmware is known to be rebooting
+ */
+void mark_board_lost(void);
+
+
+/**
+ * Wait until the board is connected
+ * 
+ * @param timeout_ms The maximum time to wait, in milliseconds
+ * @return true if connected, false if timeout
+ */
+bool wait_for_board(int timeout_ms);
+
+
 /**
  * Get Witty Pi model
+ * The model is cached while the board stays connected
  * 
  * @return The model of Witty Pi
  */
 int get_wittypi_model(void);
 
 
+/**
+ * Get firmware version of the connected board
+ * 
+ * @param major Pointer to store the major version
+ * @param minor Pointer to store the minor version
+ * @return true if board is connected and version is known, otherwise false
+ */
+bool get_firmware_version(int * major, int * minor);
+
+
+/**
+ * Recover from persistent I2C failures: close the device, reopen it and validate the board.
+ * If that is not enough and the adapter keeps timing out, reset the I2C adapter (where supported,
+ * only if allowed with set_controller_reset and never while the firmware may be reloading).
+ * All is done within a time budget.
+ * 
+ * @param i2c_dev The I2C device handler in use (will be closed), or -1
+ * @return The new I2C device handler if recovered, -1 otherwise
+ */
+int recover_i2c_device(int i2c_dev);
+
+
+/**
+ * Get metrics of I2C bus recovery
+ * 
+ * @param stats Pointer to store the metrics
+ */
+void get_recovery_stats(RecoveryStats *stats);
+
+
 /**
  * Get power mode
  * 
@@ -480,7 +1386,15 @@ bool get_system_time(DateTime * dt);
 
 
 /**
- * Get RTC time information
+ * Check if system time is synchronized (e.g. disciplined by NTP)
+ * 
+ * @return true if kernel reports synchronized clock, otherwise false
+ */
+bool is_system_time_synced(void);
+
+
+/**
+ * Get RTC time information, the clock registers are read in one burst until identical readings validate it
  * 
  * @param dt The DateTime object to save the result
  * @return true if succeed, otherwise false
@@ -505,6 +1419,14 @@ bool is_time_valid(DateTime * dt);
 bool system_to_rtc(void);
 
 
+/**
+ * Write system time into RTC, aligned to the second boundary of system time
+ * 
+ * @return true if succeed, otherwise false
+ */
+bool system_to_rtc_precise(void);
+
+
 /**
  * Write RTC time into system
  * 
@@ -513,6 +1435,33 @@ bool system_to_rtc(void);
 bool rtc_to_system(void);
 
 
+/**
+ * Measure the offset between RTC time and system time
+ * 
+ * @param offset Pointer to store the offset in seconds (RTC time minus system time)
+ * @return true if succeed, otherwise false
+ */
+bool get_rtc_offset(double * offset);
+
+
+/**
+ * Set the list of NTP servers used for network time synchronization
+ * 
+ * @param servers Comma separated list of "host" or "host:port", NULL to use default list
+ */
+void set_ntp_servers(const char * servers);
+
+
+/**
+ * Query the configured NTP servers in parallel and pick the best sample
+ * 
+ * @param offset Pointer to store the offset in seconds (server time minus system time)
+ * @param delay Pointer to store the round-trip delay in seconds, can be NULL
+ * @return true if at least one valid response is received, otherwise false
+ */
+bool sntp_query(double * offset, double * delay);
+
+
 /**
  * Write network time into system and RTC
  * 
@@ -628,6 +1577,80 @@ bool set_recovery_voltage_threshold(float threshold);
 bool run_admin_command(uint16_t psw_cmd);
 
 
+/**
+ * Run administrative command and wait for its completion
+ * The command register is polled with growing interval until the firmware clears it. For commands that
+ * make the firmware reload, it waits until the board is gone and connected again.
+ * 
+ * @param psw_cmd The 16 bit integer that stores password and command
+ * @param timeout_ms The maximum time to wait, in milliseconds
+ * @param elapsed_ms Pointer to store the elapsed time in milliseconds, can be NULL
+ * @return ADMIN_DONE, ADMIN_TIMEOUT, or ADMIN_FAILED if the command could not be sent
+ */
+AdminResult run_admin_command_wait(uint16_t psw_cmd, int timeout_ms, int *elapsed_ms);
+
+/**
+ * Initialize an empty file listing
+ * 
+ * @param list The listing
+ */
+void init_file_listing(FileListing *list);
+
+/**
+ * Release the memory of a file listing
+ * 
+ * @param list The listing
+ */
+void free_file_listing(FileListing *list);
+
+/**
+ * Parse the next part of a directory listing from the download stream
+ * Entries are available as soon as their delimiter is parsed, the field before LIST_END is not an entry
+ * 
+ * @param list The listing
+ * @param data The next part of the stream
+ * @param len The length of data
+ * @param filter Called for each entry once parsed, return false to leave it out; can be NULL
+ * @param arg The argument for filter
+ * @return The number of new entries, -1 if out of memory
+ */
+int feed_file_listing(FileListing *list, const uint8_t *data, int len, ListingFilter filter, void *arg);
+
+/**
+ * Get an entry in file listing
+ * 
+ * @param list The listing
+ * @param index The index of the entry, from 0
+ * @return The file name, NULL if index is out of range
+ */
+const char *get_file_listing_entry(const FileListing *list, int index);
+
+/**
+ * List files in a directory on Witty Pi disk, the download stream is parsed chunk by chunk while being read
+ * 
+ * @param dir The directory, see DIRECTORY_???
+ * @param list The listing to fill, initialized by init_file_listing()
+ * @param filter Called for each entry once downloaded, return false to leave it out; can be NULL
+ * @param arg The argument for filter
+ * @return true if the whole listing is downloaded, false otherwise
+ */
+bool download_file_listing(uint8_t dir, FileListing *list, ListingFilter filter, void *arg);
+
+
+/**
+ * List files in a directory on Witty Pi disk, from cache if it is fresh, otherwise download and cache it
+ * The cache is shared by processes of the same user, and is dropped after administrative commands that may write files
+ * 
+ * @param dir The directory, see DIRECTORY_???
+ * @param list The listing to fill, initialized by init_file_listing()
+ * @param filter Called for each entry, return false to leave it out; can be NULL
+ * @param arg The argument for filter
+ * @param cached Pointer to store whether the listing comes from cache, can be NULL
+ * @return true if succeed, false otherwise
+ */
+bool get_file_listing(uint8_t dir, FileListing *list, ListingFilter filter, void *arg, bool *cached);
+
+
 /**
  * Check if schedule script is in use
  * 